@@ -7,6 +7,7 @@
 .set CR0_PG_BIT,    0x80000000      # Enable paging
 .set CR0_WP_BIT,    0x00010000      # Enable write protection for kernel 
 .set CR4_PSE_BIT,   0x00000010      # Enable page size extension (4 MiB pages)
+.set CR4_PAE_BIT,   0x00000020      # Enable physical address extension
 
 .section .multiboot
 .align 8
@@ -29,6 +30,47 @@ _start:
 
     xorl %edi, %edi
     xorl %ebp, %ebp
+
+.ifdef CONFIG_PAE
+    # Fill the page directory pointer table with the four contiguous page
+    # directories, each one covering 1 GiB of the virtual address space.
+    movl $(kernel_pdpt - KERNEL_VBASE), %esi
+    movl $(kernel_pd - KERNEL_VBASE + 1), %eax
+    movl $4, %ecx
+.Lpdpt:
+    movl %eax, (%esi)       # Present
+    addl $8, %esi           # Move to the next PDPT entry
+    addl $0x1000, %eax      # Move to the next page directory
+    loop .Lpdpt
+
+    # Identity map the first 2 MiB of memory
+    movl $(kernel_pd - KERNEL_VBASE), %esi
+    movl %edi, (%esi)
+    orl $0x83,(%esi)
+
+    # Map the first 512 MiB of memory to the kernel address space with 2 MiB
+    # pages. Memory above is high memory and must be mapped with kmap(). The
+    # mappings are global, so they survive address space switches once PGE is
+    # enabled, unlike the temporary identity mapping.
+    addl $1536*8, %esi
+    movl $256, %ecx
+.L1:
+    movl %edi, (%esi)   # Set the page directory entry to the physical address
+    orl $0x183,(%esi)   # Present, read/write, 2 MiB page, global
+
+    addl $8, %esi           # Move to the next page directory entry
+    addl $0x200000, %edi    # Move to the next 2 MiB page
+    loop .L1                # Repeat for all 512 MiB of memory
+
+    # Load the physical address of the page directory pointer table into CR3
+    movl $(kernel_pdpt - KERNEL_VBASE), %edx
+    movl %edx, %cr3
+
+    # Enable physical address extension (PAE) and page size extension (PSE)
+    movl %cr4, %edx
+    orl $(CR4_PAE_BIT | CR4_PSE_BIT), %edx
+    movl %edx, %cr4
+.else
     movl $128, %ecx
 
     # Identity map the first 4 MiB of memory
@@ -37,13 +79,14 @@ _start:
     orl $0x83,(%esi)
 
     # Map the first 512 MiB of memory to the kernel address space. If
-    # there is more than 512 MiB of memory, the rest will not be accessible
-    # to the kernel. This is a serious limitation, but it is good enough
-    # for now.
+    # there is more than 512 MiB of memory, the rest is high memory and
+    # must be temporarily mapped with kmap() to be accessed. The mappings
+    # are global, so they survive address space switches once PGE is
+    # enabled, unlike the temporary identity mapping.
     addl $768*4, %esi
 .L1:
     movl %edi, (%esi)   # Set the page table entry to the physical address
-    orl $0x83,(%esi)    # Present, read/write, 4 MiB page
+    orl $0x183,(%esi)   # Present, read/write, 4 MiB page, global
 
     addl $4, %esi           # Move to the next page table entry
     addl $0x400000, %edi    # Move to the next 4 MiB page
@@ -57,6 +100,7 @@ _start:
     movl %cr4, %edx
     orl $CR4_PSE_BIT, %edx
     movl %edx, %cr4
+.endif
 
     # Enable kernel write protection (WP) and paging (PG)
     movl %cr0, %edx
@@ -81,7 +125,16 @@ _start:
 .align 4096
 .global kernel_pd
 kernel_pd:
+.ifdef CONFIG_PAE
+    .skip 4096 * 4
+
+.align 32
+.global kernel_pdpt
+kernel_pdpt:
+    .skip 32
+.else
     .skip 4096
+.endif
 
 .align 16
 stack_bottom:
@@ -57,6 +57,18 @@ interrupt_handlers:
     .set irq, irq + 1
 .endr
 
+# The common part of all interrupt handlers. The general purpose registers are
+# saved on the stack after the values pushed by the handler, so that the stack
+# matches `struct trap_frame`, and a pointer to the frame is given to the C
+# handler. The values pushed by the handler and the error code are removed
+# before returning from the interrupt.
+.extern trap_handler
 interrupt_common:
+    pushad
+    cld
+    push esp
+    call trap_handler
+    add esp, 4
+    popad
     add esp, 16
     iret
@@ -49,4 +49,15 @@ void memset(void *b, int c, size_t len) {
     for (size_t i = 0; i < len; i++) {
         dst[i] = (unsigned char) c;
     }
-}
\ No newline at end of file
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] - y[i];
+        }
+    }
+    return 0;
+}
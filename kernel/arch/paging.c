@@ -16,20 +16,835 @@
  * You should have received a copy of the GNU General Public License
  * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <lib/log.h>
+#include <lib/math.h>
+#include <mm/page.h>
+#include <mm/buddy.h>
+#include <arch/cpu.h>
 #include <arch/paging.h>
+#include <arch/tlb.h>
 
-// The kernel page directory, defined in arch/asm/boot.asm
-extern struct page_directory kernel_pd;
+/// The page table used to map the fixmap area. It is statically allocated
+/// because the fixmap area is used to access memory that may not be mapped
+/// anywhere else, and therefore must be usable before any allocator exists.
+static struct page_table fixmap_pt = {};
+
+/// The page directory currently loaded in CR3. The kernel only has a single
+/// address space for now, but the TLB only needs to be flushed when the
+/// modified page directory is the active one.
+static struct page_directory *paging_active_pd = &kernel_pd;
+
+/// The page directories created with `paging_create_pd()`, linked through
+/// the `list` field of the page information structure of their first page.
+/// The changes of the kernel entries of `kernel_pd` are copied to all of them.
+static DECLARE_LIST(paging_pds);
+
+/// The number of pre-zeroed pages kept to allocate page tables.
+#define PAGING_PT_CACHE_SIZE    16
+
+/// The cache of pre-zeroed pages used to allocate page tables without having
+/// to clear a page on the hot path of a mapping.
+static struct page_table *paging_pt_cache[PAGING_PT_CACHE_SIZE];
+
+/// The number of pages in the page table cache.
+static uint paging_pt_cached = 0;
+
+/// The number of page tables allocated from the cache, and the number of page
+/// tables allocated from the buddy allocator because the cache was empty.
+static uint paging_pt_hits = 0;
+static uint paging_pt_misses = 0;
+
+/// The MSR containing the extended feature enable register.
+#define MSR_EFER            0xC0000080
+
+/// The bit in the EFER register that enables the no-execute page protection.
+#define EFER_NXE            (1 << 11)
+
+/// The bit returned in EDX by the CPUID leaf 0x80000001 when the processor
+/// supports the no-execute page protection.
+#define CPUID_EXT_NX        (1 << 20)
+
+/// The bit returned in EDX by the CPUID leaf 1 when the processor supports
+/// the global pages.
+#define CPUID_PGE           (1 << 13)
+
+/// Whether the no-execute bit is supported and enabled. It can only be used
+/// with PAE, since regular 32 bits page table entries do not have room for
+/// this bit.
+bool paging_nx_enabled = false;
+
+/// Whether the global pages are supported and enabled. When enabled, the
+/// kernel mappings are not flushed from the TLB when switching the address
+/// space.
+bool paging_pge_enabled = false;
+
+/**
+ * @brief Enable the no-execute page protection if the processor supports it.
+ * Without PAE, this function does nothing since the NX bit does not exist in
+ * the legacy page table format.
+ */
+_init
+static void paging_enable_nx(void)
+{
+#ifdef CONFIG_PAE
+    u32 eax, ebx, ecx, edx;
+
+    cpu_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001) {
+        return;
+    }
+
+    cpu_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_EXT_NX) {
+        cpu_write_msr(MSR_EFER, cpu_read_msr(MSR_EFER) | EFER_NXE);
+        paging_nx_enabled = true;
+    }
+#endif
+}
+
+/**
+ * @brief Enable the global pages if the processor supports them. The kernel
+ * mappings are created global by boot.asm, but the global bit is ignored
+ * until CR4.PGE is set. This must be done after the identity mapping is
+ * removed, since its TLB entries would otherwise survive the CR3 reload.
+ */
+_init
+static void paging_enable_pge(void)
+{
+    u32 eax, ebx, ecx, edx;
+
+    cpu_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_PGE) {
+        cpu_write_cr4(cpu_read_cr4() | CPU_CR4_PGE);
+        paging_pge_enabled = true;
+    }
+}
 
 /**
  * @brief Setup the paging system. Most of the work is done in the boot.asm
  * file, needed to setup an higher-half kernel. Here, we just need to unmap
- * the first 4MB of memory, used briefly by the bootloader when setting up
- * the paging system.
+ * the identity mapping of the beginning of the memory, used briefly by the
+ * bootloader when setting up the paging system.
  */
 _init
 void paging_setup() {
-    for (int i = 0; i < 768; i++) {
+    for (uint i = 0; i < paging_pde_index(KERNEL_VBASE); i++) {
         kernel_pd.entries[i].v = 0;
     }
-}
\ No newline at end of file
+
+    // Install the fixmap page table in the kernel page directory. Its entries
+    // are filled on demand by `paging_fixmap_set()`.
+    struct pde *pde = &kernel_pd.entries[paging_pde_index(FIXMAP_BASE)];
+    pde->frame = ((vaddr) &fixmap_pt - KERNEL_VBASE) >> 12;
+    pde->present = 1;
+    pde->rw = 1;
+
+    // Flush the TLB to remove the stale identity mapping
+    cpu_write_cr3(cpu_read_cr3());
+    paging_enable_nx();
+    paging_enable_pge();
+}
+
+/**
+ * @brief Switch to another address space. Writing CR3 flushes the TLB
+ * entries of the user space, but the kernel mappings are global and stay in
+ * the TLB when PGE is enabled, so the kernel does not need to walk its page
+ * tables again after the switch.
+ * 
+ * With PAE, the processor loads the page directory pointer table entries when
+ * CR3 is written, so the kernel PDPT is simply updated to reference the four
+ * page directories of the new address space before reloading CR3.
+ * 
+ * @param pd The page directory of the new address space. Its kernel part must
+ * be a copy of the one of `kernel_pd`.
+ */
+void paging_switch(struct page_directory *pd)
+{
+    const u32 pd_addr = (vaddr) pd - KERNEL_VBASE;
+    paging_active_pd = pd;
+
+#ifdef CONFIG_PAE
+    for (uint i = 0; i < PAGING_PDPT_ENTRIES; i++) {
+        kernel_pdpt.entries[i].frame = (pd_addr >> 12) + i;
+    }
+    cpu_write_cr3((vaddr) &kernel_pdpt - KERNEL_VBASE);
+#else
+    cpu_write_cr3(pd_addr);
+#endif
+}
+
+/**
+ * @brief Get the page information structure linking a page directory in the
+ * list of the page directories.
+ * 
+ * @param pd The page directory, created with `paging_create_pd()`.
+ * @return struct page* The page information structure of its first page.
+ */
+static struct page *paging_pd_page(struct page_directory *pd)
+{
+    return page_info((vaddr) pd - KERNEL_VBASE);
+}
+
+/**
+ * @brief Copy a kernel entry of `kernel_pd` that was changed in place, like a
+ * large page removed, split or protected, to all the other page directories.
+ * Otherwise, they would keep the old translation. The entries that were not
+ * present are copied lazily by `paging_sync_kernel()` instead.
+ * 
+ * @param pd The page directory containing the entry.
+ * @param pde The entry. Nothing is done if it is not a kernel entry of
+ * `kernel_pd`.
+ */
+static void paging_propagate_pde(struct page_directory *pd, struct pde *pde)
+{
+    const uint index = pde - pd->entries;
+    if (pd != &kernel_pd || index < paging_pde_index(KERNEL_VBASE)) {
+        return;
+    }
+
+    list_foreach(&paging_pds, entry) {
+        struct page *page = list_entry(entry, struct page, list);
+        struct page_directory *other =
+            (struct page_directory *) paddr_to_vaddr(page_paddr(page));
+        other->entries[index] = *pde;
+    }
+}
+
+/**
+ * @brief Create the page directory of a new address space. The user part is
+ * empty, and the kernel part is a copy of the one of `kernel_pd`, so that the
+ * kernel page tables are shared by all the address spaces. The kernel entries
+ * changed afterwards are propagated by `paging_propagate_pde()`.
+ * 
+ * @return struct page_directory* The new page directory, or NULL if there is
+ * no memory left.
+ */
+struct page_directory *paging_create_pd(void)
+{
+    struct page_directory *pd = buddy_alloc(PAGING_PD_ORDER, BUDDY_ZERO);
+    if (pd == NULL) {
+        return NULL;
+    }
+
+    for (uint i = paging_pde_index(KERNEL_VBASE); i < PAGING_PD_ENTRIES; i++) {
+        pd->entries[i] = kernel_pd.entries[i];
+    }
+    list_add_tail(&paging_pds, &paging_pd_page(pd)->list);
+    return pd;
+}
+
+/**
+ * @brief Destroy a page directory created with `paging_create_pd()`. The
+ * pages mapped in its user part must have been released by the caller. The
+ * page tables of the user part are released with the page directory.
+ * 
+ * @param pd The page directory. It must not be active.
+ */
+void paging_destroy_pd(struct page_directory *pd)
+{
+    assert(pd != &kernel_pd && !paging_is_active(pd));
+    paging_unmap_range(pd, 0, KERNEL_VBASE);
+    list_remove(&paging_pd_page(pd)->list);
+    buddy_free(pd, PAGING_PD_ORDER);
+}
+
+/**
+ * @brief Copy a page directory entry of the kernel space from `kernel_pd` to
+ * another page directory. The kernel part of a page directory is copied when
+ * it is created, and the entries changed in place are propagated right away,
+ * but the entries created afterwards in the kernel space are only propagated
+ * lazily, when the kernel faults on them.
+ * 
+ * @param pd The page directory.
+ * @param va The virtual address in the kernel space.
+ * @return true If the entry was missing and has been copied.
+ * @return false If the entry is also missing in `kernel_pd`, or if it was
+ * already present.
+ */
+bool paging_sync_kernel(struct page_directory *pd, vaddr va)
+{
+    assert(va >= KERNEL_VBASE);
+    const uint index = paging_pde_index(va);
+    if (pd->entries[index].present || !kernel_pd.entries[index].present) {
+        return false;
+    }
+
+    pd->entries[index] = kernel_pd.entries[index];
+    return true;
+}
+
+/**
+ * @brief Flush all the TLB entries, including the global ones. Reloading CR3
+ * is not enough when PGE is enabled, so the PGE bit is toggled instead.
+ */
+void paging_flush_global(void)
+{
+    if (paging_pge_enabled) {
+        const u32 cr4 = cpu_read_cr4();
+        cpu_write_cr4(cr4 & ~CPU_CR4_PGE);
+        cpu_write_cr4(cr4);
+    } else {
+        cpu_write_cr3(cpu_read_cr3());
+    }
+}
+
+/**
+ * @brief Map a physical page into a fixmap slot, replacing any previous
+ * mapping in this slot. The stale TLB entry for the slot is invalidated.
+ * 
+ * @param slot The fixmap slot index, must be less than FIXMAP_SLOTS.
+ * @param addr The physical address of the page to map. It must be page
+ * aligned.
+ * @return vaddr The virtual address where the page is now mapped.
+ */
+vaddr paging_fixmap_set(uint slot, paddr addr)
+{
+    assert(slot < FIXMAP_SLOTS);
+    const vaddr va = paging_fixmap_vaddr(slot);
+    struct pte *pte = &fixmap_pt.entries[slot];
+
+    pte->v = 0;
+    pte->frame = addr >> 12;
+    pte->present = 1;
+    pte->rw = 1;
+    pte->global = 1;
+    paging_invalidate_page(va);
+    return va;
+}
+
+/**
+ * @brief Remove the mapping of a fixmap slot. Accessing the slot address
+ * after this function returns will trigger a page fault.
+ * 
+ * @param slot The fixmap slot index, must be less than FIXMAP_SLOTS.
+ */
+void paging_fixmap_clear(uint slot)
+{
+    assert(slot < FIXMAP_SLOTS);
+    fixmap_pt.entries[slot].v = 0;
+    paging_invalidate_page(paging_fixmap_vaddr(slot));
+}
+
+/**
+ * @brief Allocate a zeroed page to be used as a page table. The page is taken
+ * from the page table cache if possible, and from the buddy allocator
+ * otherwise. The page is always in the low memory, so it is accessible
+ * through the direct mapping.
+ * 
+ * @return struct page_table* The page table, or NULL if there is no memory
+ * left.
+ */
+static struct page_table *paging_alloc_table(void)
+{
+    if (paging_pt_cached > 0) {
+        paging_pt_hits++;
+        return paging_pt_cache[--paging_pt_cached];
+    }
+
+    paging_pt_misses++;
+    return buddy_alloc(0, BUDDY_ZERO);
+}
+
+/**
+ * @brief Release a page table that does not contain any entry anymore. Since
+ * all its entries are cleared, the page is still zeroed and can be put back
+ * in the page table cache without being cleared again. The page table must
+ * not be referenced by the TLB anymore, see `tlb_gather_table()`.
+ * 
+ * @param pt The page table. All its entries must be cleared.
+ */
+void paging_free_table(struct page_table *pt)
+{
+    if (paging_pt_cached < PAGING_PT_CACHE_SIZE) {
+        paging_pt_cache[paging_pt_cached++] = pt;
+    } else {
+        buddy_free(pt, 0);
+    }
+}
+
+/**
+ * @brief Refill the page table cache with pre-zeroed pages. This function is
+ * meant to be called when the CPU is idle, so that allocating a page table
+ * on the hot path of a mapping does not need to clear a page.
+ * 
+ * @param budget The maximum number of pages to add to the cache.
+ * @return true If the cache is not full yet.
+ * @return false If the cache is full, or there is no memory to refill it.
+ */
+bool paging_pt_cache_refill(uint budget)
+{
+    while (budget-- > 0 && paging_pt_cached < PAGING_PT_CACHE_SIZE) {
+        if (buddy_below_watermark(BUDDY_WMARK_HIGH)) {
+            return false;
+        }
+
+        struct page_table *pt = buddy_alloc(0, BUDDY_ZERO);
+        if (pt == NULL) {
+            return false;
+        }
+        paging_pt_cache[paging_pt_cached++] = pt;
+    }
+    return paging_pt_cached < PAGING_PT_CACHE_SIZE;
+}
+
+/**
+ * @brief Print the statistics of the page table cache.
+ */
+void paging_debug_info(void)
+{
+    debug("Page table cache: %u/%u pages, %u hits, %u misses",
+        paging_pt_cached, PAGING_PT_CACHE_SIZE,
+        paging_pt_hits, paging_pt_misses);
+}
+
+/**
+ * @brief Verify if a page directory is the one currently used by the
+ * processor, in which case its translations may be cached in the TLB.
+ * 
+ * @param pd The page directory.
+ * @return true If the page directory is active.
+ * @return false Otherwise.
+ */
+bool paging_is_active(struct page_directory *pd)
+{
+    return pd == paging_active_pd;
+}
+
+/**
+ * @brief Verify if a page table does not contain any entry. The entries that
+ * are not present must be empty as well, since they may still hold data for
+ * the owner of the mapping, like the slot of a swapped out page.
+ * 
+ * @param pt The page table.
+ * @return true If the page table is empty.
+ * @return false Otherwise.
+ */
+static bool paging_table_empty(struct page_table *pt)
+{
+    for (uint i = 0; i < PAGING_PT_ENTRIES; i++) {
+        if (pt->entries[i].v != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Verify if an address is aligned on a large page. The address may be
+ * a 64 bits physical address, so a mask is used instead of a modulo.
+ * 
+ * @param addr The address.
+ * @return true If the address is aligned on a large page.
+ * @return false Otherwise.
+ */
+static bool paging_large_aligned(u64 addr) {
+    return (addr & (PAGING_LARGE_PAGE_SIZE - 1)) == 0;
+}
+
+/**
+ * @brief Get the end of the large page containing an address, clamped to the
+ * end of a range.
+ * 
+ * @param addr The address.
+ * @param end The end of the range.
+ * @return vaddr The end of the large page, or `end` if it comes first.
+ */
+static vaddr paging_large_end(vaddr addr, vaddr end) {
+    const vaddr next = align_down(addr, PAGING_LARGE_PAGE_SIZE) +
+        PAGING_LARGE_PAGE_SIZE;
+    // The distances are used instead of the addresses, since the end of a
+    // range at the top of the address space wraps around to 0.
+    return (end - addr <= next - addr) ? end : next;
+}
+
+/**
+ * @brief Set the attributes of a page table entry from mapping flags. The
+ * mappings of the kernel space are global, since they are shared by all the
+ * address spaces.
+ * 
+ * @param pte The page table entry.
+ * @param va The virtual address mapped by the entry.
+ * @param flags The mapping flags (PAGING_*).
+ */
+static void paging_set_pte_flags(struct pte *pte, vaddr va, uint flags) {
+    pte->global = (va >= KERNEL_VBASE) ? 1 : 0;
+    pte->rw = (flags & PAGING_WRITE) ? 1 : 0;
+    pte->user = (flags & PAGING_USER) ? 1 : 0;
+    pte->cache_disabled = (flags & PAGING_NOCACHE) ? 1 : 0;
+#ifdef CONFIG_PAE
+    pte->nx = ((flags & PAGING_NOEXEC) && paging_nx_enabled) ? 1 : 0;
+#endif
+}
+
+/**
+ * @brief Set the attributes of a page directory entry mapping a large page
+ * from mapping flags. The mappings of the kernel space are global.
+ * 
+ * @param pde The page directory entry.
+ * @param va The virtual address mapped by the entry.
+ * @param flags The mapping flags (PAGING_*).
+ */
+static void paging_set_large_flags(struct pde *pde, vaddr va, uint flags) {
+    pde->global = (va >= KERNEL_VBASE) ? 1 : 0;
+    pde->rw = (flags & PAGING_WRITE) ? 1 : 0;
+    pde->user = (flags & PAGING_USER) ? 1 : 0;
+    pde->cache_disabled = (flags & PAGING_NOCACHE) ? 1 : 0;
+#ifdef CONFIG_PAE
+    pde->nx = ((flags & PAGING_NOEXEC) && paging_nx_enabled) ? 1 : 0;
+#endif
+}
+
+/**
+ * @brief Get the page table referenced by a page directory entry, and
+ * optionally allocate it if the entry is not present.
+ * 
+ * @param pde The page directory entry. It must not map a large page.
+ * @param create Whether to allocate the page table if it does not exist.
+ * @param flags The mapping flags (PAGING_*) of the pages that will be mapped
+ * with this table. Only PAGING_USER matters, since the other restrictions are
+ * set in the page table entries.
+ * @return struct page_table* The page table, or NULL if it does not exist and
+ * could not be allocated.
+ */
+static struct page_table *paging_get_table(struct pde *pde, bool create,
+    uint flags)
+{
+    assert(!pde->present || !pde->page_size);
+    if (pde->present) {
+        if (flags & PAGING_USER) {
+            pde->user = 1;
+        }
+        return (struct page_table *) paddr_to_vaddr((paddr) pde->frame << 12);
+    } else if (!create) {
+        return NULL;
+    }
+
+    struct page_table *pt = paging_alloc_table();
+    if (pt == NULL) {
+        return NULL;
+    }
+
+    pde->v = 0;
+    pde->frame = ((vaddr) pt - KERNEL_VBASE) >> 12;
+    pde->user = (flags & PAGING_USER) ? 1 : 0;
+    pde->rw = 1;
+    pde->present = 1;
+    return pt;
+}
+
+/**
+ * @brief Split a large page mapping into a page table mapping the same
+ * physical memory with the same attributes, so that a part of it can be
+ * changed. The translation of the large page does not change, so the TLB
+ * does not need to be flushed.
+ * 
+ * @param pde The page directory entry mapping a large page.
+ * @return true If the large page was split.
+ * @return false If the page table could not be allocated.
+ */
+static bool paging_split_large(struct pde *pde)
+{
+    struct page_table *pt = paging_alloc_table();
+    if (pt == NULL) {
+        return false;
+    }
+
+    struct pde large = *pde;
+    const paddr base = (paddr) large.frame << 12;
+    for (uint i = 0; i < PAGING_PT_ENTRIES; i++) {
+        struct pte *pte = &pt->entries[i];
+        pte->frame = (base >> 12) + i;
+        pte->rw = large.rw;
+        pte->user = large.user;
+        pte->cache_disabled = large.cache_disabled;
+        pte->global = large.global;
+#ifdef CONFIG_PAE
+        pte->nx = large.nx;
+#endif
+        pte->present = 1;
+    }
+
+    pde->page_size = 0;
+    pde->global = 0;
+    pde->frame = ((vaddr) pt - KERNEL_VBASE) >> 12;
+    pde->rw = 1;
+    pde->cache_disabled = 0;
+#ifdef CONFIG_PAE
+    pde->nx = 0;
+#endif
+    return true;
+}
+
+/**
+ * @brief Get the page table entry translating a virtual address, optionally
+ * allocating the page table if it does not exist. This is the fast path used
+ * to map single pages, for example when resolving a page fault: the caller
+ * fills the entry with `paging_set_pte()`.
+ * 
+ * @param pd The page directory.
+ * @param va The virtual address.
+ * @param create Whether to allocate the page table if it does not exist.
+ * @return struct pte* The page table entry, or NULL if the address is mapped
+ * by a large page, or if the page table does not exist and could not be
+ * allocated.
+ */
+struct pte *paging_get_pte(struct page_directory *pd, vaddr va, bool create)
+{
+    struct pde *pde = &pd->entries[paging_pde_index(va)];
+    if (pde->present && pde->page_size) {
+        return NULL;
+    }
+
+    const uint flags = (va < KERNEL_VBASE) ? PAGING_USER : PAGING_NONE;
+    struct page_table *pt = paging_get_table(pde, create, flags);
+    if (pt == NULL) {
+        return NULL;
+    }
+    return &pt->entries[paging_pte_index(va)];
+}
+
+/**
+ * @brief Fill a page table entry to map a page. The entry must not be present
+ * yet, since the TLB is not flushed.
+ * 
+ * @param pte The page table entry, returned by `paging_get_pte()`.
+ * @param va The virtual address mapped by the entry.
+ * @param pa The physical address of the page.
+ * @param flags The mapping flags (PAGING_*).
+ */
+void paging_set_pte(struct pte *pte, vaddr va, paddr pa, uint flags)
+{
+    assert(!pte->present);
+    pte->v = 0;
+    pte->frame = pa >> 12;
+    paging_set_pte_flags(pte, va, flags);
+    pte->present = 1;
+}
+
+/**
+ * @brief Map a physically contiguous region in a page directory. The parts of
+ * the region that are aligned on a large page, both virtually and physically,
+ * are mapped with large pages to reduce the TLB pressure, and the edges are
+ * mapped with regular 4 KiB pages. The region must not be mapped yet.
+ * 
+ * @param pd The page directory.
+ * @param va The virtual address of the region. It must be page aligned.
+ * @param pa The physical address of the region. It must be page aligned.
+ * @param size The size of the region, in bytes. It must be page aligned.
+ * @param flags The mapping flags (PAGING_*).
+ * @return true If the region was mapped.
+ * @return false If a page table could not be allocated. Nothing is mapped
+ * in this case.
+ */
+bool paging_map_range(struct page_directory *pd, vaddr va, paddr pa,
+    u32 size, uint flags)
+{
+    assert(page_is_aligned(va) && page_is_aligned(size));
+    assert((pa & (PAGE_SIZE - 1)) == 0);
+    assert(size == 0 || va + size - 1 >= va);
+
+    const vaddr end = va + size;
+    vaddr addr = va;
+    while (addr != end) {
+        struct pde *pde = &pd->entries[paging_pde_index(addr)];
+        if (!pde->present &&
+            paging_large_aligned(addr) &&
+            paging_large_aligned(pa) &&
+            end - addr >= PAGING_LARGE_PAGE_SIZE) {
+            pde->v = 0;
+            pde->frame = pa >> 12;
+            paging_set_large_flags(pde, addr, flags);
+            pde->page_size = 1;
+            pde->present = 1;
+            paging_propagate_pde(pd, pde);
+            addr += PAGING_LARGE_PAGE_SIZE;
+            pa += PAGING_LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (pde->present && pde->page_size) {
+            panic("paging_map_range(): %p is already mapped", addr);
+        }
+
+        struct page_table *pt = paging_get_table(pde, true, flags);
+        if (pt == NULL) {
+            paging_unmap_range(pd, va, addr - va);
+            return false;
+        }
+
+        struct pte *pte = &pt->entries[paging_pte_index(addr)];
+        if (pte->present) {
+            panic("paging_map_range(): %p is already mapped", addr);
+        }
+        pte->v = 0;
+        pte->frame = pa >> 12;
+        paging_set_pte_flags(pte, addr, flags);
+        pte->present = 1;
+        addr += PAGE_SIZE;
+        pa += PAGE_SIZE;
+    }
+
+    // The entries were not present before, and the processor does not cache
+    // non-present translations, so the TLB does not need to be flushed.
+    return true;
+}
+
+/**
+ * @brief Remove the mappings of a region of a page directory. Large pages
+ * entirely inside the region are removed at once, and large pages partially
+ * inside the region are split first. The parts of the region that are not
+ * mapped are skipped. The TLB entries of the region are invalidated once
+ * all the entries are cleared.
+ *
+ * The page tables of the user space that become empty are released after
+ * the TLB flush. The page tables of the kernel space are kept, since they are
+ * likely to be reused by the next mappings, and since they are shared by all
+ * the address spaces.
+ * 
+ * @param pd The page directory.
+ * @param va The virtual address of the region. It must be page aligned.
+ * @param size The size of the region, in bytes. It must be page aligned.
+ */
+void paging_unmap_range(struct page_directory *pd, vaddr va, u32 size)
+{
+    assert(page_is_aligned(va) && page_is_aligned(size));
+    assert(size == 0 || va + size - 1 >= va);
+
+    struct mmu_gather tlb;
+    tlb_gather_init(&tlb, pd);
+
+    const vaddr end = va + size;
+    vaddr addr = va;
+    while (addr != end) {
+        struct pde *pde = &pd->entries[paging_pde_index(addr)];
+        const vaddr next = paging_large_end(addr, end);
+        if (!pde->present) {
+            addr = next;
+            continue;
+        }
+
+        if (pde->page_size) {
+            if (paging_large_aligned(addr) && paging_large_aligned(next)) {
+                pde->v = 0;
+                paging_propagate_pde(pd, pde);
+                tlb_gather_page(&tlb, addr);
+                addr = next;
+                continue;
+            } else if (!paging_split_large(pde)) {
+                panic("paging_unmap_range(): cannot split a large page");
+            }
+            paging_propagate_pde(pd, pde);
+        }
+
+        struct page_table *pt = paging_get_table(pde, false, 0);
+        for (; addr != next; addr += PAGE_SIZE) {
+            struct pte *pte = &pt->entries[paging_pte_index(addr)];
+            if (pte->present) {
+                pte->v = 0;
+                tlb_gather_page(&tlb, addr);
+            }
+        }
+
+        const bool user = pde < &pd->entries[paging_pde_index(KERNEL_VBASE)];
+        if (user && paging_table_empty(pt)) {
+            pde->v = 0;
+            tlb_gather_table(&tlb, pt);
+        }
+    }
+
+    tlb_finish(&tlb);
+}
+
+/**
+ * @brief Change the attributes of the mappings of a region of a page
+ * directory. Large pages partially inside the region are split first. The
+ * parts of the region that are not mapped are skipped. The TLB entries of the
+ * region are invalidated once all the entries are updated.
+ * 
+ * @param pd The page directory.
+ * @param va The virtual address of the region. It must be page aligned.
+ * @param size The size of the region, in bytes. It must be page aligned.
+ * @param flags The new mapping flags (PAGING_*).
+ * @return true If the attributes were changed.
+ * @return false If a large page could not be split. The region may be
+ * partially updated in this case.
+ */
+bool paging_protect_range(struct page_directory *pd, vaddr va, u32 size,
+    uint flags)
+{
+    assert(page_is_aligned(va) && page_is_aligned(size));
+    assert(size == 0 || va + size - 1 >= va);
+
+    struct mmu_gather tlb;
+    tlb_gather_init(&tlb, pd);
+
+    bool success = true;
+    const vaddr end = va + size;
+    vaddr addr = va;
+    while (addr != end) {
+        struct pde *pde = &pd->entries[paging_pde_index(addr)];
+        const vaddr next = paging_large_end(addr, end);
+        if (!pde->present) {
+            addr = next;
+            continue;
+        }
+
+        if (pde->page_size) {
+            if (paging_large_aligned(addr) && paging_large_aligned(next)) {
+                paging_set_large_flags(pde, addr, flags);
+                paging_propagate_pde(pd, pde);
+                tlb_gather_page(&tlb, addr);
+                addr = next;
+                continue;
+            } else if (!paging_split_large(pde)) {
+                success = false;
+                break;
+            }
+            paging_propagate_pde(pd, pde);
+        }
+
+        struct page_table *pt = paging_get_table(pde, false, flags);
+        for (; addr != next; addr += PAGE_SIZE) {
+            struct pte *pte = &pt->entries[paging_pte_index(addr)];
+            if (pte->present) {
+                paging_set_pte_flags(pte, addr, flags);
+                tlb_gather_page(&tlb, addr);
+            }
+        }
+    }
+
+    tlb_finish(&tlb);
+    return success;
+}
+
+/**
+ * @brief Map a physically contiguous region in the kernel address space,
+ * using large pages where possible.
+ * 
+ * @param va The virtual address of the region. It must be page aligned and
+ * inside the [KERNEL_MAP_BASE, KERNEL_MAP_END) area.
+ * @param pa The physical address of the region. It must be page aligned.
+ * @param size The size of the region, in bytes. It must be page aligned.
+ * @param flags The mapping flags (PAGING_*).
+ * @return true If the region was mapped.
+ * @return false If a page table could not be allocated.
+ */
+bool paging_map_kernel(vaddr va, paddr pa, u32 size, uint flags)
+{
+    assert(va >= KERNEL_MAP_BASE && va + size <= KERNEL_MAP_END);
+    assert(!(flags & PAGING_USER));
+    return paging_map_range(&kernel_pd, va, pa, size, flags);
+}
+
+/**
+ * @brief Remove the mappings of a region of the kernel address space created
+ * with `paging_map_kernel()`.
+ * 
+ * @param va The virtual address of the region. It must be page aligned.
+ * @param size The size of the region, in bytes. It must be page aligned.
+ */
+void paging_unmap_kernel(vaddr va, u32 size)
+{
+    assert(va >= KERNEL_MAP_BASE && va + size <= KERNEL_MAP_END);
+    paging_unmap_range(&kernel_pd, va, size);
+}
@@ -0,0 +1,144 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <arch/cpu.h>
+#include <arch/tlb.h>
+
+/// The number of pages invalidated with `invlpg`, the number of full TLB
+/// flushes, and the number of page tables released after a flush.
+static uint tlb_page_flushes = 0;
+static uint tlb_full_flushes = 0;
+static uint tlb_freed_tables = 0;
+
+/**
+ * @brief Start gathering the TLB invalidations of an operation on a page
+ * directory.
+ * 
+ * @param tlb The gather to initialize.
+ * @param pd The page directory that will be modified.
+ */
+void tlb_gather_init(struct mmu_gather *tlb, struct page_directory *pd)
+{
+    tlb->pd = pd;
+    tlb->page_count = 0;
+    tlb->full_flush = false;
+    tlb->global = false;
+    tlb->table_count = 0;
+}
+
+/**
+ * @brief Record a page whose translation changed. Once more than
+ * TLB_FLUSH_THRESHOLD pages are recorded, the gather switches to a full
+ * flush and stops recording the pages.
+ * 
+ * @param tlb The gather.
+ * @param va The virtual address of the page, or of any page inside a large
+ * page.
+ */
+void tlb_gather_page(struct mmu_gather *tlb, vaddr va)
+{
+    if (va >= KERNEL_VBASE) {
+        tlb->global = true;
+    }
+
+    if (tlb->full_flush) {
+        return;
+    } else if (tlb->page_count == TLB_FLUSH_THRESHOLD) {
+        tlb->full_flush = true;
+        return;
+    }
+    tlb->pages[tlb->page_count++] = va;
+}
+
+/**
+ * @brief Defer the release of a page table removed from the page directory
+ * until the TLB is flushed. If too many page tables are pending, the TLB is
+ * flushed right away to release them.
+ * 
+ * @param tlb The gather.
+ * @param pt The page table. All its entries must be cleared.
+ */
+void tlb_gather_table(struct mmu_gather *tlb, struct page_table *pt)
+{
+    if (tlb->table_count == TLB_GATHER_TABLES) {
+        tlb_flush(tlb);
+    }
+    tlb->tables[tlb->table_count++] = pt;
+}
+
+/**
+ * @brief Invalidate the TLB entries recorded so far, then release the pending
+ * page tables. Nothing needs to be invalidated if the page directory is not
+ * the one currently used by the processor, since its translations cannot be
+ * cached, unless kernel pages were recorded: the kernel mappings are shared
+ * by all the page directories. A full flush of a kernel range must also flush
+ * the global pages.
+ * The gather can be reused after this call.
+ * 
+ * @param tlb The gather.
+ */
+void tlb_flush(struct mmu_gather *tlb)
+{
+    if (paging_is_active(tlb->pd) || tlb->global) {
+        if (tlb->full_flush && tlb->global) {
+            paging_flush_global();
+            tlb_full_flushes++;
+        } else if (tlb->full_flush) {
+            cpu_write_cr3(cpu_read_cr3());
+            tlb_full_flushes++;
+        } else {
+            for (uint i = 0; i < tlb->page_count; i++) {
+                paging_invalidate_page(tlb->pages[i]);
+            }
+            tlb_page_flushes += tlb->page_count;
+        }
+    }
+
+    for (uint i = 0; i < tlb->table_count; i++) {
+        paging_free_table(tlb->tables[i]);
+    }
+    tlb_freed_tables += tlb->table_count;
+
+    tlb->page_count = 0;
+    tlb->full_flush = false;
+    tlb->global = false;
+    tlb->table_count = 0;
+}
+
+/**
+ * @brief Complete an operation on a page directory, flushing the TLB entries
+ * and releasing the page tables gathered during the operation.
+ * 
+ * @param tlb The gather.
+ */
+void tlb_finish(struct mmu_gather *tlb)
+{
+    if (tlb->page_count > 0 || tlb->full_flush || tlb->table_count > 0) {
+        tlb_flush(tlb);
+    }
+}
+
+/**
+ * @brief Print the statistics of the TLB invalidations.
+ */
+void tlb_debug_info(void)
+{
+    debug("TLB: %u pages invalidated, %u full flushes, %u page tables freed",
+        tlb_page_flushes, tlb_full_flushes, tlb_freed_tables);
+}
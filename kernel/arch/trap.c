@@ -16,6 +16,9 @@
  * You should have received a copy of the GNU General Public License
  * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <lib/log.h>
+#include <mm/vm.h>
+#include <arch/cpu.h>
 #include <arch/gdt.h>
 #include <arch/trap.h>
 
@@ -100,6 +103,30 @@ void trap_setup(void)
     asm volatile("lidt %0" : : "m" (IDTR) : "memory");
 }
 
+/**
+ * @brief Handle an interrupt. This function is called by the interrupt
+ * handlers of arch/asm/trap.asm with the state of the interrupted code. Page
+ * faults are given to the virtual memory subsystem, and any other exception
+ * is fatal since the kernel cannot recover from it yet. Hardware interrupts
+ * are ignored.
+ * 
+ * @param frame The state of the interrupted code.
+ */
+_cdecl _hot
+void trap_handler(struct trap_frame *frame)
+{
+    if (likely(frame->vector == TRAP_PAGE_FAULT)) {
+        const vaddr addr = cpu_read_cr2();
+        if (!vm_fault(addr, frame->error)) {
+            panic("Page fault at %p (error %x, eip %p)",
+                addr, frame->error, frame->eip);
+        }
+    } else if (!frame->is_irq) {
+        panic("Exception %u (error %x, eip %p)",
+            frame->vector, frame->error, frame->eip);
+    }
+}
+
 /**
  * @brief Disable interrupts on the current CPU core by clearing the IF flag
  * in the EFLAGS register. However, this does not prevent the CPU from
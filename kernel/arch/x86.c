@@ -59,12 +59,15 @@ void arch_x86_setup(struct mb_info *mb_info)
         };
 
         while (mmap < mb_mmap_end(mb_info)) {
-            const u32 length = mmap->len & 0xFFFFFFFF;
-            const u32 base = mmap->addr & 0xFFFFFFFF;
-            const u32 end = base + (length + - 1);
+            const u64 base = mmap->addr;
+            const u64 end = mmap->addr + mmap->len - 1;
 
-            debug("Memory region: 0x%08x - 0x%08x (%s)",
-                base, end, MB_MEMORY_TYPES[mmap->type]);
+            // The printf-like functions do not support 64 bits integers, so
+            // the addresses are printed in two halves.
+            debug("Memory region: 0x%08x%08x - 0x%08x%08x (%s)",
+                (u32) (base >> 32), (u32) base,
+                (u32) (end >> 32), (u32) end,
+                MB_MEMORY_TYPES[mmap->type]);
             mmap = mb_next_mmap(mmap);
         }
     }
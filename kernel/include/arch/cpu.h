@@ -17,6 +17,139 @@
  * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
  */
 #pragma once
+#include <kernel.h>
+#include <config.h>
+
+/// The bit in the CR4 register that enables the global pages, whose TLB
+/// entries are not flushed when CR3 is written.
+#define CPU_CR4_PGE     (1 << 7)
+
+/**
+ * @brief Get the identifier of the CPU executing this code. The kernel does
+ * not support SMP yet, so this is always the boot CPU.
+ * 
+ * @return uint The identifier of the current CPU, less than MAX_CPUS.
+ */
+static inline uint cpu_id(void)
+{
+    return 0;
+}
+
+/**
+ * @brief Execute the CPUID instruction with the given leaf.
+ * 
+ * @param leaf The CPUID leaf to query.
+ * @param eax Where to store the value of the EAX register.
+ * @param ebx Where to store the value of the EBX register.
+ * @param ecx Where to store the value of the ECX register.
+ * @param edx Where to store the value of the EDX register.
+ */
+static inline void cpu_cpuid(u32 leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(0));
+}
+
+/**
+ * @brief Read a model specific register.
+ * 
+ * @param msr The index of the MSR to read.
+ * @return u64 The value of the MSR.
+ */
+static inline u64 cpu_read_msr(u32 msr)
+{
+    u32 low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((u64) high << 32) | low;
+}
+
+/**
+ * @brief Write a model specific register. Writing an invalid value or an
+ * unsupported MSR will trigger a general protection fault.
+ * 
+ * @param msr The index of the MSR to write.
+ * @param value The value to write.
+ */
+static inline void cpu_write_msr(u32 msr, u64 value)
+{
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"((u32) value), "d"((u32) (value >> 32)));
+}
+
+/**
+ * @brief Read the CR2 register, containing the virtual address that caused
+ * the last page fault.
+ * 
+ * @return u32 The value of the CR2 register.
+ */
+static inline u32 cpu_read_cr2(void)
+{
+    u32 cr2;
+    asm volatile("mov %0, cr2" : "=r"(cr2));
+    return cr2;
+}
+
+/**
+ * @brief Read the CR3 register, containing the physical address of the
+ * current paging structure.
+ * 
+ * @return u32 The value of the CR3 register.
+ */
+static inline u32 cpu_read_cr3(void)
+{
+    u32 cr3;
+    asm volatile("mov %0, cr3" : "=r"(cr3));
+    return cr3;
+}
+
+/**
+ * @brief Write the CR3 register. This switches the current paging structure
+ * and flushes all non-global TLB entries.
+ * 
+ * @param cr3 The new value of the CR3 register.
+ */
+static inline void cpu_write_cr3(u32 cr3)
+{
+    asm volatile("mov cr3, %0" : : "r"(cr3) : "memory");
+}
+
+/**
+ * @brief Read the CR4 register, containing the processor extension flags.
+ * 
+ * @return u32 The value of the CR4 register.
+ */
+static inline u32 cpu_read_cr4(void)
+{
+    u32 cr4;
+    asm volatile("mov %0, cr4" : "=r"(cr4));
+    return cr4;
+}
+
+/**
+ * @brief Write the CR4 register. Toggling the CPU_CR4_PGE bit flushes all the
+ * TLB entries, including the global ones.
+ * 
+ * @param cr4 The new value of the CR4 register.
+ */
+static inline void cpu_write_cr4(u32 cr4)
+{
+    asm volatile("mov cr4, %0" : : "r"(cr4) : "memory");
+}
+
+/**
+ * @brief Read the time stamp counter, incremented at a constant rate on
+ * modern processors.
+ * 
+ * @return u64 The value of the time stamp counter.
+ */
+static inline u64 cpu_rdtsc(void)
+{
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64) high << 32) | low;
+}
 
 /**
  * @brief Halt the CPU forever
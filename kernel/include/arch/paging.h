@@ -25,6 +25,141 @@
 #define KERNEL_PBASE    0x00100000
 #define KERNEL_MAX_PAGE 0x40000000
 
+/// The base virtual address of the fixmap area. The fixmap area starts 4 MiB
+/// before the end of the virtual address space and is backed by a single
+/// static page table, allowing the kernel to create temporary mappings of any
+/// physical page without needing to allocate memory.
+#define FIXMAP_BASE     0xFFC00000
+
+/// The number of 4 KiB slots in the fixmap area.
+#define FIXMAP_SLOTS    PAGING_PT_ENTRIES
+
+/// The area of the kernel address space available for dynamic mappings
+/// created with `paging_map_kernel()`. It starts after the direct mapping of
+/// the low memory and ends at the fixmap area.
+#define KERNEL_MAP_BASE 0xE0000000
+#define KERNEL_MAP_END  FIXMAP_BASE
+
+/// The end of the dynamic mapping area, from VMALLOC_BASE, is reserved for the
+/// virtually contiguous allocations of `vmalloc()`. The other mappings of the
+/// area must stay below it.
+#define VMALLOC_BASE    0xF0000000
+#define VMALLOC_END     KERNEL_MAP_END
+
+/// The mapping is read-only, executable, cached and only accessible from the
+/// kernel.
+#define PAGING_NONE     0x00
+
+/// The mapping is writable.
+#define PAGING_WRITE    0x01
+
+/// The mapping is not cached, for example to map device memory.
+#define PAGING_NOCACHE  0x02
+
+/// The mapping is not executable. This is only enforced when the processor
+/// supports the no-execute bit, which requires PAE.
+#define PAGING_NOEXEC   0x04
+
+/// The mapping is accessible from the user mode.
+#define PAGING_USER     0x08
+
+/// The number of pages added to the page table cache by a single call to
+/// `paging_pt_cache_refill()`.
+#define PAGING_PT_CACHE_BATCH   4
+
+#ifdef CONFIG_PAE
+
+/// The number of entries in the page directory. With PAE, each page directory
+/// only contains 512 entries and covers 1 GiB of virtual memory. The four page
+/// directories referenced by the page directory pointer table are allocated
+/// contiguously, so they can be used as a single 2048 entries directory that
+/// covers the whole 4 GiB address space.
+#define PAGING_PD_ENTRIES   2048
+
+/// The number of entries in a page table.
+#define PAGING_PT_ENTRIES   512
+
+/// The number of entries in the page directory pointer table.
+#define PAGING_PDPT_ENTRIES 4
+
+/// The number of bits of the virtual address translated by a page directory
+/// entry (2 MiB).
+#define PAGING_PDE_SHIFT    21
+
+struct pdpte {
+    union {
+        struct {
+            u64 present : 1;
+            u64 reserved0 : 2;
+            u64 write_through : 1;
+            u64 cache_disabled : 1;
+            u64 reserved1 : 4;
+            u64 available : 3;
+            u64 frame : 40;
+            u64 reserved2 : 12;
+        };
+        u64 v;
+    };
+} __attribute__((packed));
+
+struct pde {
+    union {
+        struct {
+            u64 present : 1;
+            u64 rw : 1;
+            u64 user : 1;
+            u64 write_through : 1;
+            u64 cache_disabled : 1;
+            u64 accessed : 1;
+            u64 dirty : 1;
+            u64 page_size : 1;
+            u64 global : 1;
+            u64 available : 3;
+            u64 frame : 40;
+            u64 reserved : 11;
+            u64 nx : 1;
+        };
+        u64 v;
+    };
+} __attribute__((packed));
+
+struct pte {
+    union {
+        struct {
+            u64 present : 1;
+            u64 rw : 1;
+            u64 user : 1;
+            u64 write_through : 1;
+            u64 cache_disabled : 1;
+            u64 accessed : 1;
+            u64 dirty : 1;
+            u64 pat : 1;
+            u64 global : 1;
+            u64 available : 3;
+            u64 frame : 40;
+            u64 reserved : 11;
+            u64 nx : 1;
+        };
+        u64 v;
+    };
+} __attribute__((packed));
+
+struct page_directory_pointer_table {
+    struct pdpte entries[PAGING_PDPT_ENTRIES];
+} __attribute__((packed, aligned(32)));
+
+#else
+
+/// The number of entries in the page directory.
+#define PAGING_PD_ENTRIES   1024
+
+/// The number of entries in a page table.
+#define PAGING_PT_ENTRIES   1024
+
+/// The number of bits of the virtual address translated by a page directory
+/// entry (4 MiB).
+#define PAGING_PDE_SHIFT    22
+
 struct pde {
     union {
         struct {
@@ -63,14 +198,52 @@ struct pte {
     };
 } __attribute__((packed));
 
+#endif
+
+/// The size of a large page mapped directly by a page directory entry: 4 MiB
+/// without PAE, and 2 MiB with PAE.
+#define PAGING_LARGE_PAGE_SIZE  (1u << PAGING_PDE_SHIFT)
+
+/// The buddy order of a page directory. With PAE, the four page directories
+/// referenced by the PDPT are allocated together.
+#ifdef CONFIG_PAE
+#define PAGING_PD_ORDER     2
+#else
+#define PAGING_PD_ORDER     0
+#endif
+
 struct page_directory {
-    struct pde entries[1024];
+    struct pde entries[PAGING_PD_ENTRIES];
 } __attribute__((packed, aligned(4096)));
 
 struct page_table {
-    struct pte entries[1024];
+    struct pte entries[PAGING_PT_ENTRIES];
 } __attribute__((packed, aligned(4096)));
 
+/**
+ * @brief Get the index of the page directory entry that translates the given
+ * virtual address.
+ * 
+ * @param addr The virtual address.
+ * @return uint The index of the entry in `struct page_directory`.
+ */
+_const
+static inline uint paging_pde_index(vaddr addr) {
+    return addr >> PAGING_PDE_SHIFT;
+}
+
+/**
+ * @brief Get the index of the page table entry that translates the given
+ * virtual address.
+ * 
+ * @param addr The virtual address.
+ * @return uint The index of the entry in `struct page_table`.
+ */
+_const
+static inline uint paging_pte_index(vaddr addr) {
+    return (addr >> 12) & (PAGING_PT_ENTRIES - 1);
+}
+
 /**
  * @brief Convert a physical address to a virtual address. This function
  * assumes that all the physical addresses usable by the kernel are mapped
@@ -85,7 +258,60 @@ struct page_table {
 _const
 static inline vaddr paddr_to_vaddr(paddr addr) {
     assert(addr < KERNEL_MAX_PAGE);
-    return KERNEL_VBASE + addr;
+    return KERNEL_VBASE + (vaddr) addr;
 }
 
-void paging_setup(void);
\ No newline at end of file
+/**
+ * @brief Get the virtual address of a fixmap slot.
+ * 
+ * @param slot The fixmap slot index, must be less than FIXMAP_SLOTS.
+ * @return vaddr The virtual address mapped by the slot.
+ */
+_const
+static inline vaddr paging_fixmap_vaddr(uint slot) {
+    return FIXMAP_BASE + (slot << 12);
+}
+
+/**
+ * @brief Invalidate the TLB entry for the given virtual address on the
+ * current CPU.
+ * 
+ * @param addr The virtual address to invalidate.
+ */
+static inline void paging_invalidate_page(vaddr addr) {
+    asm volatile("invlpg [%0]" : : "r" (addr) : "memory");
+}
+
+extern bool paging_nx_enabled;
+
+void paging_setup(void);
+vaddr paging_fixmap_set(uint slot, paddr addr);
+void paging_fixmap_clear(uint slot);
+
+// The kernel page directory, defined in arch/asm/boot.asm
+extern struct page_directory kernel_pd;
+#ifdef CONFIG_PAE
+extern struct page_directory_pointer_table kernel_pdpt;
+#endif
+
+extern bool paging_pge_enabled;
+
+void paging_switch(struct page_directory *pd);
+struct page_directory *paging_create_pd(void);
+void paging_destroy_pd(struct page_directory *pd);
+bool paging_sync_kernel(struct page_directory *pd, vaddr va);
+void paging_flush_global(void);
+
+bool paging_is_active(struct page_directory *pd);
+void paging_free_table(struct page_table *pt);
+bool paging_pt_cache_refill(uint budget);
+void paging_debug_info(void);
+struct pte *paging_get_pte(struct page_directory *pd, vaddr va, bool create);
+void paging_set_pte(struct pte *pte, vaddr va, paddr pa, uint flags);
+bool paging_map_range(struct page_directory *pd, vaddr va, paddr pa,
+    u32 size, uint flags);
+void paging_unmap_range(struct page_directory *pd, vaddr va, u32 size);
+bool paging_protect_range(struct page_directory *pd, vaddr va, u32 size,
+    uint flags);
+bool paging_map_kernel(vaddr va, paddr pa, u32 size, uint flags);
+void paging_unmap_kernel(vaddr va, u32 size);
\ No newline at end of file
@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <arch/paging.h>
+
+/// The number of pages above which a gather flushes the whole TLB instead of
+/// invalidating each page with `invlpg`. Reloading CR3 is cheaper than a long
+/// sequence of `invlpg`, but also throws away the translations that are still
+/// valid and that will need to be walked again.
+#define TLB_FLUSH_THRESHOLD 32
+
+/// The number of page tables whose release can be deferred by a gather before
+/// it needs to flush the TLB early.
+#define TLB_GATHER_TABLES   16
+
+/// Collects the TLB invalidations and the released page tables during an
+/// operation on a page directory, to flush the TLB only once at the end.
+struct mmu_gather {
+    /// The page directory being modified.
+    struct page_directory *pd;
+    /// The pages whose translation changed, until TLB_FLUSH_THRESHOLD is
+    /// reached. Pages mapped with a large page only need a single entry.
+    vaddr pages[TLB_FLUSH_THRESHOLD];
+    uint page_count;
+    /// Whether the whole TLB must be flushed, because too many pages changed.
+    bool full_flush;
+    /// Whether a page of the kernel space changed. Its translation is global
+    /// and is not flushed by a CR3 reload.
+    bool global;
+    /// The page tables removed from the page directory. They may still be
+    /// used by the processor to walk stale translations, so they are only
+    /// released after the TLB has been flushed.
+    struct page_table *tables[TLB_GATHER_TABLES];
+    uint table_count;
+};
+
+void tlb_gather_init(struct mmu_gather *tlb, struct page_directory *pd);
+void tlb_gather_page(struct mmu_gather *tlb, vaddr va);
+void tlb_gather_table(struct mmu_gather *tlb, struct page_table *pt);
+void tlb_flush(struct mmu_gather *tlb);
+void tlb_finish(struct mmu_gather *tlb);
+void tlb_debug_info(void);
@@ -21,6 +21,16 @@
 
 #define IDT_ENTRIES     256
 
+/// The vector of the page fault exception.
+#define TRAP_PAGE_FAULT 14
+
+/// The bits of the page fault error code: the fault was caused by a protection
+/// violation rather than a non-present page, by a write rather than a read,
+/// and by an access from the user mode.
+#define TRAP_PF_PRESENT 0x01
+#define TRAP_PF_WRITE   0x02
+#define TRAP_PF_USER    0x04
+
 struct idt_descriptor {
     u16 offset0_15;
     u16 selector;
@@ -34,6 +44,28 @@ struct idtr {
     u32 base;
 } __attribute__((packed));
 
+/// The state of the interrupted code, as saved on the stack by the interrupt
+/// handlers of arch/asm/trap.asm. The general purpose registers are saved by
+/// `pushad`, followed by the values pushed by the handler and the interrupt
+/// frame pushed by the processor.
+struct trap_frame {
+    u32 edi;
+    u32 esi;
+    u32 ebp;
+    u32 esp;
+    u32 ebx;
+    u32 edx;
+    u32 ecx;
+    u32 eax;
+    u32 reserved;
+    u32 vector;
+    u32 is_irq;
+    u32 error;
+    u32 eip;
+    u32 cs;
+    u32 eflags;
+} __attribute__((packed));
+
 void trap_setup(void);
 
 void trap_disable_irq(void);
@@ -22,9 +22,24 @@
 #include <multiboot.h>
 #include <arch/cpu.h>
 
+#ifdef CONFIG_PAE
+typedef u64 paddr;
+#else
 typedef u32 paddr;
+#endif
 typedef u32 vaddr;
 
+#ifdef CONFIG_PAE
+/// The end of the physical address space usable by the kernel (exclusive).
+/// PAE allows addressing 64 GiB of physical memory on all processors that
+/// support it.
+#define PADDR_END   0x1000000000ULL
+#else
+/// The end of the physical address space usable by the kernel (exclusive).
+/// Without PAE, only the first 4 GiB of physical memory can be addressed.
+#define PADDR_END   0x100000000ULL
+#endif
+
 #define page_align_up(a)    align_up(a, PAGE_SIZE)
 #define page_align_down(a)  align_down(a, PAGE_SIZE)
 #define page_is_aligned(a)  is_aligned(a, PAGE_SIZE)
@@ -34,4 +49,11 @@ typedef u32 vaddr;
 /// any meaningful data ! Only its address should be used.
 extern char __end[];
 
+/// The addresses of these symbols are the bounds of the init section, which
+/// contains the code and data only used during the boot. They are page
+/// aligned by the linker script, so that the init section can be freed once
+/// the kernel is fully initialized.
+extern char __init_start[];
+extern char __init_end[];
+
 void arch_x86_setup(struct mb_info *mb_info);
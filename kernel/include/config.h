@@ -20,3 +20,15 @@
 
 // The size of the buffer used by the printf like functions.
 #define PRINTF_BUFFER_SIZE  256
+
+// The maximum number of CPUs supported by the kernel.
+#define MAX_CPUS            1
+
+// The size of the contiguous memory area reserved at boot for large physically
+// contiguous buffers. It must be a multiple of the buddy pageblock size.
+#define CMA_SIZE            (16 * 1024 * 1024)
+
+// The number of pages around a page fault that are mapped at the same time
+// when pages are readily available. It must be a power of two, and can be set
+// to 1 to disable fault-around.
+#define VM_FAULT_AROUND     16
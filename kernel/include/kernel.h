@@ -54,6 +54,12 @@ typedef uintptr_t uptr;
 /// actually returns, so it should be used with caution.
 #define _noreturn       __attribute__((noreturn))
 
+/// A function attribute to prevent a function from being inlined in its
+/// callers. It keeps a function in its own section when its caller is in
+/// another one, like a function called from an `_init` function that must
+/// survive the release of the init section.
+#define _noinline       __attribute__((noinline))
+
 /// A function attribute to specify that a function is cold. Cold functions are
 /// functions that are called infrequently. This attribute allows the compiler
 /// to optimize the function for size and to place the function in a special
@@ -108,6 +114,12 @@ typedef uintptr_t uptr;
 /// initialized will result in undefined behaviour.
 #define _init   __attribute__((section(".init")))
 
+/// A variable attribute to specify that a variable is used only during the
+/// initialization of the kernel. Like the functions marked with `_init`, the
+/// memory used by those variables is freed when the kernel is fully
+/// initialized.
+#define _initdata   __attribute__((section(".init.data")))
+
 /// A function attribute to specify that a function must use the cdecl calling
 /// convention. The cdecl calling convention is the default calling convention
 /// used by the C programming language and is used to specify how function
@@ -0,0 +1,27 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The maximum size of the data compressed with `lz4_compress()`. The
+/// positions in the input are stored on 16 bits in the hash table.
+#define LZ4_MAX_INPUT   65536
+
+u32 lz4_compress(const void *src, u32 size, void *dst, u32 capacity);
+u32 lz4_decompress(const void *src, u32 size, void *dst, u32 capacity);
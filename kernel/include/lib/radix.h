@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The number of bits of the index used at each level of a radix tree,
+/// and the number of slots of each node.
+#define RADIX_SHIFT     6
+#define RADIX_SLOTS     (1 << RADIX_SHIFT)
+#define RADIX_MASK      (RADIX_SLOTS - 1)
+
+/// @brief The number of tags of the items of a radix tree. A tag is a bit set
+/// on some of the items, and on all the nodes above them, so that the tagged
+/// items can be found without visiting the others.
+#define RADIX_TAGS      1
+
+/**
+ * @brief A node of a radix tree. The leaves store the items, and the other
+ * nodes store their children.
+ */
+struct radix_node {
+    /// The shift of the index bits used to select a slot of the node. It is
+    /// 0 for the leaves.
+    u8 shift;
+
+    /// The number of slots in use.
+    u8 count;
+
+    /// The slot of the node in its parent.
+    u8 offset;
+
+    /// The parent node, or NULL for the root.
+    struct radix_node *parent;
+
+    /// The children or the items.
+    void *slots[RADIX_SLOTS];
+
+    /// For each tag, the slots containing a tagged item or a child with a
+    /// tagged item.
+    u64 tags[RADIX_TAGS];
+};
+
+/**
+ * @brief A radix tree mapping 32 bits indexes to non-NULL items. The height of
+ * the tree grows with the largest index, so lookups take O(log n) steps and
+ * dense ranges of indexes are stored compactly.
+ */
+struct radix_tree {
+    struct radix_node *root;
+};
+
+void radix_setup(void);
+void *radix_lookup(struct radix_tree *tree, u32 index);
+bool radix_insert(struct radix_tree *tree, u32 index, void *item);
+void *radix_delete(struct radix_tree *tree, u32 index);
+void *radix_next(struct radix_tree *tree, u32 *index);
+bool radix_tag_get(struct radix_tree *tree, u32 index, uint tag);
+bool radix_tag_set(struct radix_tree *tree, u32 index, uint tag);
+void radix_tag_clear(struct radix_tree *tree, u32 index, uint tag);
+void *radix_next_tagged(struct radix_tree *tree, u32 *index, uint tag);
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief An intrusive red-black tree node. The nodes are ordered by the user
+/// of the tree, which finds the insertion point itself before calling
+/// `rb_insert()`.
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+};
+
+/// @brief The root of a red-black tree.
+struct rb_root {
+    struct rb_node *node;
+};
+
+/// @brief A callback recomputing the augmented data of a node from the node
+/// itself and from its children, for trees that maintain data about each
+/// subtree. It can be NULL for trees that are not augmented.
+typedef void (*rb_augment_t)(struct rb_node *node);
+
+/// @brief Declare an empty red-black tree.
+#define DECLARE_RB_ROOT(name)   \
+    struct rb_root name = { NULL }
+
+/// @brief Get the container structure of a node of the tree.
+#define rb_entry(ptr, type, member) \
+    container_of(ptr, type, member)
+
+void rb_insert(struct rb_root *root, struct rb_node *node,
+               struct rb_node *parent, struct rb_node **link,
+               rb_augment_t augment);
+void rb_erase(struct rb_root *root, struct rb_node *node,
+              rb_augment_t augment);
+void rb_propagate(struct rb_node *node, rb_augment_t augment);
@@ -70,6 +70,12 @@ struct ubsan_nonnull_return_info
 	struct ubsan_source_location attr_location;
 };
 
+struct ubsan_nonnull_arg_info {
+    struct ubsan_source_location location;
+    struct ubsan_source_location attr_location;
+    int arg_index;
+};
+
 struct ubsan_ptr_overflow_info {
     struct ubsan_source_location location;
 };
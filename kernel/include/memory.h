@@ -21,3 +21,4 @@
 #define memmove(dst, src, len)  __builtin_memmove(dst, src, len)
 #define memcpy(dst, src, len)   __builtin_memcpy(dst, src, len)
 #define memset(dst, val, len)   __builtin_memset(dst, val, len)
+#define memcmp(a, b, len)       __builtin_memcmp(a, b, len)
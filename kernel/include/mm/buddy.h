@@ -26,12 +26,51 @@
 /// @brief The maximum order of a block in the buddy allocator (64 MiB blocks).
 #define BUDDY_MAX_ORDER 14
 
+/// @brief The number of pages in the largest block of the buddy allocator.
+#define BUDDY_MAX_BLOCK_PAGES   (1 << BUDDY_MAX_ORDER)
+
 /// @brief The maximum number of pages that the buddy allocator can manage.
 #define BUDDY_MAX_PAGES ((512 * 1024 * 1024) / PAGE_SIZE) 
 
 /// @brief The number of buckets in the buddy allocator.
 #define BUDDY_BUCKET_COUNT BUDDY_MAX_ORDER + 1
 
+/// @brief The order of a pageblock (4 MiB). A pageblock is the granularity at
+/// which the buddy allocator groups allocations of the same migrate type to
+/// limit the fragmentation of the physical memory.
+#define BUDDY_PAGEBLOCK_ORDER 10
+
+/// @brief No flags set for the allocation. The memory is considered as
+/// unmovable kernel memory.
+#define BUDDY_NONE          0x00
+
+/// @brief The allocated memory can be freed on demand when the system is
+/// running low on memory, for example by shrinking a cache.
+#define BUDDY_RECLAIMABLE   0x01
+
+/// @brief The allocated memory can be moved or paged out, because it is only
+/// accessed through page tables that can be updated.
+#define BUDDY_MOVABLE       0x02
+
+/// @brief The allocated memory must be filled with zeros. Single page
+/// requests are served from the pre-zeroed page pool when possible, and
+/// are zeroed inline otherwise.
+#define BUDDY_ZERO          0x04
+
+/// @brief The buddy allocator watermarks, in increasing order. Below the min
+/// watermark, only allocations that cannot wait should be served. Below the
+/// low watermark, memory should be reclaimed in the background until the
+/// high watermark is reached again.
+#define BUDDY_WMARK_MIN     0
+#define BUDDY_WMARK_LOW     1
+#define BUDDY_WMARK_HIGH    2
+#define BUDDY_WMARK_COUNT   3
+
+/// @brief The min watermark, as a fraction of the memory managed by the buddy
+/// allocator, and its lower bound in pages.
+#define BUDDY_WMARK_MIN_RATIO   128
+#define BUDDY_WMARK_MIN_PAGES   32
+
 struct buddy_block {
     struct list_head list;
 };
@@ -75,6 +114,15 @@ static inline u32 buddy_order_to_bytes(u32 order) {
 }
 
 void buddy_setup(void);
+void buddy_add_memory(u32 start, u32 end);
 void buddy_debug(void);
+void buddy_debug_info(void);
+u32 buddy_free_count(void);
+u32 buddy_available(u32 order);
+bool buddy_below_watermark(uint wmark);
+u32 buddy_watermark(uint wmark);
 void buddy_free(void *ptr, u32 order);
-void *buddy_alloc(u32 order);
+void *buddy_alloc(u32 order, uint flags);
+
+bool buddy_alloc_range(void *base, u32 count);
+void buddy_free_range(void *base, u32 count);
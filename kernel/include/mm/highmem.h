@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <config.h>
+#include <mm/page.h>
+#include <arch/paging.h>
+
+/// @brief The number of temporary kmap slots available for each CPU. This is
+/// the maximum number of highmem pages a CPU can have mapped at the same time
+/// with `kmap()`.
+#define KMAP_SLOTS_PER_CPU  16
+
+/// @brief The first fixmap slot used by the kmap slots. Slots are allocated
+/// contiguously for each CPU, starting with the first CPU.
+#define KMAP_FIXMAP_FIRST   0
+
+/// @brief The base virtual address of the kmap slots.
+#define KMAP_BASE           paging_fixmap_vaddr(KMAP_FIXMAP_FIRST)
+
+/// @brief The end virtual address of the kmap slots (exclusive).
+#define KMAP_END            paging_fixmap_vaddr(KMAP_FIXMAP_FIRST + \
+                                KMAP_SLOTS_PER_CPU * MAX_CPUS)
+
+void highmem_setup(void);
+void highmem_add_memory(u32 start, u32 end);
+void highmem_debug_info(void);
+void highmem_free(paddr addr);
+paddr highmem_alloc(void);
+
+void *kmap(paddr addr);
+void kunmap(void *ptr);
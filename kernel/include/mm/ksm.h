@@ -0,0 +1,35 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The number of page addresses scanned by a single call to
+/// `ksm_run()`, to bound the time spent in the background work.
+#define KSM_BATCH       64
+
+/// @brief The number of buckets of the hash tables of the scanned and of the
+/// merged pages. It must be a power of two.
+#define KSM_BUCKETS     256
+
+struct vm_space;
+
+void ksm_setup(void);
+void ksm_debug_info(void);
+bool ksm_run(uint budget);
+void ksm_forget_space(struct vm_space *space);
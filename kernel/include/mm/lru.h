@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <mm/page.h>
+
+/// The types of the LRU lists. Each type has an active and an inactive list.
+#define LRU_ANON    0   // Anonymous memory, mapped by the virtual memory areas
+#define LRU_FILE    1   // Cached data of files or other objects
+#define LRU_TYPES   2
+
+/// @brief The maximum number of pages scanned for each page to reclaim, to
+/// bound the work of the reclaimer when most pages are referenced.
+#define LRU_SCAN_RATIO  4
+
+/// @brief The maximum number of active pages aged in a single call to
+/// `lru_shrink()`.
+#define LRU_AGE_BATCH   64
+
+/**
+ * @brief The operations of the owner of the pages of an LRU type, used by the
+ * reclaimer to age and evict its pages.
+ */
+struct lru_ops {
+    /// @brief Test and clear the accessed bits of the mappings of a page, and
+    /// return true if the page was accessed since the last call.
+    bool (*referenced)(struct page *page);
+
+    /// @brief Evict a page already removed from the LRU lists: unmap it, save
+    /// its content if needed, and release it. Return false if the page cannot
+    /// be evicted, and the reclaimer puts it back in the lists. It is NULL
+    /// when the pages of the type cannot be evicted at all.
+    bool (*evict)(struct page *page);
+};
+
+void lru_setup(void);
+void lru_register(uint type, const struct lru_ops *ops);
+void lru_add(struct page *page, uint type);
+void lru_remove(struct page *page);
+void lru_mark_accessed(struct page *page);
+u32 lru_shrink(u32 target);
+bool lru_evict(struct page *page);
+void lru_debug_info(void);
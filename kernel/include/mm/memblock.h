@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <multiboot.h>
+#include <mm/page.h>
+
+/// @brief The maximum number of regions of each memblock type. Adjacent and
+/// overlapping regions are merged, so this is rarely reached.
+#define MEMBLOCK_MAX_REGIONS    64
+
+/// @brief The default alignment of the memory allocated with `memblock_alloc`
+/// and `memblock_phys_alloc`.
+#define MEMBLOCK_ALIGN          16
+
+/// @brief Iterate over the regions of a memblock type. In the loop body, a
+/// variable `region` points to the current region.
+#define memblock_foreach(type, region)                          \
+    for (struct memblock_region *region = (type)->regions;      \
+         region < (type)->regions + (type)->count;              \
+         region++)
+
+/**
+ * @brief A region of physical memory. Regions use 64 bits addresses, so that
+ * the end of the last region can be represented even if it is the end of the
+ * physical address space.
+ */
+struct memblock_region {
+    /// @brief The first physical address of the region.
+    u64 base;
+
+    /// @brief The end physical address of the region (exclusive).
+    u64 end;
+};
+
+/**
+ * @brief A set of sorted, disjoint and non-adjacent regions.
+ */
+struct memblock_type {
+    /// @brief The number of regions in the set.
+    uint count;
+
+    /// @brief The regions, sorted by address.
+    struct memblock_region regions[MEMBLOCK_MAX_REGIONS];
+};
+
+/// The early memory allocator is only used during the boot: its code and its
+/// data are in the init section and are freed once the kernel is initialized.
+extern struct memblock_type memblock_memory;
+extern struct memblock_type memblock_reserved;
+
+void memblock_setup(struct mb_info *mb_info);
+void memblock_add(u64 base, u64 size);
+void memblock_reserve(u64 base, u64 size);
+void memblock_free(u64 base, u64 size);
+void memblock_finish(void);
+u64 memblock_end(void);
+
+paddr memblock_phys_alloc(u32 size, u32 align);
+void *memblock_alloc(u32 size, u32 align);
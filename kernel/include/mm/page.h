@@ -20,6 +20,7 @@
 #include <kernel.h>
 #include <multiboot.h>
 #include <arch/x86.h>
+#include <lib/list.h>
 
 #define PAGE_SIZE   4096
 #define PAGE_SHIFT  12
@@ -30,11 +31,83 @@
 #define PG_POISONED 0x08    // Poisoned memory, cannot be used
 #define PG_LOCKED   0x10    // Locked memory, cannot be swapped/paged out
 #define PG_BUDDY    0x20    // Handled by the buddy allocator
+#define PG_HIGHMEM  0x40    // Not permanently mapped in the kernel space
+#define PG_LRU      0x80    // On the LRU lists of the reclaimer
+
+/// The LRU state of a page, only meaningful with PG_LRU. These flags use the
+/// bits above the migrate type.
+#define PG_ACTIVE       0x0800  // On an active LRU list
+#define PG_REFERENCED   0x1000  // Referenced since it was last scanned
+#define PG_LRU_FILE     0x2000  // On the file LRU lists, not anonymous ones
+
+/// The page was merged with identical pages by the same-page merging. It is
+/// always copied on write, even when it is not shared anymore.
+#define PG_KSM          0x4000
+
+/// The page of the page cache whose access starts the next readahead window.
+#define PG_READAHEAD    0x8000
+
+/// The migrate type of a pageblock, stored in the flags of the first page of
+/// each pageblock. The migrate type is used by the buddy allocator to group
+/// allocations with the same mobility together and limit fragmentation.
+#define PG_MIGRATE_SHIFT    8
+#define PG_MIGRATE_MASK     (0x07 << PG_MIGRATE_SHIFT)
+
+/// The section containing the page, stored in the flags of each page so that
+/// the physical address of a page can be found from its page information
+/// structure.
+#define PG_SECTION_SHIFT    16
+#define PG_SECTION_MASK     (0x3FF << PG_SECTION_SHIFT)
+
+#define MIGRATE_UNMOVABLE   0   // Kernel memory that cannot be moved
+#define MIGRATE_RECLAIMABLE 1   // Kernel memory that can be freed on demand
+#define MIGRATE_MOVABLE     2   // Memory that can be moved or paged out
+#define MIGRATE_CMA         3   // Contiguous area, lent to movable memory
+#define MIGRATE_TYPES       4
+
+/// The end of the low memory, i.e. the physical memory permanently mapped in
+/// the kernel address space by the boot code. Memory above this limit is high
+/// memory and must be temporarily mapped with `kmap()` to be accessed.
+#define LOWMEM_END  0x20000000
+
+/// The physical memory is divided in sections of 64 MiB, and only the
+/// sections containing usable memory have page information structures. The
+/// first section is initialized synchronously by `page_setup()`, and the
+/// others later by `page_deferred_init()`. A section must be a multiple of
+/// the largest buddy allocator block.
+#define PAGE_SECTION_SHIFT  14
+#define PAGE_SECTION_PAGES  (1 << PAGE_SECTION_SHIFT)
+#define PAGE_SECTION_COUNT  (PADDR_END >> (PAGE_SHIFT + PAGE_SECTION_SHIFT))
+
+/// The maximum number of physical memory ranges of a same type tracked by the
+/// page allocator to initialize the page array.
+#define PAGE_MAX_RANGES     64
+
+struct page {
+    u32 flags;
+    u8 order;
+    u16 count;
+
+    /// A list node that can be used by the owner of the page to link it into
+    /// its own lists, for example the free list of the highmem zone or the
+    /// LRU lists.
+    struct list_head list;
+
+    /// The owner of a page on the LRU lists, and the position of the page in
+    /// it: for an anonymous page, an area mapping it and its virtual address.
+    void *mapping;
+    u32 index;
+};
 
 void page_debug_info(void);
 
 void page_setup(struct mb_info *mb_info);
+bool page_deferred_init(void);
+void page_free_init_memory(void);
+u32 page_pfn_end(void);
+bool page_range_free(paddr start, paddr end);
 struct page *page_info(paddr addr);
+paddr page_paddr(struct page *pg);
 
 /**
  * @brief Check if a physical address is compatible with the BIOS, i.e. if it
@@ -70,7 +143,7 @@ static inline bool page_isa_compatible(paddr addr) {
  * @return false if the address is not compatible with low memory.
  */
 static inline bool page_lowmem_compatible(paddr addr) {
-    return addr < 0x20000000;
+    return addr < LOWMEM_END;
 }
 
 /**
@@ -83,7 +156,7 @@ static inline bool page_lowmem_compatible(paddr addr) {
  * the page frame number is out of range of the physical memory.
  */
 static inline struct page *page_pfn_info(u32 idx) {
-    return page_info(idx << PAGE_SHIFT);
+    return page_info((paddr) idx << PAGE_SHIFT);
 }
 
 /**
@@ -91,10 +164,10 @@ static inline struct page *page_pfn_info(u32 idx) {
  * be seen as the size in the specified unit of pages. 
  * 
  * @param pfn The page frame number to convert in bytes.
- * @return u32 The offset in bytes.
+ * @return paddr The offset in bytes.
  */
-static inline u32 page_pnf_to_offset(u32 pfn) {
-    return pfn << PAGE_SHIFT;
+static inline paddr page_pnf_to_offset(u32 pfn) {
+    return (paddr) pfn << PAGE_SHIFT;
 }
 
 /**
@@ -107,8 +180,23 @@ static inline u32 page_pfn(paddr addr) {
     return addr >> PAGE_SHIFT;
 }
 
-struct page {
-    u8 flags;
-    u8 order;
-    u16 count;
-};
+/**
+ * @brief Get the migrate type stored in the flags of a page.
+ * 
+ * @param pg The page information structure.
+ * @return uint The migrate type of the page (one of the MIGRATE_* values).
+ */
+static inline uint page_migratetype(struct page *pg) {
+    return (pg->flags & PG_MIGRATE_MASK) >> PG_MIGRATE_SHIFT;
+}
+
+/**
+ * @brief Set the migrate type stored in the flags of a page, without
+ * modifying the other flags.
+ * 
+ * @param pg The page information structure.
+ * @param type The migrate type (one of the MIGRATE_* values).
+ */
+static inline void page_set_migratetype(struct page *pg, uint type) {
+    pg->flags = (pg->flags & ~PG_MIGRATE_MASK) | (type << PG_MIGRATE_SHIFT);
+}
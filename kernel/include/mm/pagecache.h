@@ -0,0 +1,104 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <lib/list.h>
+#include <lib/radix.h>
+
+/// @brief The radix tree tag of the dirty pages of an object.
+#define PAGECACHE_TAG_DIRTY     0
+
+/// @brief The size of the first readahead window of a sequential read, and
+/// the largest window, in pages. The window grows between the two as long as
+/// the reads stay sequential.
+#define PAGECACHE_RA_INIT       4
+#define PAGECACHE_RA_MAX        32
+
+/// @brief The maximum number of pages written back in a single call to
+/// `pagecache_writeback()`, to bound the time spent in the background work.
+#define PAGECACHE_WRITEBACK_BATCH   16
+
+struct pagecache_object;
+
+/**
+ * @brief The operations of the backing store of a cached object, like a file
+ * or a block device.
+ */
+struct pagecache_ops {
+    /// @brief Read a page of the object. Return false on an I/O error.
+    bool (*read)(struct pagecache_object *object, u32 index, void *page);
+
+    /// @brief Write a page of the object. Return false on an I/O error.
+    bool (*write)(struct pagecache_object *object, u32 index,
+        const void *page);
+};
+
+/**
+ * @brief The readahead state of an object. A read following the previous one
+ * reads a window of pages ahead, and the access to the marked page of the
+ * window (PG_READAHEAD) reads the next window, twice as large, before the
+ * reader needs it. A random read resets the window.
+ */
+struct pagecache_readahead {
+    /// The first page of the last window.
+    u32 start;
+
+    /// The size of the last window, in pages, or 0 after a random read.
+    u32 size;
+
+    /// The last page read, to detect the sequential reads.
+    u32 prev;
+};
+
+/**
+ * @brief An object whose pages are cached, indexed by their position in the
+ * object. The pages are on the file LRU lists, and their `mapping` and
+ * `index` fields are the object and the position.
+ */
+struct pagecache_object {
+    /// The operations of the backing store.
+    const struct pagecache_ops *ops;
+
+    /// The size of the object, in pages.
+    u32 size;
+
+    /// The cached pages, tagged with PAGECACHE_TAG_DIRTY when they have been
+    /// modified and must be written back.
+    struct radix_tree pages;
+
+    /// The number of cached pages, and of dirty pages.
+    uint nrpages;
+    uint nrdirty;
+
+    /// The readahead state.
+    struct pagecache_readahead ra;
+
+    /// A list node to link the object in the list of the objects with dirty
+    /// pages.
+    struct list_head dirty_node;
+};
+
+void pagecache_setup(void);
+void pagecache_debug_info(void);
+void pagecache_object_init(struct pagecache_object *object,
+    const struct pagecache_ops *ops, u32 size);
+void pagecache_object_release(struct pagecache_object *object);
+void *pagecache_read(struct pagecache_object *object, u32 index);
+bool pagecache_mark_dirty(struct pagecache_object *object, u32 index);
+bool pagecache_writeback(uint budget);
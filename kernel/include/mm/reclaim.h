@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <lib/list.h>
+
+/// @brief The maximum number of pages the background reclaimer tries to free
+/// in a single call to `reclaim_run()`, to bound the time spent in the
+/// background work.
+#define RECLAIM_BATCH   64
+
+/**
+ * @brief A shrinker is a subsystem that holds memory which can be freed on
+ * demand, like the empty slubs of the slub caches. Shrinkers are called by
+ * the reclaimer when the number of free pages is running low.
+ */
+struct shrinker {
+    /// @brief The name of the shrinker, used for debugging purposes.
+    const char *name;
+
+    /// @brief Free up to the given number of pages, and return the number of
+    /// pages actually freed. A shrinker that has nothing left to free must
+    /// return 0.
+    u32 (*shrink)(u32 target);
+
+    /// @brief The number of pages freed by this shrinker since boot.
+    u32 reclaimed;
+
+    /// @brief A list node to link the shrinker in the shrinker list.
+    struct list_head node;
+};
+
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+
+void reclaim_wakeup(void);
+void reclaim_debug_info(void);
+bool reclaim_run(u32 budget);
+u32 reclaim_direct(u32 target);
@@ -42,6 +42,11 @@
 /// when allocating and freeing objects.
 #define SLUB_DEBUG      0x02
 
+/// @brief When set, the objects of the cache can be freed on demand when the
+/// system is running low on memory. The slubs of such caches are allocated
+/// in reclaimable pageblocks to keep them away from unmovable memory.
+#define SLUB_RECLAIMABLE 0x04
+
 /**
  * @brief The structure representing a slub cache. A slub cache is a collection
  * of slubs that are used to allocate objects of a specific size. Slub caches
@@ -94,6 +99,10 @@ struct slub_cache {
     /// objects. These slubs cannot be used for new allocations until at least
     /// one object is freed from them.
     struct list_head full_slubs;
+
+    /// @brief A list node to link the cache in the list of all caches, used
+    /// to shrink the caches when the system is running low on memory.
+    struct list_head cache_node;
 };
 
 /**
@@ -130,6 +139,7 @@ void slub_setup(void);
 void slub_free(struct slub_cache *cache, void *ptr);
 void *slub_alloc(struct slub_cache *cache);
 void slub_destroy_cache(struct slub_cache *cache);
+u32 slub_shrink_cache(struct slub_cache *cache, u32 target);
 struct slub_cache *slub_create_cache(
     const char *name,
     u16 obj_size,
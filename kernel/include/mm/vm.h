@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <lib/list.h>
+#include <lib/rbtree.h>
+#include <arch/paging.h>
+
+/// The area can be written.
+#define VM_WRITE        0x01
+
+/// The area can be executed.
+#define VM_EXEC         0x02
+
+/// The area is accessible from the user mode.
+#define VM_USER         0x04
+
+/// The pages of the area can be merged with identical pages by the same-page
+/// merging scanner.
+#define VM_MERGEABLE    0x08
+
+/// The number of buckets of the page fault latency histograms. The bucket `i`
+/// counts the faults resolved in [2^i, 2^(i+1)) cycles, and the last bucket
+/// also counts all the slower faults.
+#define VM_FAULT_BUCKETS    24
+
+/**
+ * @brief A range of virtual memory whose pages are allocated and mapped on
+ * demand, when they are first accessed. The pages are anonymous and zeroed.
+ * The `count` field of the page information structure of each mapped page is
+ * the number of address spaces mapping it: pages shared after a clone are
+ * mapped read-only and are copied on the first write. Each page also records
+ * one area mapping it, so that the reclaimer can check its accessed bit.
+ */
+struct vm_area {
+    /// The first address of the area, page aligned.
+    vaddr start;
+
+    /// The end of the area (exclusive), page aligned.
+    vaddr end;
+
+    /// The access rights of the area (VM_*).
+    uint flags;
+
+    /// The address space containing the area.
+    struct vm_space *space;
+
+    /// A list node to link the area in its address space, sorted by address.
+    struct list_head node;
+
+    /// A node of the tree of the areas of the address space, sorted by
+    /// address.
+    struct rb_node rb;
+
+    /// The largest free gap before an area of the subtree of this area, the
+    /// gap before an area being the space between the end of the previous
+    /// area and its start. It is used to find free space in O(log n).
+    u32 subtree_gap;
+};
+
+/**
+ * @brief An address space, made of a page directory and of the areas that
+ * can be mapped on demand inside it. The areas are both in a sorted list, to
+ * iterate over them and to find the neighbours of an area, and in a tree
+ * augmented with the free gaps, to find an area or free space in O(log n).
+ */
+struct vm_space {
+    /// The page directory of the address space.
+    struct page_directory *pd;
+
+    /// The areas of the address space, sorted by address.
+    struct list_head areas;
+
+    /// The tree of the areas of the address space.
+    struct rb_root tree;
+
+    /// A list node to link the address space in the list of all the address
+    /// spaces.
+    struct list_head node;
+};
+
+extern struct vm_space vm_kernel_space;
+extern struct list_head vm_spaces;
+
+void vm_setup(void);
+struct vm_space *vm_space_create(void);
+struct vm_space *vm_space_clone(struct vm_space *src);
+void vm_space_destroy(struct vm_space *space);
+void vm_switch(struct vm_space *space);
+void vm_debug_info(void);
+struct vm_area *vm_area_find(struct vm_space *space, vaddr addr);
+struct vm_area *vm_area_find_next(struct vm_space *space, vaddr addr);
+struct vm_area *vm_area_create(struct vm_space *space, vaddr start, u32 size,
+    uint flags);
+struct vm_area *vm_area_alloc(struct vm_space *space, u32 size, uint flags,
+    vaddr low, vaddr high);
+vaddr vm_space_find_gap(struct vm_space *space, u32 size, vaddr low,
+    vaddr high);
+void vm_area_destroy(struct vm_space *space, struct vm_area *area);
+bool vm_fault(vaddr addr, u32 error);
+u32 vm_fault_count(void);
+paddr vm_page_private(struct vm_space *space, vaddr va);
+bool vm_page_merge(struct vm_space *space, vaddr va, paddr pa,
+    paddr target);
@@ -0,0 +1,30 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The number of lazily freed pages after which the freed virtual
+/// ranges are purged: the TLB is flushed once for all of them and their
+/// ranges become available again.
+#define VMALLOC_LAZY_MAX    8192
+
+void *vmalloc(u32 size);
+void vfree(void *ptr);
+void vmalloc_purge(void);
+void vmalloc_debug_info(void);
@@ -0,0 +1,34 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The number of pre-zeroed pages kept in the pool for each migrate
+/// type. The pool is refilled up to this number when the CPU is idle.
+#define ZERO_POOL_TARGET    64
+
+/// @brief The number of pages zeroed by a single call to `zero_pool_refill()`,
+/// to bound the time spent in the background work.
+#define ZERO_POOL_BATCH     16
+
+void zero_pool_setup(void);
+void zero_pool_debug_info(void);
+void *zero_pool_get(uint type);
+bool zero_pool_refill(uint budget);
+uint zero_pool_drain(void);
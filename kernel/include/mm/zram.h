@@ -0,0 +1,42 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+/// @brief The number of pages that can be stored in the compressed swap, i.e.
+/// 64 MiB of uncompressed memory.
+#define ZRAM_SLOTS          16384
+
+/// @brief The compressed pages are allocated from size classes multiple of
+/// ZRAM_CLASS_SIZE bytes. A page that does not compress below ZRAM_MAX_SIZE
+/// bytes is stored uncompressed in a whole page.
+#define ZRAM_CLASS_SIZE     64
+#define ZRAM_MAX_SIZE       3072
+#define ZRAM_CLASSES        (ZRAM_MAX_SIZE / ZRAM_CLASS_SIZE)
+
+/// @brief The number of buckets of the page-in latency histogram, like the
+/// page fault latency histograms.
+#define ZRAM_LATENCY_BUCKETS    24
+
+void zram_setup(void);
+void zram_debug_info(void);
+u32 zram_store(const void *page);
+void zram_load(u32 slot, void *page);
+void zram_dup(u32 slot);
+void zram_free(u32 slot);
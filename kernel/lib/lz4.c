@@ -0,0 +1,272 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/lz4.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+
+/// The number of bits of the hash of 4 bytes, used to index the hash table of
+/// the last positions where each hash was seen.
+#define LZ4_HASH_BITS       12
+
+/// The minimum length of a match.
+#define LZ4_MIN_MATCH       4
+
+/// The format requires the last 5 bytes to be literals, and the last match to
+/// start at least 12 bytes before the end of the input.
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MATCH_LIMIT     12
+
+/// The maximum distance between a match and its reference.
+#define LZ4_MAX_OFFSET      65535
+
+/// The number of missed positions after which the search starts to skip
+/// bytes, to go faster through incompressible data.
+#define LZ4_SKIP_TRIGGER    6
+
+/// The position of the last occurrence of each hash in the input. There is
+/// a single CPU, so the table is static instead of taking 8 KiB of stack.
+static u16 lz4_table[1 << LZ4_HASH_BITS];
+
+/**
+ * @brief Read 4 bytes at any alignment.
+ * 
+ * @param ptr The address of the bytes.
+ * @return u32 The bytes, as a little endian integer.
+ */
+static inline u32 lz4_read32(const u8 *ptr)
+{
+    u32 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Hash 4 bytes of the input.
+ * 
+ * @param value The bytes.
+ * @return uint The index of the bytes in the hash table.
+ */
+static inline uint lz4_hash(u32 value)
+{
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * @brief Write the extension bytes of a length that does not fit in the 4
+ * bits of a token.
+ * 
+ * @param op The output pointer.
+ * @param length The length, minus 15.
+ * @return u8* The output pointer after the extension bytes.
+ */
+static u8 *lz4_write_length(u8 *op, u32 length)
+{
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/**
+ * @brief Write a sequence: a token, the literals, and the offset and length
+ * of the match that follows them if any.
+ * 
+ * @param op The output pointer.
+ * @param oend The end of the output buffer.
+ * @param literals The literals.
+ * @param count The number of literals.
+ * @param offset The offset of the match, or 0 for the last sequence.
+ * @param length The length of the match, minus LZ4_MIN_MATCH.
+ * @return u8* The output pointer after the sequence, or NULL if the output
+ * buffer is too small.
+ */
+static u8 *lz4_write_sequence(u8 *op, u8 *oend, const u8 *literals,
+    u32 count, u32 offset, u32 length)
+{
+    // This bound counts a few more bytes than needed, but it avoids checking
+    // the capacity before each byte.
+    if ((u32) (oend - op) < count + count / 255 + length / 255 + 5) {
+        return NULL;
+    }
+
+    u8 *token = op++;
+    *token = min(count, 15u) << 4;
+    if (count >= 15) {
+        op = lz4_write_length(op, count - 15);
+    }
+    memcpy(op, literals, count);
+    op += count;
+
+    if (offset != 0) {
+        *token |= min(length, 15u);
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        if (length >= 15) {
+            op = lz4_write_length(op, length - 15);
+        }
+    }
+    return op;
+}
+
+/**
+ * @brief Compress data in the LZ4 block format. The matches are found with
+ * a hash table of the last position of each 4 bytes sequence, which is fast
+ * but does not find the longest matches.
+ * 
+ * @param src The data to compress.
+ * @param size The size of the data, at most LZ4_MAX_INPUT bytes.
+ * @param dst The output buffer.
+ * @param capacity The size of the output buffer.
+ * @return u32 The size of the compressed data, or 0 if it does not fit in
+ * the output buffer.
+ */
+u32 lz4_compress(const void *src, u32 size, void *dst, u32 capacity)
+{
+    assert(size <= LZ4_MAX_INPUT);
+    const u8 *base = src;
+    const u8 *iend = base + size;
+    const u8 *ip = base;
+    const u8 *anchor = base;
+    u8 *op = dst;
+    u8 *oend = op + capacity;
+
+    memset(lz4_table, 0, sizeof(lz4_table));
+    while (size >= LZ4_MATCH_LIMIT && ip <= iend - LZ4_MATCH_LIMIT) {
+        const u32 sequence = lz4_read32(ip);
+        const uint hash = lz4_hash(sequence);
+        const u8 *ref = base + lz4_table[hash];
+        lz4_table[hash] = ip - base;
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+            lz4_read32(ref) != sequence) {
+            ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+            continue;
+        }
+
+        // Extend the match forward, 4 bytes at a time first.
+        const u8 *limit = iend - LZ4_LAST_LITERALS;
+        const u8 *match = ip + LZ4_MIN_MATCH;
+        ref += LZ4_MIN_MATCH;
+        while (match + 4 <= limit && lz4_read32(match) == lz4_read32(ref)) {
+            match += 4;
+            ref += 4;
+        }
+        while (match < limit && *match == *ref) {
+            match++;
+            ref++;
+        }
+
+        op = lz4_write_sequence(op, oend, anchor, ip - anchor, match - ref,
+            match - ip - LZ4_MIN_MATCH);
+        if (op == NULL) {
+            return 0;
+        }
+        ip = anchor = match;
+    }
+
+    op = lz4_write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op != NULL ? op - (u8 *) dst : 0;
+}
+
+/**
+ * @brief Read the extension bytes of a length.
+ * 
+ * @param ip The input pointer, updated after the extension bytes.
+ * @param iend The end of the input.
+ * @param length The length, updated with the extension bytes.
+ * @return true If the length was read.
+ * @return false If the input is truncated.
+ */
+static bool lz4_read_length(const u8 **ip, const u8 *iend, u32 *length)
+{
+    u8 byte;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * @brief Decompress data in the LZ4 block format. The input is checked, so a
+ * corrupted input never reads or writes outside of the buffers.
+ * 
+ * @param src The compressed data.
+ * @param size The size of the compressed data.
+ * @param dst The output buffer.
+ * @param capacity The size of the output buffer.
+ * @return u32 The size of the decompressed data, or 0 if the input is
+ * corrupted or does not fit in the output buffer.
+ */
+u32 lz4_decompress(const void *src, u32 size, void *dst, u32 capacity)
+{
+    const u8 *ip = src;
+    const u8 *iend = ip + size;
+    u8 *op = dst;
+    u8 *oend = op + capacity;
+
+    while (ip < iend) {
+        const u8 token = *ip++;
+        u32 count = token >> 4;
+        if (count == 15 && !lz4_read_length(&ip, iend, &count)) {
+            return 0;
+        } else if (count > (u32) (iend - ip) || count > (u32) (oend - op)) {
+            return 0;
+        }
+        memcpy(op, ip, count);
+        op += count;
+        ip += count;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        const u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        u32 length = token & 15;
+        if (length == 15 && !lz4_read_length(&ip, iend, &length)) {
+            return 0;
+        }
+        length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (u32) (op - (u8 *) dst) ||
+            length > (u32) (oend - op)) {
+            return 0;
+        }
+
+        // The match may overlap the output when the offset is smaller than
+        // the length, to repeat a short pattern.
+        const u8 *ref = op - offset;
+        if (offset >= length) {
+            memcpy(op, ref, length);
+            op += length;
+        } else {
+            for (u32 i = 0; i < length; i++) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - (u8 *) dst;
+}
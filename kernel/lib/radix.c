@@ -0,0 +1,421 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/math.h>
+#include <lib/radix.h>
+#include <lib/assert.h>
+#include <mm/slub.h>
+
+/// The pseudo-tag used to search any item instead of the tagged ones.
+#define RADIX_ANY   RADIX_TAGS
+
+/// The maximum number of nodes on the path from the root to a leaf, for 32
+/// bits indexes.
+#define RADIX_MAX_PATH  ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+/// The maximum number of nodes created by an insertion: a leaf root may grow
+/// up to the highest level, and a new path is then created below the top.
+#define RADIX_MAX_NEW   (2 * (RADIX_MAX_PATH - 1))
+
+/// The cache used to allocate the nodes of all the radix trees.
+static struct slub_cache *radix_node_cache = NULL;
+
+/**
+ * @brief Setup the radix trees. This function must be called after the slub
+ * allocator has been initialized.
+ */
+_init
+void radix_setup(void)
+{
+    radix_node_cache = slub_create_cache(
+        "radix_node", sizeof(struct radix_node), 0, 0, SLUB_NONE);
+    if (radix_node_cache == NULL) {
+        panic("Failed to create the radix node cache");
+    }
+}
+
+/**
+ * @brief Initialize an empty node.
+ * 
+ * @param node The node, allocated from the node cache.
+ * @param shift The shift of the index bits used by the node.
+ * @param parent The parent of the node, or NULL.
+ * @param offset The slot of the node in its parent.
+ * @return struct radix_node* The node.
+ */
+static struct radix_node *radix_node_init(struct radix_node *node,
+    uint shift, struct radix_node *parent, uint offset)
+{
+    memset(node, 0, sizeof(struct radix_node));
+    node->shift = shift;
+    node->parent = parent;
+    node->offset = offset;
+    return node;
+}
+
+/**
+ * @brief Check if an index is inside the range covered by a node used as the
+ * root of a tree.
+ * 
+ * @param node The node.
+ * @param index The index.
+ * @return true If the index is covered by the node.
+ */
+static inline bool radix_covers(const struct radix_node *node, u32 index)
+{
+    return ((u64) index >> node->shift) < RADIX_SLOTS;
+}
+
+/**
+ * @brief Get the shift of the lowest root covering an index.
+ * 
+ * @param index The index.
+ * @return uint The shift of the root.
+ */
+static uint radix_root_shift(u32 index)
+{
+    uint shift = 0;
+    while (((u64) index >> shift) >= RADIX_SLOTS) {
+        shift += RADIX_SHIFT;
+    }
+    return shift;
+}
+
+/**
+ * @brief Count the nodes that inserting an item at an index would create: the
+ * new roots needed to cover the index, and the missing nodes on its path.
+ * When the tree grows, the path of the index leaves the old root right below
+ * the new top node, so all the nodes of its path are new.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @return uint The number of nodes to create.
+ */
+static uint radix_missing(const struct radix_tree *tree, u32 index)
+{
+    const uint shift = radix_root_shift(index);
+    const struct radix_node *node = tree->root;
+    if (node == NULL) {
+        return shift / RADIX_SHIFT + 1;
+    } else if (!radix_covers(node, index)) {
+        return (shift - node->shift) / RADIX_SHIFT + shift / RADIX_SHIFT;
+    }
+
+    uint missing = node->shift / RADIX_SHIFT;
+    while (node != NULL && node->shift > 0) {
+        node = node->slots[(index >> node->shift) & RADIX_MASK];
+        missing -= (node != NULL) ? 1 : 0;
+    }
+    return missing;
+}
+
+/**
+ * @brief Find the leaf whose slots contain an index.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @return struct radix_node* The leaf, or NULL if there is none.
+ */
+static struct radix_node *radix_leaf(struct radix_tree *tree, u32 index)
+{
+    struct radix_node *node = tree->root;
+    if (node == NULL || !radix_covers(node, index)) {
+        return NULL;
+    }
+
+    while (node != NULL && node->shift > 0) {
+        node = node->slots[(index >> node->shift) & RADIX_MASK];
+    }
+    return node;
+}
+
+/**
+ * @brief Release the empty nodes from a node up to the root, then remove the
+ * root while it only has a child in its first slot, to keep the tree as low
+ * as possible.
+ * 
+ * @param tree The tree.
+ * @param node The first node that may be empty.
+ */
+static void radix_prune(struct radix_tree *tree, struct radix_node *node)
+{
+    while (node != NULL && node->count == 0) {
+        struct radix_node *parent = node->parent;
+        if (parent != NULL) {
+            parent->slots[node->offset] = NULL;
+            parent->count--;
+        } else {
+            tree->root = NULL;
+        }
+        slub_free(radix_node_cache, node);
+        node = parent;
+    }
+
+    struct radix_node *root = tree->root;
+    while (root != NULL && root->shift > 0 && root->count == 1 &&
+        root->slots[0] != NULL) {
+        struct radix_node *child = root->slots[0];
+        child->parent = NULL;
+        tree->root = child;
+        slub_free(radix_node_cache, root);
+        root = child;
+    }
+}
+
+/**
+ * @brief Get the item at an index.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @return void* The item, or NULL if there is none.
+ */
+void *radix_lookup(struct radix_tree *tree, u32 index)
+{
+    struct radix_node *leaf = radix_leaf(tree, index);
+    return leaf != NULL ? leaf->slots[index & RADIX_MASK] : NULL;
+}
+
+/**
+ * @brief Insert an item at an index. The tree is first made high enough to
+ * cover the index, then the missing nodes on the path are created.
+ * 
+ * The nodes are all allocated before the tree is changed: an allocation may
+ * reclaim memory, and the reclaimer may remove items of this very tree and
+ * release or collapse the nodes being linked. Since the tree may shrink
+ * during an allocation, the missing nodes are counted again after each one.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @param item The item, which must not be NULL.
+ * @return true If the item was inserted.
+ * @return false If the index is already used, or if there is no memory left.
+ */
+bool radix_insert(struct radix_tree *tree, u32 index, void *item)
+{
+    assert(item != NULL);
+    struct radix_node *spare[RADIX_MAX_NEW];
+    uint spares = 0;
+    while (spares < radix_missing(tree, index)) {
+        spare[spares] = slub_alloc(radix_node_cache);
+        if (spare[spares] == NULL) {
+            while (spares > 0) {
+                slub_free(radix_node_cache, spare[--spares]);
+            }
+            return false;
+        }
+        spares++;
+    }
+
+    if (tree->root == NULL) {
+        tree->root = radix_node_init(spare[--spares],
+            radix_root_shift(index), NULL, 0);
+    }
+
+    while (!radix_covers(tree->root, index)) {
+        struct radix_node *root = tree->root;
+        struct radix_node *node = radix_node_init(spare[--spares],
+            root->shift + RADIX_SHIFT, NULL, 0);
+        node->slots[0] = root;
+        node->count = 1;
+        for (uint tag = 0; tag < RADIX_TAGS; tag++) {
+            node->tags[tag] = root->tags[tag] != 0;
+        }
+        root->parent = node;
+        tree->root = node;
+    }
+
+    struct radix_node *node = tree->root;
+    while (node->shift > 0) {
+        const uint offset = (index >> node->shift) & RADIX_MASK;
+        if (node->slots[offset] == NULL) {
+            node->slots[offset] = radix_node_init(spare[--spares],
+                node->shift - RADIX_SHIFT, node, offset);
+            node->count++;
+        }
+        node = node->slots[offset];
+    }
+    while (spares > 0) {
+        slub_free(radix_node_cache, spare[--spares]);
+    }
+
+    const uint offset = index & RADIX_MASK;
+    if (node->slots[offset] != NULL) {
+        return false;
+    }
+    node->slots[offset] = item;
+    node->count++;
+    return true;
+}
+
+/**
+ * @brief Remove the item at an index, with its tags.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @return void* The removed item, or NULL if there was none.
+ */
+void *radix_delete(struct radix_tree *tree, u32 index)
+{
+    struct radix_node *leaf = radix_leaf(tree, index);
+    const uint offset = index & RADIX_MASK;
+    void *item = leaf != NULL ? leaf->slots[offset] : NULL;
+    if (item == NULL) {
+        return NULL;
+    }
+
+    for (uint tag = 0; tag < RADIX_TAGS; tag++) {
+        radix_tag_clear(tree, index, tag);
+    }
+    leaf->slots[offset] = NULL;
+    leaf->count--;
+    radix_prune(tree, leaf);
+    return item;
+}
+
+/**
+ * @brief Check if the item at an index has a tag.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @param tag The tag.
+ * @return true If there is an item at this index, and it has the tag.
+ */
+bool radix_tag_get(struct radix_tree *tree, u32 index, uint tag)
+{
+    assert(tag < RADIX_TAGS);
+    struct radix_node *leaf = radix_leaf(tree, index);
+    return leaf != NULL && (leaf->tags[tag] >> (index & RADIX_MASK)) & 1;
+}
+
+/**
+ * @brief Set a tag on the item at an index, and on all the nodes above it.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @param tag The tag.
+ * @return true If the tag was set.
+ * @return false If there is no item at this index.
+ */
+bool radix_tag_set(struct radix_tree *tree, u32 index, uint tag)
+{
+    assert(tag < RADIX_TAGS);
+    struct radix_node *node = radix_leaf(tree, index);
+    uint offset = index & RADIX_MASK;
+    if (node == NULL || node->slots[offset] == NULL) {
+        return false;
+    }
+
+    for (; node != NULL; offset = node->offset, node = node->parent) {
+        node->tags[tag] |= 1ull << offset;
+    }
+    return true;
+}
+
+/**
+ * @brief Clear a tag on the item at an index, and on the nodes above it that
+ * do not have another tagged item below them.
+ * 
+ * @param tree The tree.
+ * @param index The index.
+ * @param tag The tag.
+ */
+void radix_tag_clear(struct radix_tree *tree, u32 index, uint tag)
+{
+    assert(tag < RADIX_TAGS);
+    struct radix_node *node = radix_leaf(tree, index);
+    uint offset = index & RADIX_MASK;
+    while (node != NULL) {
+        node->tags[tag] &= ~(1ull << offset);
+        if (node->tags[tag] != 0) {
+            break;
+        }
+        offset = node->offset;
+        node = node->parent;
+    }
+}
+
+/**
+ * @brief Find the first item of a subtree at or after an index.
+ * 
+ * @param node The root of the subtree.
+ * @param base The first index covered by the subtree.
+ * @param start The first index to search, covered by the subtree.
+ * @param tag The tag of the items to find, or RADIX_ANY.
+ * @param found Set to the index of the item found.
+ * @return void* The item, or NULL if there is none.
+ */
+static void *radix_find(const struct radix_node *node, u32 base, u32 start,
+    uint tag, u32 *found)
+{
+    for (uint offset = (start - base) >> node->shift; offset < RADIX_SLOTS;
+        offset++) {
+        void *slot = node->slots[offset];
+        if (slot == NULL ||
+            (tag != RADIX_ANY && !((node->tags[tag] >> offset) & 1))) {
+            continue;
+        }
+
+        const u32 slot_base = base + (offset << node->shift);
+        if (node->shift == 0) {
+            *found = slot_base;
+            return slot;
+        }
+
+        void *item = radix_find(slot, slot_base, max(start, slot_base), tag,
+            found);
+        if (item != NULL) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the first item at or after an index, to iterate over the items
+ * of a tree in the order of their indexes.
+ * 
+ * @param tree The tree.
+ * @param index The first index to search, set to the index of the item found.
+ * @return void* The item, or NULL if there is none.
+ */
+void *radix_next(struct radix_tree *tree, u32 *index)
+{
+    if (tree->root == NULL || !radix_covers(tree->root, *index)) {
+        return NULL;
+    }
+    return radix_find(tree->root, 0, *index, RADIX_ANY, index);
+}
+
+/**
+ * @brief Find the first item with a tag at or after an index. Only the nodes
+ * with tagged items are visited.
+ * 
+ * @param tree The tree.
+ * @param index The first index to search, set to the index of the item found.
+ * @param tag The tag.
+ * @return void* The item, or NULL if there is none.
+ */
+void *radix_next_tagged(struct radix_tree *tree, u32 *index, uint tag)
+{
+    assert(tag < RADIX_TAGS);
+    if (tree->root == NULL || !radix_covers(tree->root, *index)) {
+        return NULL;
+    }
+    return radix_find(tree->root, 0, *index, tag, index);
+}
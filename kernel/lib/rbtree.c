@@ -0,0 +1,336 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/rbtree.h>
+
+/**
+ * @brief Replace a child of a node, or the root of the tree if the node has
+ * no parent.
+ * 
+ * @param root The root of the tree.
+ * @param parent The parent node, or NULL.
+ * @param old The child to replace.
+ * @param new The new child, which can be NULL.
+ */
+static void rb_replace_child(struct rb_root *root, struct rb_node *parent,
+                             struct rb_node *old, struct rb_node *new)
+{
+    if (parent == NULL) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+/**
+ * @brief Rotate a node to the left: its right child takes its place, and the
+ * node becomes the left child of its former right child. The augmented data
+ * of both nodes is recomputed, the node first since it is now the child.
+ * 
+ * @param root The root of the tree.
+ * @param node The node to rotate. It must have a right child.
+ * @param augment The augment callback, or NULL.
+ */
+static void rb_rotate_left(struct rb_root *root, struct rb_node *node,
+                           rb_augment_t augment)
+{
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if (right->left != NULL) {
+        right->left->parent = node;
+    }
+
+    right->parent = node->parent;
+    rb_replace_child(root, node->parent, node, right);
+    right->left = node;
+    node->parent = right;
+
+    if (augment != NULL) {
+        augment(node);
+        augment(right);
+    }
+}
+
+/**
+ * @brief Rotate a node to the right: its left child takes its place, and the
+ * node becomes the right child of its former left child.
+ * 
+ * @param root The root of the tree.
+ * @param node The node to rotate. It must have a left child.
+ * @param augment The augment callback, or NULL.
+ */
+static void rb_rotate_right(struct rb_root *root, struct rb_node *node,
+                            rb_augment_t augment)
+{
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right != NULL) {
+        left->right->parent = node;
+    }
+
+    left->parent = node->parent;
+    rb_replace_child(root, node->parent, node, left);
+    left->right = node;
+    node->parent = left;
+
+    if (augment != NULL) {
+        augment(node);
+        augment(left);
+    }
+}
+
+/**
+ * @brief Verify if a node is red. Missing leaves are black.
+ * 
+ * @param node The node, or NULL.
+ * @return true If the node is red.
+ * @return false If the node is black or NULL.
+ */
+static bool rb_is_red(struct rb_node *node)
+{
+    return node != NULL && node->red;
+}
+
+/**
+ * @brief Recompute the augmented data of a node and of all its ancestors.
+ * This must be called when the data a node is augmented with changes without
+ * any modification of the tree structure.
+ * 
+ * @param node The lowest node whose data changed, or NULL.
+ * @param augment The augment callback, or NULL.
+ */
+void rb_propagate(struct rb_node *node, rb_augment_t augment)
+{
+    if (augment == NULL) {
+        return;
+    }
+
+    for (; node != NULL; node = node->parent) {
+        augment(node);
+    }
+}
+
+/**
+ * @brief Insert a node in the tree and rebalance it. The caller must have
+ * found the position of the node by descending the tree from the root.
+ * 
+ * @param root The root of the tree.
+ * @param node The node to insert.
+ * @param parent The parent of the new node, or NULL if the tree is empty.
+ * @param link The child pointer of the parent (or the root pointer) where the
+ * node must be linked. It must be NULL.
+ * @param augment The augment callback, or NULL.
+ */
+void rb_insert(struct rb_root *root, struct rb_node *node,
+               struct rb_node *parent, struct rb_node **link,
+               rb_augment_t augment)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+    rb_propagate(node, augment);
+
+    // A red node cannot have a red parent. While this is the case, either
+    // recolor the parent and the uncle if both are red and continue with the
+    // grandparent, or rotate the grandparent to fix the subtree.
+    while (rb_is_red(node->parent)) {
+        parent = node->parent;
+        struct rb_node *grandparent = parent->parent;
+
+        if (parent == grandparent->left) {
+            struct rb_node *uncle = grandparent->right;
+            if (rb_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->right) {
+                rb_rotate_left(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rb_rotate_right(root, grandparent, augment);
+        } else {
+            struct rb_node *uncle = grandparent->left;
+            if (rb_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->left) {
+                rb_rotate_right(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rb_rotate_left(root, grandparent, augment);
+        }
+    }
+    root->node->red = false;
+}
+
+/**
+ * @brief Restore the red-black properties after a black node was removed.
+ * 
+ * @param root The root of the tree.
+ * @param node The node that replaced the removed node, which can be NULL.
+ * @param parent The parent of `node`.
+ * @param augment The augment callback, or NULL.
+ */
+static void rb_erase_fixup(struct rb_root *root, struct rb_node *node,
+                           struct rb_node *parent, rb_augment_t augment)
+{
+    // The subtree of `node` misses a black node. Move the missing black up
+    // the tree until it can be absorbed by a red node or by a rotation.
+    while (node != root->node && !rb_is_red(node)) {
+        if (node == parent->left) {
+            struct rb_node *sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_left(root, parent, augment);
+                sibling = parent->right;
+            }
+
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!rb_is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rb_rotate_right(root, sibling, augment);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rb_rotate_left(root, parent, augment);
+        } else {
+            struct rb_node *sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_right(root, parent, augment);
+                sibling = parent->left;
+            }
+
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!rb_is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rb_rotate_left(root, sibling, augment);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rb_rotate_right(root, parent, augment);
+        }
+        node = root->node;
+    }
+
+    if (node != NULL) {
+        node->red = false;
+    }
+}
+
+/**
+ * @brief Remove a node from the tree and rebalance it.
+ * 
+ * @param root The root of the tree.
+ * @param node The node to remove.
+ * @param augment The augment callback, or NULL.
+ */
+void rb_erase(struct rb_root *root, struct rb_node *node,
+              rb_augment_t augment)
+{
+    struct rb_node *child;
+    struct rb_node *parent;
+    bool red;
+
+    if (node->left == NULL || node->right == NULL) {
+        // The node has at most one child, which takes its place.
+        child = (node->left != NULL) ? node->left : node->right;
+        parent = node->parent;
+        red = node->red;
+
+        rb_replace_child(root, parent, node, child);
+        if (child != NULL) {
+            child->parent = parent;
+        }
+    } else {
+        // The node has two children: its successor, which has no left child,
+        // is unlinked from its position and takes the place of the node.
+        struct rb_node *successor = node->right;
+        while (successor->left != NULL) {
+            successor = successor->left;
+        }
+
+        child = successor->right;
+        red = successor->red;
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child != NULL) {
+                child->parent = parent;
+            }
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->red = node->red;
+        rb_replace_child(root, node->parent, node, successor);
+    }
+
+    // The augmented data of the nodes between the place where a node was
+    // unlinked and the root changed. The rotations of the fixup preserve it.
+    rb_propagate(parent, augment);
+    if (!red) {
+        rb_erase_fixup(root, child, parent, augment);
+    }
+}
@@ -140,6 +140,13 @@ void __ubsan_handle_nonnull_return(void *data)
     ubsan_abort(&info->location, "nonnull returned null");
 }
 
+_cold _ubsan
+void __ubsan_handle_nonnull_arg(void *data)
+{
+    struct ubsan_nonnull_arg_info *info = data;
+    ubsan_abort(&info->location, "null passed as a nonnull argument");
+}
+
 _cold _ubsan
 void __ubsan_handle_pointer_overflow(void *data, 
     [[maybe_unused]] void *base,
@@ -20,20 +20,111 @@
 #include <multiboot.h>
 #include <lib/log.h>
 #include <arch/x86.h>
+#include <arch/cpu.h>
+#include <arch/tlb.h>
+#include <arch/paging.h>
 #include <arch/console.h>
+#include <mm/cma.h>
 #include <mm/page.h>
+#include <mm/zero.h>
 #include <mm/slub.h>
 #include <mm/buddy.h>
 #include <mm/malloc.h>
+#include <mm/vm.h>
+#include <mm/ksm.h>
+#include <mm/zram.h>
+#include <mm/lru.h>
+#include <mm/vmalloc.h>
+#include <mm/memblock.h>
+#include <mm/reclaim.h>
+#include <mm/highmem.h>
+#include <mm/pagecache.h>
+#include <lib/radix.h>
+
+/// The number of pages written back to the page cache test object.
+static uint test_pagecache_writes = 0;
+
+/**
+ * @brief Read a page of the page cache test object, filled with its index.
+ */
+static bool test_pagecache_read([[maybe_unused]] struct pagecache_object *o,
+    u32 index, void *page)
+{
+    u32 *words = page;
+    for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+        words[i] = index;
+    }
+    return true;
+}
+
+/**
+ * @brief Write a page of the page cache test object, only counting it.
+ */
+static bool test_pagecache_write([[maybe_unused]] struct pagecache_object *o,
+    u32 index, const void *page)
+{
+    assert(*(const u32 *) page == index);
+    test_pagecache_writes++;
+    return true;
+}
+
+/// The operations of the page cache test object.
+static const struct pagecache_ops test_pagecache_ops = {
+    .read = test_pagecache_read,
+    .write = test_pagecache_write,
+};
+
+/**
+ * @brief The idle loop of the boot CPU. The init section is freed first, since
+ * the boot is complete and this function never returns to `startup()`. Since
+ * there is no scheduler yet, the background memory management work is done
+ * here until there is nothing left to do, and the CPU is then halted. The
+ * page array is initialized first, and memory is reclaimed before refilling
+ * the pre-zeroed page pools, since they only grow above the high watermark.
+ * 
+ * This function must not be inlined in `startup()`, since it would then be
+ * in the init section that it releases.
+ */
+_noinline _noreturn
+static void idle(void)
+{
+    page_free_init_memory();
+
+    bool pending = true;
+    while (pending) {
+        pending = page_deferred_init();
+        pending |= reclaim_run(RECLAIM_BATCH);
+        pending |= zero_pool_refill(ZERO_POOL_BATCH);
+        pending |= paging_pt_cache_refill(PAGING_PT_CACHE_BATCH);
+        pending |= ksm_run(KSM_BATCH);
+        pending |= pagecache_writeback(PAGECACHE_WRITEBACK_BATCH);
+    }
+
+    page_debug_info();
+    zero_pool_debug_info();
+    reclaim_debug_info();
+    paging_debug_info();
+    tlb_debug_info();
+    cpu_freeze();
+}
 
 _cdecl _init _noreturn
 void startup(struct mb_info *mb_info)
 {
     arch_x86_setup(mb_info);
+    memblock_setup(mb_info);
     page_setup(mb_info);
     buddy_setup();
+    zero_pool_setup();
+    highmem_setup();
     slub_setup();
     malloc_setup();
+    lru_setup();
+    vm_setup();
+    radix_setup();
+    pagecache_setup();
+    zram_setup();
+    ksm_setup();
 
     // Test the slub allocator
     struct slub_cache *cache = slub_create_cache("test", 16, 0, 0, SLUB_NONE);
@@ -66,7 +157,318 @@ void startup(struct mb_info *mb_info)
     free(ptr3);
     free(ptr4);
 
+    // Test the highmem zone, if any
+    paddr high = highmem_alloc();
+    if (high) {
+        u32 *mapped = kmap(high);
+        mapped[0] = 0xDEADBEEF;
+        debug("highmem page #%u mapped at %p", page_pfn(high), mapped);
+        kunmap(mapped);
+        highmem_free(high);
+    }
+
+    // Stress the grouping by migrate type with a pseudo-random churn of
+    // unmovable, reclaimable and movable blocks of order 0 to 3, and report
+    // how many blocks of each order are still available while about half of
+    // them are allocated.
+    static _initdata void *churn[1024];
+    static _initdata u8 churn_order[1024];
+    static const uint churn_flags[] = {
+        BUDDY_NONE, BUDDY_RECLAIMABLE, BUDDY_MOVABLE
+    };
+    u32 available[BUDDY_BUCKET_COUNT];
+    for (u32 order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        available[order] = buddy_available(order);
+    }
+
+    const u64 churn_start = cpu_rdtsc();
+    u32 seed = 0x2545F491;
+    for (u32 round = 0; round < 65536; round++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        const u32 slot = seed % 1024;
+        if (churn[slot] != NULL) {
+            buddy_free(churn[slot], churn_order[slot]);
+            churn[slot] = NULL;
+            continue;
+        }
+        churn_order[slot] = ((seed >> 10) & 3) == 0 ? (seed >> 12) & 3 : 0;
+        churn[slot] = buddy_alloc(churn_order[slot],
+            churn_flags[(seed >> 16) % 3]);
+    }
+    const u32 churn_cycles = cpu_rdtsc() - churn_start;
+
+    debug("buddy: 65536 churn rounds in %u cycles", churn_cycles);
+    for (u32 order = 0; order <= BUDDY_MAX_ORDER; order += 2) {
+        debug("  Order %2u: %5u blocks available before, %5u after", order,
+            available[order], buddy_available(order));
+    }
+    for (u32 slot = 0; slot < 1024; slot++) {
+        buddy_free(churn[slot], churn_order[slot]);
+    }
+
+#ifdef CONFIG_SELFTEST
+    // Test the contiguous memory allocator after fragmenting its area. The
+    // rest of the low memory is exhausted first, so that the pages written
+    // to an area, one page out of two, are borrowed from the contiguous
+    // memory area. The page tables of the area are created beforehand by
+    // read faults, which map the zero page. The borrowed pages are evicted
+    // to the compressed swap by cma_alloc(), and read back afterwards. This
+    // test initializes all the deferred pages and takes all the low memory,
+    // so it is only built with `make SELFTEST=1`.
+    const u32 cma_pages = CMA_SIZE / PAGE_SIZE;
+    struct vm_area *borrowed = vm_area_alloc(&vm_kernel_space, CMA_SIZE,
+        VM_WRITE, 0x40000000, KERNEL_VBASE);
+    assert(borrowed != NULL);
+    for (vaddr va = borrowed->start; va < borrowed->end; va += PAGE_SIZE) {
+        assert(*(u32 *) va == 0);
+    }
+
+    zero_pool_drain();
+    void *exhausted = NULL;
+    while (true) {
+        void **page = buddy_alloc(0, BUDDY_MOVABLE);
+        if (page == NULL || cma_contains((vaddr) page - KERNEL_VBASE)) {
+            buddy_free(page, 0);
+            break;
+        }
+        *page = exhausted;
+        exhausted = page;
+    }
+
+    u32 lent = 0;
+    for (vaddr va = borrowed->start; va < borrowed->end; va += 2 * PAGE_SIZE) {
+        *(u32 *) va = va;
+        const struct pte *pte = paging_get_pte(&kernel_pd, va, false);
+        lent += cma_contains((paddr) pte->frame << 12) ? 1 : 0;
+    }
+    assert(lent == cma_pages / 2);
+    while (exhausted != NULL) {
+        void *next = *(void **) exhausted;
+        buddy_free(exhausted, 0);
+        exhausted = next;
+    }
+
+    void *contiguous = cma_alloc(cma_pages);
+    assert(contiguous != NULL);
+    debug("cma: %u contiguous pages at %p, %u pages were lent", cma_pages,
+        contiguous, lent);
+    cma_free(contiguous, cma_pages);
+    for (vaddr va = borrowed->start; va < borrowed->end; va += 2 * PAGE_SIZE) {
+        assert(*(u32 *) va == va);
+    }
+    vm_area_destroy(&vm_kernel_space, borrowed);
+#endif
+
+    // Test the kernel mappings: the beginning of the physical memory is mapped
+    // with two large pages and a 4 KiB edge, then partially unmapped to split
+    // the second large page.
+    const u32 map_size = 2 * PAGING_LARGE_PAGE_SIZE + PAGE_SIZE;
+    if (!paging_map_kernel(KERNEL_MAP_BASE, 0, map_size, PAGING_WRITE)) {
+        panic("cannot map %u bytes at %p", map_size, KERNEL_MAP_BASE);
+    }
+    assert(*(u32 *) (KERNEL_MAP_BASE + KERNEL_PBASE) ==
+        *(u32 *) (KERNEL_VBASE + KERNEL_PBASE));
+    paging_protect_range(&kernel_pd, KERNEL_MAP_BASE, map_size, PAGING_NONE);
+    paging_unmap_kernel(KERNEL_MAP_BASE + PAGING_LARGE_PAGE_SIZE, PAGE_SIZE);
+    paging_unmap_kernel(KERNEL_MAP_BASE, map_size);
+
+    // Test the demand paging: the pages of the area are only allocated when
+    // they are first touched, here one page out of two.
+    struct vm_area *lazy = vm_area_create(
+        &vm_kernel_space, 0x40000000, 64 * PAGE_SIZE, VM_WRITE);
+    assert(lazy != NULL);
+    for (vaddr va = lazy->start; va < lazy->end; va += 2 * PAGE_SIZE) {
+        assert(*(u32 *) va == 0);
+        *(u32 *) va = va;
+    }
+    lru_debug_info();
+    vm_area_destroy(&vm_kernel_space, lazy);
+
+    // Test the fault-around: reading half of an area sequentially takes fewer
+    // faults than pages, since the neighbours of each faulting page are mapped
+    // to the zero page as well. The written half only maps its neighbours
+    // when the pre-zeroed page pool has pages, so its faults are not checked.
+    struct vm_area *around = vm_area_alloc(&vm_kernel_space, 64 * PAGE_SIZE,
+        VM_WRITE, 0x40000000, KERNEL_VBASE);
+    assert(around != NULL);
+    const vaddr around_half = around->start + 32 * PAGE_SIZE;
+    const u32 write_start = vm_fault_count();
+    for (vaddr va = around->start; va < around_half; va += PAGE_SIZE) {
+        *(u32 *) va = va;
+    }
+    const u32 read_start = vm_fault_count();
+    for (vaddr va = around_half; va < around->end; va += PAGE_SIZE) {
+        assert(*(u32 *) va == 0);
+    }
+    const u32 write_faults = read_start - write_start;
+    const u32 read_faults = vm_fault_count() - read_start;
+    assert(read_faults < 32);
+    debug("vm: 32 pages written in %u faults, 32 pages read in %u faults",
+        write_faults, read_faults);
+    vm_area_destroy(&vm_kernel_space, around);
+
+    // Test the virtually contiguous allocations: a freed range is not reused
+    // before it is purged, so the second buffer follows the first one.
+    u32 *table = vmalloc(8 * 1024 * 1024);
+    assert(table != NULL);
+    for (u32 i = 0; i < 8 * 1024 * 1024 / sizeof(u32); i += 1024) {
+        table[i] = i;
+    }
+    vfree(table);
+    u32 *buffer = vmalloc(3 * PAGE_SIZE + 1);
+    assert(buffer != NULL && buffer != table);
+    buffer[3 * PAGE_SIZE / sizeof(u32)] = 0;
+    vfree(buffer);
+    vmalloc_purge();
+
+    // Test the compressed swap: the pages of an area, zeroed or filled with a
+    // repeating pattern, are evicted by the reclaimer once they have aged,
+    // and read back by page faults.
+    struct vm_area *swapped = vm_area_alloc(&vm_kernel_space, 128 * PAGE_SIZE,
+        VM_WRITE, 0x40000000, KERNEL_VBASE);
+    assert(swapped != NULL);
+    for (vaddr va = swapped->start; va < swapped->end; va += PAGE_SIZE) {
+        u32 *words = (u32 *) va;
+        for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+            words[i] = (va & PAGE_SIZE) ? va + (i & 63) : 0;
+        }
+    }
+    u32 evicted = 0;
+    for (uint round = 0; round < 4 && evicted < 128; round++) {
+        evicted += lru_shrink(128 - evicted);
+    }
+    for (vaddr va = swapped->start; va < swapped->end; va += PAGE_SIZE) {
+        assert(((u32 *) va)[65] == ((va & PAGE_SIZE) ? va + 1 : 0));
+    }
+    vm_area_destroy(&vm_kernel_space, swapped);
+    debug("zram: %u pages evicted and read back", evicted);
+
+    // Test the same-page merging: out of 64 written pages, 32 identical pages
+    // are merged into one and 16 zeroed pages are replaced with the zero
+    // page. Writing a merged page copies it again.
+    struct vm_area *merged = vm_area_alloc(&vm_kernel_space, 64 * PAGE_SIZE,
+        VM_WRITE | VM_MERGEABLE, 0x40000000, KERNEL_VBASE);
+    assert(merged != NULL);
+    for (vaddr va = merged->start; va < merged->end; va += PAGE_SIZE) {
+        const uint index = (va - merged->start) / PAGE_SIZE;
+        u32 *words = (u32 *) va;
+        for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+            words[i] = index < 32 ? i : (index < 48 ? 0 : va + i);
+        }
+    }
+    while (ksm_run(KSM_BATCH)) {
+    }
+    ksm_debug_info();
+    *(u32 *) merged->start = 1;
+    assert(((u32 *) merged->start)[1] == 1);
+    assert(*(u32 *) (merged->start + PAGE_SIZE) == 0);
+    assert(*(u32 *) (merged->start + 63 * PAGE_SIZE) ==
+        merged->start + 63 * PAGE_SIZE);
+    vm_area_destroy(&vm_kernel_space, merged);
+
+    // Measure the latency of a fork-like clone of an address space with 256
+    // populated pages, shared copy-on-write. Writing the first page from the
+    // clone copies it, and writing it again from the original address space
+    // reuses it since it is not shared anymore.
+    struct vm_area *heap = vm_area_alloc(&vm_kernel_space, 256 * PAGE_SIZE,
+        VM_WRITE, 0x40000000, KERNEL_VBASE);
+    assert(heap != NULL);
+    for (vaddr va = heap->start; va < heap->end; va += PAGE_SIZE) {
+        *(u32 *) va = va;
+    }
+
+    if (!paging_map_kernel(KERNEL_MAP_BASE, 0, PAGING_LARGE_PAGE_SIZE,
+        PAGING_WRITE)) {
+        panic("cannot map a large page at %p", KERNEL_MAP_BASE);
+    }
+
+    const u64 clone_start = cpu_rdtsc();
+    struct vm_space *clone = vm_space_clone(&vm_kernel_space);
+    const u32 clone_cycles = cpu_rdtsc() - clone_start;
+    assert(clone != NULL);
+
+    // The kernel large page unmapped after the clone must not stay mapped in
+    // the page directory of the clone.
+    paging_unmap_kernel(KERNEL_MAP_BASE, PAGING_LARGE_PAGE_SIZE);
+    assert(!clone->pd->entries[paging_pde_index(KERNEL_MAP_BASE)].present);
+
+    vm_switch(clone);
+    assert(*(u32 *) heap->start == heap->start);
+    *(u32 *) heap->start = 0;
+    vm_switch(&vm_kernel_space);
+    assert(*(u32 *) heap->start == heap->start);
+    *(u32 *) heap->start = 0;
+
+    vm_space_destroy(clone);
+    vm_area_destroy(&vm_kernel_space, heap);
+    debug("vm: cloned 256 pages in %u cycles", clone_cycles);
+
+    // Measure the cost of walking the kernel page tables again after an
+    // address space switch, by touching one page in each large page of the
+    // direct mapping, without and with the global pages.
+    if (paging_pge_enabled) {
+        const u32 cr4 = cpu_read_cr4();
+        const vaddr probe_end = KERNEL_VBASE +
+            min(page_pfn_end(), page_pfn(LOWMEM_END)) * PAGE_SIZE;
+        u32 cycles[2] = {};
+        for (uint global = 0; global < 2; global++) {
+            cpu_write_cr4(global ? cr4 : cr4 & ~CPU_CR4_PGE);
+            for (uint round = 0; round < 16; round++) {
+                vaddr va = KERNEL_VBASE;
+                for (; va < probe_end; va += PAGING_LARGE_PAGE_SIZE) {
+                    (void) *(volatile u32 *) va;
+                }
+
+                paging_switch(&kernel_pd);
+                const u64 start = cpu_rdtsc();
+                for (va = KERNEL_VBASE; va < probe_end;
+                    va += PAGING_LARGE_PAGE_SIZE) {
+                    (void) *(volatile u32 *) va;
+                }
+                cycles[global] += cpu_rdtsc() - start;
+            }
+        }
+        cpu_write_cr4(cr4);
+        debug("TLB refill after a switch: %u cycles, %u with global pages",
+            cycles[0] / 16, cycles[1] / 16);
+    }
+
+    // Test the page cache with an object backed by nothing: each page is
+    // filled with its index when read, and the writes are only counted. A
+    // sequential read is served mostly from the readahead windows.
+    struct pagecache_object object;
+    pagecache_object_init(&object, &test_pagecache_ops, 512);
+    for (u32 index = 0; index < 256; index++) {
+        const u32 *words = pagecache_read(&object, index);
+        assert(words != NULL && words[7] == index);
+    }
+    for (u32 index = 500; index > 300; index -= 37) {
+        assert(*(u32 *) pagecache_read(&object, index) == index);
+    }
+    assert(pagecache_read(&object, 512) == NULL);
+    for (u32 index = 0; index < 64; index += 2) {
+        assert(pagecache_mark_dirty(&object, index));
+    }
+    assert(!pagecache_mark_dirty(&object, 511));
+    while (pagecache_writeback(PAGECACHE_WRITEBACK_BATCH)) {
+    }
+    assert(object.nrdirty == 0 && test_pagecache_writes == 32);
+    debug("pagecache: %u pages cached", object.nrpages);
+    pagecache_debug_info();
+    pagecache_object_release(&object);
+
     info("Boot completed !");
     page_debug_info();
-    cpu_freeze(); 
+    buddy_debug_info();
+    highmem_debug_info();
+    cma_debug_info();
+    vm_debug_info();
+    vmalloc_debug_info();
+    lru_debug_info();
+    zram_debug_info();
+    ksm_debug_info();
+    pagecache_debug_info();
+    idle();
 }
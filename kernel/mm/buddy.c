@@ -16,17 +16,45 @@
  * You should have received a copy of the GNU General Public License
  * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <memory.h>
+#include <mm/cma.h>
 #include <mm/page.h>
+#include <mm/zero.h>
 #include <mm/buddy.h>
+#include <mm/reclaim.h>
 #include <lib/log.h>
 #include <lib/assert.h>
 #include <arch/paging.h>
 
 /**
- * @brief The buddy allocator buckets free lists. Each bucket represents a
- * block size that the buddy allocator will manage.
+ * @brief The buddy allocator buckets free lists. Each migrate type has its own
+ * set of buckets, and each bucket represents a block size that the buddy
+ * allocator will manage. A free block is always stored in the free lists of
+ * the migrate type of the pageblock containing its first page.
  */
-static struct list_head buddy_buckets[BUDDY_BUCKET_COUNT] = { };
+static struct list_head buddy_buckets[MIGRATE_TYPES][BUDDY_BUCKET_COUNT] = { };
+
+/**
+ * @brief The migrate types to steal memory from when no free block of the
+ * requested migrate type is available, in order of preference. Each list is
+ * terminated by MIGRATE_TYPES. The contiguous memory area is only lent to
+ * movable allocations, since their pages can be given back when a contiguous
+ * allocation needs them.
+ */
+static const uint buddy_fallbacks[MIGRATE_TYPES][MIGRATE_TYPES] = {
+    [MIGRATE_UNMOVABLE]   = {
+        MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE, MIGRATE_TYPES
+    },
+    [MIGRATE_RECLAIMABLE] = {
+        MIGRATE_UNMOVABLE, MIGRATE_MOVABLE, MIGRATE_TYPES
+    },
+    [MIGRATE_MOVABLE]     = {
+        MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_CMA, MIGRATE_TYPES
+    },
+    [MIGRATE_CMA]         = {
+        MIGRATE_TYPES
+    },
+};
 
 /**
  * @brief The buddy allocator initialization flag. This flag is used to modify
@@ -38,6 +66,29 @@ static struct list_head buddy_buckets[BUDDY_BUCKET_COUNT] = { };
  */
 static bool buddy_initialized = false;
 
+/// The number of free blocks of each order, all migrate types included.
+static unsigned int buddy_free_blocks[BUDDY_BUCKET_COUNT] = { };
+
+/// The number of free pages in the free lists of the buddy allocator.
+static unsigned int buddy_free_pages = 0;
+
+/// The number of pages given to the buddy allocator with `buddy_add_memory()`.
+/// The watermarks are computed from this number.
+static unsigned int buddy_managed_pages = 0;
+
+/// The number of allocations that failed for each order.
+static unsigned int buddy_failures[BUDDY_BUCKET_COUNT] = { };
+
+/// The watermarks of the buddy allocator, in pages, indexed by BUDDY_WMARK_*.
+static unsigned int buddy_watermarks[BUDDY_WMARK_COUNT] = { };
+
+/// The number of times the free pages dropped below each watermark.
+static unsigned int buddy_wmark_crossings[BUDDY_WMARK_COUNT] = { };
+
+/// The number of watermarks currently above the number of free pages. This is
+/// used to detect watermark crossings without scanning the free lists.
+static uint buddy_wmark_level = 0;
+
 /// The number of kernel pages in the system, defined in kernel/mm/page.c
 extern unsigned int pg_kernel;
 
@@ -85,6 +136,116 @@ static paddr buddy_vaddr_to_paddr(vaddr addr) {
     return addr - KERNEL_VBASE;
 }
 
+/**
+ * @brief Get the page information structure of the first page of the
+ * pageblock containing the given address. This page holds the migrate type
+ * of the whole pageblock.
+ * 
+ * @param base A virtual address managed by the buddy allocator.
+ * @return struct page* The page information of the pageblock head.
+ */
+static struct page *buddy_pageblock(vaddr base) {
+    const vaddr block = align_down(base, buddy_order_to_bytes(
+        BUDDY_PAGEBLOCK_ORDER));
+    return page_info(buddy_vaddr_to_paddr(block));
+}
+
+/**
+ * @brief Get the migrate type of the pageblock containing the given address.
+ * 
+ * @param base A virtual address managed by the buddy allocator.
+ * @return uint The migrate type of the pageblock.
+ */
+static uint buddy_pageblock_type(vaddr base) {
+    return page_migratetype(buddy_pageblock(base));
+}
+
+/**
+ * @brief Set the migrate type of all pageblocks covered by a block. If the
+ * block is smaller than a pageblock, the migrate type of the pageblock that
+ * contains it is changed.
+ * 
+ * @param base The base address of the block.
+ * @param order The order of the block.
+ * @param type The new migrate type.
+ */
+static void buddy_set_pageblock_type(vaddr base, u32 order, uint type) {
+    const u32 size = buddy_order_to_bytes(
+        max(order, (u32) BUDDY_PAGEBLOCK_ORDER));
+    const u32 step = buddy_order_to_bytes(BUDDY_PAGEBLOCK_ORDER);
+    for (vaddr va = base; va < base + size; va += step) {
+        page_set_migratetype(buddy_pageblock(va), type);
+    }
+}
+
+/**
+ * @brief Add a free block to the free list matching its order and the migrate
+ * type of its pageblock, and record its order in the page array.
+ * 
+ * @param base The base address of the block.
+ * @param order The order of the block.
+ */
+static void buddy_add_free_block(vaddr base, u32 order) {
+    struct buddy_block *block = create_buddy_block_at(base);
+    struct page *pg = page_info(buddy_vaddr_to_paddr(base));
+    const uint type = buddy_pageblock_type(base);
+
+    pg->order = order;
+    list_add_head(&buddy_buckets[type][order], &block->list);
+    buddy_free_blocks[order]++;
+    buddy_free_pages += buddy_order_to_pfn(order);
+}
+
+/**
+ * @brief Remove a free block from its free list.
+ * 
+ * @param block The free block.
+ * @param order The order of the block.
+ */
+static void buddy_remove_free_block(struct buddy_block *block, u32 order) {
+    list_remove(&block->list);
+    buddy_free_blocks[order]--;
+    buddy_free_pages -= buddy_order_to_pfn(order);
+}
+
+/**
+ * @brief Update the watermark level after the number of free pages changed,
+ * and count the watermarks that were crossed downwards. The watermarks are
+ * sorted in increasing order, so the level is the number of watermarks that
+ * are still above the number of free pages when counting from the highest.
+ * The background reclaimer is woken up when the low watermark is crossed.
+ */
+static void buddy_update_watermarks(void) {
+    uint level = 0;
+    while (level < BUDDY_WMARK_COUNT &&
+           buddy_free_pages < buddy_watermarks[BUDDY_WMARK_HIGH - level]) {
+        level++;
+    }
+
+    for (uint i = buddy_wmark_level; i < level; i++) {
+        buddy_wmark_crossings[BUDDY_WMARK_HIGH - i]++;
+        if (BUDDY_WMARK_HIGH - i == BUDDY_WMARK_LOW) {
+            reclaim_wakeup();
+        }
+    }
+    buddy_wmark_level = level;
+}
+
+/**
+ * @brief Convert allocation flags to the migrate type of the allocation.
+ * 
+ * @param flags The allocation flags (BUDDY_*).
+ * @return uint The migrate type matching the allocation flags.
+ */
+static uint buddy_flags_to_migratetype(uint flags) {
+    if (flags & BUDDY_MOVABLE) {
+        return MIGRATE_MOVABLE;
+    } else if (flags & BUDDY_RECLAIMABLE) {
+        return MIGRATE_RECLAIMABLE;
+    }
+    return MIGRATE_UNMOVABLE;
+}
+
 /**
  * @brief Verify if the block with the given base address can be coalesced with
  * the its buddy block. The block can be coalesced if with its buddy block if:
@@ -94,6 +255,8 @@ static paddr buddy_vaddr_to_paddr(vaddr addr) {
  *  - The block and its buddy block have the same order.
  *  - Coalescing the block with its buddy block will not exceed the maximum
  *    order of the buddy allocator.
+ *  - The block and its buddy block are both inside or both outside of the
+ *    contiguous memory area.
  * 
  * @note This function assume that the `vbase` parameter points to the base
  * of a block managed by the buddy allocator (i.e the base page has a non-zero
@@ -108,13 +271,216 @@ static bool buddy_can_coalesce(vaddr vbase) {
     assert(page_info(base) != NULL);
     struct page *pg = page_info(base);
     struct page *buddy = page_info(buddy_address(base, pg->order));
-    return (buddy != NULL) &&
-           (pg->flags & PG_FREE) &&
-           (pg->flags & PG_BUDDY) && 
-           (buddy->flags & PG_FREE) &&
-           (buddy->flags & PG_BUDDY) &&
-           (pg->order == buddy->order) &&
-           (pg->order < BUDDY_MAX_ORDER);
+    if (buddy == NULL ||
+        !(pg->flags & PG_FREE) ||
+        !(pg->flags & PG_BUDDY) ||
+        !(buddy->flags & PG_FREE) ||
+        !(buddy->flags & PG_BUDDY) ||
+        (pg->order != buddy->order) ||
+        (pg->order >= BUDDY_MAX_ORDER)) {
+        return false;
+    }
+
+    // Blocks of the contiguous memory area must never be merged with blocks
+    // outside of it, otherwise they could end up in the free lists of another
+    // migrate type and be used for unmovable memory.
+    if (pg->order >= BUDDY_PAGEBLOCK_ORDER) {
+        const vaddr buddy_base = buddy_address(vbase, pg->order);
+        const bool cma = buddy_pageblock_type(vbase) == MIGRATE_CMA;
+        const bool buddy_cma = buddy_pageblock_type(buddy_base) == MIGRATE_CMA;
+        return cma == buddy_cma;
+    }
+    return true;
+}
+
+/**
+ * @brief Split a free block that was removed from its free list until it has
+ * the requested order. The unused halves are added back to the free lists of
+ * their own pageblock migrate type.
+ * 
+ * @param block The block to split, already removed from its free list.
+ * @param from The current order of the block.
+ * @param to The order of the block after splitting.
+ */
+static void buddy_split(struct buddy_block *block, u32 from, u32 to) {
+    for (u32 j = from; j > to; j--) {
+        buddy_add_free_block(buddy_address((vaddr) block, j - 1), j - 1);
+    }
+}
+
+/**
+ * @brief Take the ownership of the pageblock containing a free block of a
+ * different migrate type. All free blocks inside the pageblock are moved to
+ * the free lists of the new migrate type, so that future allocations of this
+ * type are served from the same pageblock. If the block is larger than a
+ * pageblock, all pageblocks covered by the block are claimed.
+ * 
+ * @param block The free block being stolen.
+ * @param order The order of the block.
+ * @param type The new migrate type of the pageblock(s).
+ */
+static void buddy_claim_pageblock(struct buddy_block *block, u32 order,
+                                  uint type) {
+    if (order >= BUDDY_PAGEBLOCK_ORDER) {
+        buddy_set_pageblock_type((vaddr) block, order, type);
+        list_reinsert_head(&buddy_buckets[type][order], &block->list);
+        return;
+    }
+
+    // Walk the pageblock and move each free block to its new free list. Free
+    // blocks smaller than a pageblock are naturally aligned, so walking the
+    // pageblock from its start always finds the head of a free block before
+    // any of its other pages.
+    const u32 pageblock_pfn = buddy_order_to_pfn(BUDDY_PAGEBLOCK_ORDER);
+    const vaddr start = align_down((vaddr) block,
+        buddy_order_to_bytes(BUDDY_PAGEBLOCK_ORDER));
+
+    for (u32 i = 0; i < pageblock_pfn; ) {
+        const vaddr va = start + (i << PAGE_SHIFT);
+        struct page *pg = page_info(buddy_vaddr_to_paddr(va));
+        if (pg != NULL && (pg->flags & PG_FREE) && (pg->flags & PG_BUDDY)) {
+            struct buddy_block *free = (struct buddy_block *) va;
+            list_reinsert_head(&buddy_buckets[type][pg->order], &free->list);
+            i += buddy_order_to_pfn(pg->order);
+        } else {
+            i++;
+        }
+    }
+
+    buddy_set_pageblock_type((vaddr) block, order, type);
+}
+
+/**
+ * @brief Remove a free block of the given order and migrate type from the
+ * free lists, splitting a larger block of the same migrate type if needed.
+ * 
+ * @param order The order of the block.
+ * @param type The migrate type of the block.
+ * @return struct buddy_block* The block, or NULL if there is no free block of
+ * this migrate type large enough.
+ */
+static struct buddy_block *buddy_take_block(u32 order, uint type) {
+    // Find the first non-empty bucket with a block of at least the given
+    // order. If a block is found, remove it from the free list and split it
+    // into smaller blocks until the desired order is reached.
+    for (u32 i = order; i <= BUDDY_MAX_ORDER; i++) {
+        struct list_head *bucket = &buddy_buckets[type][i];
+        if (!list_empty(bucket)) {
+            struct buddy_block *block = list_first_entry(
+                bucket, struct buddy_block, list);
+            buddy_remove_free_block(block, i);
+            buddy_split(block, i, order);
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Steal a free block from another migrate type when the free lists of
+ * the requested type are exhausted. The largest available block is stolen to
+ * limit the number of pageblocks polluted with a different migrate type. When
+ * a large block is stolen, or when the allocation is not movable, the whole
+ * pageblock is claimed so that the next allocations of the same type are
+ * grouped in it.
+ * 
+ * @param order The order of the block.
+ * @param type The migrate type of the allocation.
+ * @return struct buddy_block* The block, or NULL if the memory is exhausted.
+ */
+static struct buddy_block *buddy_steal_block(u32 order, uint type) {
+    for (int i = BUDDY_MAX_ORDER; i >= (int) order; i--) {
+        for (uint f = 0; buddy_fallbacks[type][f] != MIGRATE_TYPES; f++) {
+            const uint fallback = buddy_fallbacks[type][f];
+            struct list_head *bucket = &buddy_buckets[fallback][i];
+            if (list_empty(bucket)) {
+                continue;
+            }
+
+            // Pageblocks of the contiguous memory area are only lent and
+            // always keep their migrate type.
+            struct buddy_block *block = list_first_entry(
+                bucket, struct buddy_block, list);
+            if (fallback != MIGRATE_CMA &&
+                (i >= BUDDY_PAGEBLOCK_ORDER / 2 || type != MIGRATE_MOVABLE)) {
+                buddy_claim_pageblock(block, i, type);
+                return buddy_take_block(order, type);
+            }
+
+            buddy_remove_free_block(block, i);
+            buddy_split(block, i, order);
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Remove a free block of the given order from the free lists, first
+ * from the pageblocks of the requested migrate type, and then by stealing
+ * memory from the other migrate types.
+ * 
+ * @param order The order of the block.
+ * @param type The migrate type of the allocation.
+ * @return struct buddy_block* The block, or NULL if the memory is exhausted.
+ */
+static struct buddy_block *buddy_get_block(u32 order, uint type) {
+    struct buddy_block *block = buddy_take_block(order, type);
+    if (block == NULL) {
+        block = buddy_steal_block(order, type);
+    }
+    return block;
+}
+
+/**
+ * @brief Find the free block containing the given page. Free blocks are
+ * naturally aligned, so the candidate heads are searched from the largest
+ * order down: interior pages of a free block also have the `PG_FREE` flag
+ * and a zero order, and must not be mistaken for an order 0 block.
+ * 
+ * @param va The virtual address of a free page managed by the buddy allocator.
+ * @param order The order of the block containing the page, if found.
+ * @return vaddr The base address of the free block containing the page, or 0
+ * if the page is not free.
+ */
+static vaddr buddy_find_free_block(vaddr va, u32 *order) {
+    for (int i = BUDDY_MAX_ORDER; i >= 0; i--) {
+        const vaddr head = align_down(va, buddy_order_to_bytes(i));
+        struct page *pg = page_info(buddy_vaddr_to_paddr(head));
+        if (pg != NULL && (pg->flags & PG_FREE) && (pg->flags & PG_BUDDY) &&
+            pg->order == (u32) i) {
+            *order = i;
+            return head;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove a range of pages from a free block already removed from its
+ * free list. The block is split in halves until each half is either entirely
+ * inside the range, and is kept, or entirely outside, and is given back to
+ * the free lists.
+ * 
+ * @param base The base address of the free block.
+ * @param order The order of the free block.
+ * @param start The start address of the range to isolate.
+ * @param end The end address of the range to isolate (exclusive).
+ */
+static void buddy_isolate(vaddr base, u32 order, vaddr start, vaddr end) {
+    const vaddr block_end = base + buddy_order_to_bytes(order);
+    if (base >= start && block_end <= end) {
+        return;
+    }
+
+    const vaddr half = buddy_order_to_bytes(order - 1);
+    for (vaddr va = base; va < block_end; va += half) {
+        if (va + half <= start || va >= end) {
+            buddy_add_free_block(va, order - 1);
+        } else {
+            buddy_isolate(va, order - 1, start, end);
+        }
+    }
 }
 
 /**
@@ -124,46 +490,198 @@ static bool buddy_can_coalesce(vaddr vbase) {
  */
 void buddy_debug(void) {
     for (int i = 0; i < BUDDY_BUCKET_COUNT; i++) {
-        struct list_head *bucket = &buddy_buckets[i];
         debug("Bucket #%u (%u KiB block):", i, 4 << i);
-        if (list_empty(bucket)) {
-            continue;
+        for (int type = 0; type < MIGRATE_TYPES; type++) {
+            struct list_head *bucket = &buddy_buckets[type][i];
+            list_foreach(bucket, entry) {
+                struct buddy_block * block = list_entry(
+                    entry, struct buddy_block, list);
+                debug("  - Block %p-%p (type %u)", block,
+                    (vaddr) block + (1 << (i + 12)), type);
+            }
         }
+    }
+}
 
-        list_foreach(bucket, entry) {
-            struct buddy_block * block = list_entry(
-                entry, struct buddy_block, list);
-            debug("  - Block %p-%p", block, (vaddr) block + (1 << (i + 12)));
-        }
+/**
+ * @brief Print the statistics of the buddy allocator: the number of free
+ * blocks of each order, the unusable free space index of each order, the
+ * allocation failures and the watermark crossings. Unlike `buddy_debug()`,
+ * this does not walk the free lists and is cheap enough to be called at any
+ * time.
+ * 
+ * The unusable free space index of an order is the fraction of the free
+ * memory that cannot be used to satisfy an allocation of this order, because
+ * it is made of smaller blocks. It is printed in per mille: 0 means that all
+ * the free memory is usable, 1000 that none is.
+ */
+void buddy_debug_info(void) {
+    debug("Buddy free pages: %u (watermarks %u/%u/%u)", buddy_free_pages,
+        buddy_watermarks[BUDDY_WMARK_MIN], buddy_watermarks[BUDDY_WMARK_LOW],
+        buddy_watermarks[BUDDY_WMARK_HIGH]);
+    debug("Watermark crossings: min %u, low %u, high %u",
+        buddy_wmark_crossings[BUDDY_WMARK_MIN],
+        buddy_wmark_crossings[BUDDY_WMARK_LOW],
+        buddy_wmark_crossings[BUDDY_WMARK_HIGH]);
+
+    // Walk the orders from the largest one to compute the number of free
+    // pages in blocks of at least each order.
+    u32 usable = 0;
+    for (int i = BUDDY_MAX_ORDER; i >= 0; i--) {
+        usable += buddy_free_blocks[i] * buddy_order_to_pfn(i);
+        const u32 unusable = buddy_free_pages == 0 ? 1000 :
+            ((buddy_free_pages - usable) * 1000) / buddy_free_pages;
+        debug("  Order %2u: %5u free, unusable index %4u, %u failures",
+            i, buddy_free_blocks[i], unusable, buddy_failures[i]);
+    }
+}
+
+/**
+ * @brief Get the number of free pages managed by the buddy allocator.
+ * 
+ * @return u32 The number of free pages in the free lists.
+ */
+u32 buddy_free_count(void) {
+    return buddy_free_pages;
+}
+
+/**
+ * @brief Get the number of blocks of an order that could be allocated from
+ * the free lists right now, all migrate types included. A free block of a
+ * higher order counts as many blocks of the requested order.
+ * 
+ * @param order The order of the blocks.
+ * @return u32 The number of blocks of this order available.
+ */
+u32 buddy_available(u32 order) {
+    assert(order <= BUDDY_MAX_ORDER);
+    u32 available = 0;
+    for (u32 i = order; i <= BUDDY_MAX_ORDER; i++) {
+        available += buddy_free_blocks[i] << (i - order);
     }
+    return available;
+}
+
+/**
+ * @brief Verify if the number of free pages is below a watermark.
+ * 
+ * @param wmark The watermark (BUDDY_WMARK_*).
+ * @return true If the number of free pages is below the watermark.
+ * @return false Otherwise.
+ */
+bool buddy_below_watermark(uint wmark) {
+    assert(wmark < BUDDY_WMARK_COUNT);
+    return buddy_free_pages < buddy_watermarks[wmark];
+}
+
+/**
+ * @brief Get the value of a watermark of the buddy allocator.
+ * 
+ * @param wmark The watermark (BUDDY_WMARK_*).
+ * @return u32 The number of free pages of the watermark.
+ */
+u32 buddy_watermark(uint wmark) {
+    assert(wmark < BUDDY_WMARK_COUNT);
+    return buddy_watermarks[wmark];
 }
 
 /**
- * @brief Setup the buddy allocator. It simply initializes the free lists for
- * each bucket. Each bucket is still empty at this point, and memory must be
- * added to the buddy allocator using the `buddy_free()` function to make it
- * available for allocation.
+ * @brief Setup the buddy allocator. It initializes the free lists for each
+ * bucket and adds the memory of the initialized part of the page array. The
+ * rest of the memory is added with `buddy_add_memory()` as the page array
+ * initialization progresses.
  */
 _init
 void buddy_setup(void) {
     // Initialize the free lists for each bucket to an empty list.
-    for (int i = 0; i < BUDDY_BUCKET_COUNT; i++) {
-        list_init(&buddy_buckets[i]);
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+        for (int i = 0; i < BUDDY_BUCKET_COUNT; i++) {
+            list_init(&buddy_buckets[type][i]);
+        }
+    }
+
+    // Give all the initialized memory to the buddy allocator. The rest of the
+    // memory is added when the page array is initialized further.
+    buddy_initialized = true;
+    const u32 end = min(page_pfn_end(), (u32) BUDDY_MAX_PAGES);
+    for (u32 i = 0; i < end; i += BUDDY_MAX_BLOCK_PAGES) {
+        if (page_pfn_info(i) != NULL) {
+            buddy_add_memory(i, i + BUDDY_MAX_BLOCK_PAGES);
+        }
+    }
+}
+
+/**
+ * @brief Add the free pages of a range of initialized pages to the buddy
+ * allocator, and set the migrate type of the pageblocks of the range. The
+ * range must be aligned on the largest buddy block, and must not have been
+ * added before. The watermarks are updated to take the new memory into
+ * account.
+ * 
+ * @param start The first page frame number of the range.
+ * @param end The end page frame number of the range (exclusive).
+ */
+void buddy_add_memory(u32 start, u32 end)
+{
+    assert(is_aligned(start, BUDDY_MAX_BLOCK_PAGES));
+    end = min(end, (u32) BUDDY_MAX_PAGES);
+
+    // All pageblocks start as movable. Unmovable and reclaimable allocations
+    // will claim pageblocks when they need memory, keeping them grouped. The
+    // pageblocks of the contiguous memory area keep their own migrate type
+    // for their whole lifetime.
+    const u32 pageblock_pfn = buddy_order_to_pfn(BUDDY_PAGEBLOCK_ORDER);
+    for (u32 i = start; i < end; i += pageblock_pfn) {
+        struct page *pg = page_pfn_info(i);
+        if (pg == NULL) {
+            break;
+        } else if (cma_contains(page_pnf_to_offset(i))) {
+            page_set_migratetype(pg, MIGRATE_CMA);
+        } else {
+            page_set_migratetype(pg, MIGRATE_MOVABLE);
+        }
     }
 
-    // Use the page array to find free pages and add them to the buddy
-    // allocator (by default, the buddy allocator does not contain any
-    // free pages: this is because the buddy allocator is not aware of the
-    // available/used/reserved pages in the system)
-    for (int i = 0; i < BUDDY_MAX_PAGES; i++) {
+    // Find the runs of free pages in the range and free them with the largest
+    // blocks possible, which is much faster than freeing each page one by
+    // one and letting the allocator coalesce them. Pages are marked as
+    // allocated first since `buddy_free()` counts them as free again.
+    u32 i = start;
+    while (i < end) {
         struct page *pg = page_pfn_info(i);
         if (pg == NULL) {
             break;
-        } else if (pg->flags & PG_FREE) {
-            pg->flags |= PG_BUDDY;
-            buddy_free((void *) KERNEL_VBASE + page_pnf_to_offset(i), 0);
+        } else if (!(pg->flags & PG_FREE)) {
+            i++;
+            continue;
         }
+
+        u32 run = i;
+        for (; run < end; run++) {
+            struct page *free = page_pfn_info(run);
+            if (free == NULL || !(free->flags & PG_FREE)) {
+                break;
+            }
+            free->flags &= ~PG_FREE;
+        }
+
+        pg_free -= run - i;
+        buddy_managed_pages += run - i;
+        buddy_free_range((void *) KERNEL_VBASE + page_pnf_to_offset(i),
+                         run - i);
+        i = run;
     }
+
+    // Compute the watermarks from the amount of memory handed to the buddy
+    // allocator. The min watermark is the reserve that should never be used
+    // by regular allocations, and the low and high watermarks are used to
+    // start and stop the background reclaim.
+    const u32 min = max(buddy_managed_pages / BUDDY_WMARK_MIN_RATIO,
+                        (u32) BUDDY_WMARK_MIN_PAGES);
+    buddy_watermarks[BUDDY_WMARK_MIN] = min;
+    buddy_watermarks[BUDDY_WMARK_LOW] = min + min / 4;
+    buddy_watermarks[BUDDY_WMARK_HIGH] = min + min / 2;
+    buddy_update_watermarks();
 }
 
 /**
@@ -183,10 +701,28 @@ void buddy_free(void *ptr, u32 order)
         return;
     }
 
+    // Some sanity checks to ensure that the parameter is valid
+    // and that the block has not been freed before. Those checks
+    // are logic checks and should not happen in a normal execution.
+    paddr pbase = buddy_vaddr_to_paddr(base);
+    struct page *pg = page_info(pbase);
+    if (!page_is_aligned(base)) {
+        panic("buddy_free(): unaligned page address");
+    } else if (buddy_initialized) {
+        if (pg->flags & PG_RESERVED) {
+            panic("buddy_free(): trying to free a reserved page");
+        } else if (pg->flags & PG_POISONED) {
+            panic("buddy_free(): trying to free a poisoned page");
+        } else if (pg->flags & PG_FREE) {
+            panic("buddy_free(): double free detected");
+        } else if (pg->flags & PG_LRU) {
+            panic("buddy_free(): freeing a page still on the LRU lists");
+        }
+    }
+
     // Update the page information for the block by removing the PG_KERNEL
     // flag if it is set and adding the PG_FREE flag. It also set the `order`
     // field to 0 to indicate that this not a valid block anymore.
-    paddr pbase = buddy_vaddr_to_paddr(base);
     for (u32 i = 0; i < buddy_order_to_pfn(order); i++) {
         struct page *page = page_info(pbase + (i << PAGE_SHIFT));
         assert(!(page->flags & PG_FREE) || !buddy_initialized);
@@ -199,30 +735,14 @@ void buddy_free(void *ptr, u32 order)
             pg_free++;
         }
         page->flags &= ~PG_KERNEL;
-        page->flags |= PG_FREE;
+        page->flags |= PG_FREE | PG_BUDDY;
         page->order = 0;
     }
 
-    // Get the first page of the block and update its order since it is
-    // the head of the block.
-    struct page *pg = page_info(pbase);
+    // Update the order of the first page of the block since it is the head
+    // of the block.
     pg->order = order;
 
-    // Some sanity checks to ensure that the parameter is valid
-    // and that the block has not been freed before. Those checks
-    // are logic checks and should not happen in a normal execution.
-    if (!page_is_aligned(base)) {
-        panic("buddy_free(): unaligned page address");
-    } else if (buddy_initialized) {
-        if (pg->flags & PG_RESERVED) {
-            panic("buddy_free(): trying to free a reserved page");
-        } else if (pg->flags & PG_POISONED) {
-            panic("buddy_free(): trying to free a poisoned page");
-        } else if (pg->flags & PG_FREE) {
-            panic("buddy_free(): double free detected");
-        }
-    }
-
     // Coalesce the block with its buddy blocks until it is no longer
     // possible (i.e. the buddy block is not free, the maximum order
     // was reached...)
@@ -231,24 +751,27 @@ void buddy_free(void *ptr, u32 order)
         struct buddy_block *buddy = (struct buddy_block *) buddy_base;
         struct page *buddy_pg = page_info(buddy_vaddr_to_paddr(buddy_base));
 
-        list_remove(&buddy->list);
+        buddy_remove_free_block(buddy, pg->order);
 
         // Depending on the order of the buddy block, the base address of the
         // coalesced block will be the base address of the current block or the
-        // base address of the buddy block.
+        // base address of the buddy block. Only the head of the coalesced
+        // block keeps a non-zero order, so that free block heads can be
+        // found from the page array.
         if (buddy_base < base) {
             pg->order = 0;
             base = buddy_base;
             pg = buddy_pg;
+        } else {
+            buddy_pg->order = 0;
         }
         pg->order++;
     }
 
     // After coalescing, the block is now free and can be added to the free
-    // list. We simply need to create a new buddy block structure at the base
-    // address of the coalesced block and add it to the free list.
-    struct buddy_block *block = create_buddy_block_at(base);
-    list_add_head(&buddy_buckets[pg->order], &block->list);
+    // list of the migrate type of its pageblock.
+    buddy_add_free_block(base, pg->order);
+    buddy_update_watermarks();
 }
 
 /**
@@ -258,65 +781,157 @@ void buddy_free(void *ptr, u32 order)
  * @param order The order of the block to allocate. It must be between
  * `BUDDY_MIN_ORDER` and `BUDDY_MAX_ORDER` inclusive. If the order is outside
  * this range, this function panics.
+ * @param flags The allocation flags (BUDDY_*), describing the mobility of the
+ * allocated memory. The allocator uses them to group allocations with the
+ * same mobility in the same pageblocks.
  * @return void* The base address of the allocated block, or NULL if the
  * allocation failed.
  */
-void *buddy_alloc(u32 order)
+void *buddy_alloc(u32 order, uint flags)
 {
     assert(order <= BUDDY_MAX_ORDER);
 
-    // Find the first non-empty bucket with a block of at least
-    // the given order. If no such block is found, return NULL.
-    // If a block is found, remove it from the free list and
-    // split it into smaller blocks until the desired order is
-    // reached.
-    for (u32 i = order; i <= BUDDY_MAX_ORDER; i++) {
-        struct list_head *entry = list_pop_head(&buddy_buckets[i]);   
-        struct buddy_block *block = list_entry(entry, struct buddy_block, list);
-
-        // If the bucket is empty, continue to the next bucket. The block
-        // will be found in a bucket with a higher order and will be split
-        // into smaller blocks to reach the desired order.
-        if (!entry) {
-            continue;
+    // Single zeroed pages are served from the pre-zeroed page pool when
+    // possible, so that the page does not need to be zeroed here.
+    const uint type = buddy_flags_to_migratetype(flags);
+    if ((flags & BUDDY_ZERO) && order == 0) {
+        void *page = zero_pool_get(type);
+        if (page != NULL) {
+            return page;
         }
+    }
+
+    // Try to allocate a block from the pageblocks of the requested migrate
+    // type first, and only steal memory from other migrate types if there
+    // is no block available. If the memory is exhausted, give the pages
+    // of the pre-zeroed pool back to the allocator and try again, and then
+    // reclaim memory directly as a last resort. Before that, initialize the
+    // rest of the page array if it is not done yet, since this memory is
+    // free and just not known by the buddy allocator.
+    struct buddy_block *block = buddy_get_block(order, type);
+    while (block == NULL && page_deferred_init()) {
+        block = buddy_get_block(order, type);
+    }
+
+    if (block == NULL && zero_pool_drain() > 0) {
+        block = buddy_get_block(order, type);
+    }
+
+    if (block == NULL && reclaim_direct(buddy_order_to_pfn(order)) > 0) {
+        block = buddy_get_block(order, type);
+    }
+
+    if (block == NULL) {
+        warn("buddy_alloc(): cannot allocate block of order %u", order);
+        buddy_failures[order]++;
+        return NULL;
+    }
+    buddy_update_watermarks();
+
+    // Update the page information for the block (eventually splitted
+    // into smaller blocks to avoid wasting too much memory) and return
+    // the base address of the allocated block.
+    paddr base = buddy_vaddr_to_paddr((vaddr) block);
+    for (u32 j = 0; j < buddy_order_to_pfn(order); j++) {
+        struct page *page = page_info(base + (j << PAGE_SHIFT));
+        assert(!(page->flags & PG_RESERVED));
+        assert(!(page->flags & PG_POISONED));
+        assert(!(page->flags & PG_KERNEL));
+        assert(page->flags & PG_FREE);
         
-        // Split the block into smaller blocks until the desired order
-        // is reached. The remaining blocks are added to the free list.
-        for (u32 j = i; j > order; j--) {
-            const vaddr base = buddy_address((vaddr) block, j - 1);
-            struct buddy_block *buddy = create_buddy_block_at(base);
-            list_add_head(&buddy_buckets[j - 1], &buddy->list);
-
-            // Update the page information for the buddy block to reflect
-            // the new order of the created block.
-            struct page *pg = page_info(buddy_vaddr_to_paddr(base));
-            pg->order = j - 1;
-        }
+        page->flags |= PG_KERNEL;
+        page->flags &= ~PG_FREE;
+        page->order = 0;
+        page->count = 0;
+
+        pg_kernel++;
+        pg_free--;
+    }
+
+    if (flags & BUDDY_ZERO) {
+        memset(block, 0, buddy_order_to_bytes(order));
+    }
+    return block;
+}
+
+/**
+ * @brief Allocate a specific range of pages from the buddy allocator. This is
+ * used by the contiguous memory allocator, which must allocate a range at a
+ * known address instead of any block large enough. The free blocks covering
+ * the range are split, and the parts outside the range are given back to the
+ * free lists.
+ * 
+ * @param base The base address of the range. It must be page aligned.
+ * @param count The number of pages in the range.
+ * @return true If the whole range was free and is now allocated.
+ * @return false If a page in the range is not free. No page is allocated in
+ * this case.
+ */
+bool buddy_alloc_range(void *base, u32 count)
+{
+    const vaddr start = (vaddr) base;
+    const vaddr end = start + (count << PAGE_SHIFT);
+    assert(page_is_aligned(start));
 
-        // Update the page information for the block (eventually splitted
-        // into smaller blocks to avoid wasting too much memory) and return
-        // the base address of the allocated block.
-        paddr base = buddy_vaddr_to_paddr((vaddr) block);
-        for (u32 j = 0; j < buddy_order_to_pfn(order); j++) {
-            struct page *page = page_info(base + (j << PAGE_SHIFT));
-            assert(!(page->flags & PG_RESERVED));
-            assert(!(page->flags & PG_POISONED));
-            assert(!(page->flags & PG_KERNEL));
-            assert(page->flags & PG_FREE);
-            
-            page->flags |= PG_KERNEL;
-            page->flags &= ~PG_FREE;
-            page->order = 0;
-            page->count = 0;
-
-            pg_kernel++;
-            pg_free--;
+    for (vaddr va = start; va < end; va += PAGE_SIZE) {
+        struct page *pg = page_info(buddy_vaddr_to_paddr(va));
+        if (pg == NULL || !(pg->flags & PG_FREE) || !(pg->flags & PG_BUDDY)) {
+            return false;
         }
+    }
+
+    // Remove each free block overlapping the range from its free list, and
+    // give back the parts of the block outside of the range.
+    for (vaddr va = start; va < end; ) {
+        u32 order;
+        const vaddr head = buddy_find_free_block(va, &order);
+        assert(head != 0);
 
-        return block;
+        buddy_remove_free_block((struct buddy_block *) head, order);
+        buddy_isolate(head, order, start, end);
+        va = head + buddy_order_to_bytes(order);
     }
 
-    warn("buddy_alloc(): cannot allocate block of order %u", order);
-    return NULL;
+    for (vaddr va = start; va < end; va += PAGE_SIZE) {
+        struct page *page = page_info(buddy_vaddr_to_paddr(va));
+        page->flags |= PG_KERNEL;
+        page->flags &= ~PG_FREE;
+        page->order = 0;
+        page->count = 0;
+
+        pg_kernel++;
+        pg_free--;
+    }
+
+    buddy_update_watermarks();
+    return true;
+}
+
+/**
+ * @brief Free a range of pages, for example allocated with
+ * `buddy_alloc_range()`. The range is freed using the largest naturally
+ * aligned blocks that fit in it, up to a pageblock, and the buddy allocator
+ * coalesces them with their free buddies.
+ * 
+ * @param base The base address of the range. It must be page aligned.
+ * @param count The number of pages in the range.
+ */
+void buddy_free_range(void *base, u32 count)
+{
+    vaddr va = (vaddr) base;
+    const vaddr end = va + (count << PAGE_SHIFT);
+    assert(page_is_aligned(va));
+
+    // Blocks larger than a pageblock are formed by coalescing, which makes
+    // sure that they never mix contiguous memory area pageblocks with other
+    // pageblocks.
+    while (va < end) {
+        u32 order = BUDDY_PAGEBLOCK_ORDER;
+        while (!is_aligned(va, buddy_order_to_bytes(order)) ||
+               va + buddy_order_to_bytes(order) > end) {
+            order--;
+        }
+        buddy_free((void *) va, order);
+        va += buddy_order_to_bytes(order);
+    }
 }
@@ -0,0 +1,232 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/assert.h>
+#include <arch/paging.h>
+#include <mm/cma.h>
+#include <mm/lru.h>
+#include <mm/zero.h>
+#include <mm/buddy.h>
+
+/// The first physical address of the contiguous memory area, or 0 if no area
+/// could be reserved at boot.
+static paddr cma_start = 0;
+
+/// The end physical address of the contiguous memory area (exclusive).
+static paddr cma_end = 0;
+
+/// The number of pages of the contiguous memory area currently allocated with
+/// `cma_alloc()`.
+static unsigned int cma_used = 0;
+
+/// The number of borrowed pages evicted to give them back to `cma_alloc()`.
+static unsigned int cma_evicted = 0;
+
+/**
+ * @brief Verify if all pages in the given physical range are free.
+ * 
+ * @param start The first physical address of the range.
+ * @param end The end physical address of the range (exclusive).
+ * @return true If all pages in the range are free.
+ * @return false If at least one page is not free or does not exist.
+ */
+static bool cma_range_free(paddr start, paddr end) {
+    for (paddr addr = start; addr < end; addr += PAGE_SIZE) {
+        struct page *pg = page_info(addr);
+        if (pg == NULL || !(pg->flags & PG_FREE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Evict the pages borrowed by movable allocations in the given
+ * physical range, so that the whole range becomes free. Nothing is evicted
+ * if a page of the range is not on the LRU lists, since the range could not
+ * be freed anyway.
+ * 
+ * @param start The first physical address of the range.
+ * @param end The end physical address of the range (exclusive).
+ * @return true If all pages in the range are now free.
+ * @return false If at least one page could not be evicted.
+ */
+static bool cma_range_evict(paddr start, paddr end) {
+    for (paddr addr = start; addr < end; addr += PAGE_SIZE) {
+        const struct page *pg = page_info(addr);
+        if (pg == NULL || !(pg->flags & (PG_FREE | PG_LRU))) {
+            return false;
+        }
+    }
+
+    for (paddr addr = start; addr < end; addr += PAGE_SIZE) {
+        struct page *pg = page_info(addr);
+        if (pg->flags & PG_FREE) {
+            continue;
+        } else if (!lru_evict(pg)) {
+            return false;
+        }
+        cma_evicted++;
+    }
+    return true;
+}
+
+/**
+ * @brief Reserve the contiguous memory area. The highest pageblock aligned
+ * range of `CMA_SIZE` bytes of free low memory is selected, so that the area
+ * does not compete with the early boot allocations made at low addresses.
+ * The pages of the area stay free: the buddy allocator lends them to movable
+ * allocations until a contiguous allocation needs them.
+ * 
+ * This function must be called after the memory ranges of the page array are
+ * known and before the buddy allocator is set up. The pages of the area may
+ * not be initialized yet, so the memory map is used to find the free memory.
+ */
+_init
+void cma_reserve(void)
+{
+    const u32 align = buddy_order_to_bytes(BUDDY_PAGEBLOCK_ORDER);
+
+    paddr end = align_down(LOWMEM_END, align);
+    while (end >= CMA_SIZE + align) {
+        if (page_range_free(end - CMA_SIZE, end)) {
+            cma_start = end - CMA_SIZE;
+            cma_end = end;
+            info("Contiguous memory area reserved at %08x-%08x",
+                (u32) cma_start, (u32) cma_end);
+            return;
+        }
+        end -= align;
+    }
+    warn("Unable to reserve the contiguous memory area");
+}
+
+/**
+ * @brief Print some debug information about the contiguous memory area.
+ */
+void cma_debug_info(void)
+{
+    debug("Contiguous memory area: %u/%u pages used, %u pages evicted",
+        cma_used, (u32) page_pfn(cma_end - cma_start), cma_evicted);
+}
+
+/**
+ * @brief Verify if the given physical address is inside the contiguous memory
+ * area.
+ * 
+ * @param addr The physical address.
+ * @return true If the address is inside the contiguous memory area.
+ * @return false Otherwise.
+ */
+bool cma_contains(paddr addr)
+{
+    return addr >= cma_start && addr < cma_end;
+}
+
+/**
+ * @brief Try to allocate the given number of contiguous pages from the
+ * contiguous memory area.
+ * 
+ * @param count The number of pages to allocate.
+ * @param evict Whether the pages borrowed by movable allocations are evicted
+ * when no range is free.
+ * @return void* The base address of the allocated pages, or NULL if no range
+ * is free or can be freed.
+ */
+static void *cma_try_alloc(u32 count, bool evict) {
+    const u32 order = min(buddy_nearest_order(count),
+                          (uint) BUDDY_PAGEBLOCK_ORDER);
+    const u32 align = buddy_order_to_bytes(order);
+    const u32 size = count << PAGE_SHIFT;
+
+    for (paddr start = cma_start; start + size <= cma_end; start += align) {
+        if (!cma_range_free(start, start + size) &&
+            !(evict && cma_range_evict(start, start + size))) {
+            continue;
+        }
+
+        void *base = (void *) paddr_to_vaddr(start);
+        if (buddy_alloc_range(base, count)) {
+            cma_used += count;
+            return base;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocate physically contiguous pages from the contiguous memory
+ * area. The range is naturally aligned to its size, up to the size of a
+ * pageblock. If the pages are borrowed by other allocations, the pages of
+ * the pre-zeroed pool are given back first. Then, the borrowed pages of a
+ * range are evicted through the LRU lists, the anonymous pages to the
+ * compressed swap. The pages that cannot be evicted, like the pages shared
+ * copy-on-write or not on the LRU lists, keep their range busy.
+ * 
+ * @param count The number of pages to allocate.
+ * @return void* The base address of the allocated pages, or NULL if the
+ * allocation failed.
+ */
+void *cma_alloc(u32 count)
+{
+    assert(count > 0);
+    if (cma_start == cma_end) {
+        return NULL;
+    }
+
+    // The page array may not be initialized up to the contiguous memory area
+    // yet, and its pages are not in the buddy allocator until it is.
+    while (page_info(cma_end - 1) == NULL && page_deferred_init()) {
+        continue;
+    }
+
+    void *base = cma_try_alloc(count, false);
+    if (base == NULL && zero_pool_drain() > 0) {
+        base = cma_try_alloc(count, false);
+    }
+    if (base == NULL) {
+        base = cma_try_alloc(count, true);
+    }
+
+    if (base == NULL) {
+        warn("cma_alloc(): cannot allocate %u contiguous pages", count);
+    }
+    return base;
+}
+
+/**
+ * @brief Free pages allocated with `cma_alloc()`. The pages become available
+ * again for movable allocations.
+ * 
+ * @param ptr The base address of the pages.
+ * @param count The number of pages, as given to `cma_alloc()`.
+ */
+void cma_free(void *ptr, u32 count)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    const paddr base = (vaddr) ptr - KERNEL_VBASE;
+    assert(cma_contains(base));
+    assert(cma_contains(base + (count << PAGE_SHIFT) - 1));
+
+    buddy_free_range(ptr, count);
+    cma_used -= count;
+}
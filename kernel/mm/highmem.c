@@ -0,0 +1,205 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/assert.h>
+#include <arch/cpu.h>
+#include <mm/highmem.h>
+
+/// The free list of the highmem zone. Since highmem pages are not mapped in
+/// the kernel address space, the free list cannot be stored inside the free
+/// pages like the buddy allocator does, and uses the `list` field of the
+/// page information structure instead.
+static DECLARE_LIST(highmem_free_list);
+
+/// The number of pages managed by the highmem zone.
+static unsigned int highmem_total = 0;
+
+/// The number of free pages in the highmem zone.
+static unsigned int highmem_available = 0;
+
+/// The number of kmap slots currently used by each CPU. Slots are used as a
+/// stack: `kmap()` pushes a new mapping and `kunmap()` must release the most
+/// recent one.
+static uint kmap_depth[MAX_CPUS] = { };
+
+/// The number of kernel pages in the system, defined in kernel/mm/page.c
+extern unsigned int pg_kernel;
+
+/// The number of free pages in the system, defined in kernel/mm/page.c
+extern unsigned int pg_free;
+
+/**
+ * @brief Setup the highmem zone. All initialized free pages above the end of
+ * the low memory are added to the highmem free list and become allocatable
+ * with the `highmem_alloc()` function. This function must be called after
+ * the page array has been initialized.
+ */
+_init
+void highmem_setup(void)
+{
+    highmem_add_memory(page_pfn(LOWMEM_END), page_pfn_end());
+    if (highmem_total) {
+        info("Highmem: %u MiB available", highmem_total / 256);
+    }
+}
+
+/**
+ * @brief Add the free pages of a range of initialized pages above the end of
+ * the low memory to the highmem zone. Pages without a page information
+ * structure are skipped.
+ * 
+ * @param start The first page frame number of the range.
+ * @param end The end page frame number of the range (exclusive).
+ */
+void highmem_add_memory(u32 start, u32 end)
+{
+    assert(start >= page_pfn(LOWMEM_END));
+    for (u32 i = start; i < end; i++) {
+        struct page *pg = page_pfn_info(i);
+        if (pg != NULL && (pg->flags & PG_FREE)) {
+            pg->flags |= PG_HIGHMEM;
+            list_add_tail(&highmem_free_list, &pg->list);
+            highmem_available++;
+            highmem_total++;
+        }
+    }
+}
+
+/**
+ * @brief Print some debug information about the highmem zone.
+ */
+void highmem_debug_info(void)
+{
+    debug("Highmem pages: %u (%u free)", highmem_total, highmem_available);
+}
+
+/**
+ * @brief Allocate a page from the highmem zone. The page is not mapped in the
+ * kernel address space and must be accessed with `kmap()`. If the zone is
+ * empty, the rest of the page array is initialized first, since the highmem
+ * sections may not be initialized yet.
+ * 
+ * @return paddr The physical address of the allocated page, or 0 if the
+ * highmem zone is exhausted (or does not exist on this system).
+ */
+paddr highmem_alloc(void)
+{
+    while (list_empty(&highmem_free_list) && page_deferred_init()) {
+        continue;
+    }
+
+    struct list_head *entry = list_pop_head(&highmem_free_list);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    struct page *pg = list_entry(entry, struct page, list);
+    assert(pg->flags & PG_HIGHMEM);
+    assert(pg->flags & PG_FREE);
+
+    pg->flags &= ~PG_FREE;
+    pg->flags |= PG_KERNEL;
+    pg->count = 0;
+
+    highmem_available--;
+    pg_kernel++;
+    pg_free--;
+
+    return page_paddr(pg);
+}
+
+/**
+ * @brief Free a page previously allocated with `highmem_alloc()`. Freeing a
+ * page that is not a highmem page or that was already freed will panic.
+ * 
+ * @param addr The physical address of the page to free. Passing 0 is safe and
+ * has no effect.
+ */
+void highmem_free(paddr addr)
+{
+    if (addr == 0) {
+        return;
+    }
+
+    struct page *pg = page_info(addr);
+    if (pg == NULL || !(pg->flags & PG_HIGHMEM)) {
+        panic("highmem_free(): not a highmem page");
+    } else if (pg->flags & PG_FREE) {
+        panic("highmem_free(): double free detected");
+    }
+
+    pg->flags &= ~PG_KERNEL;
+    pg->flags |= PG_FREE;
+    list_add_head(&highmem_free_list, &pg->list);
+
+    highmem_available++;
+    pg_kernel--;
+    pg_free++;
+}
+
+/**
+ * @brief Temporarily map a physical page in the kernel address space. Low
+ * memory pages are permanently mapped, so their direct mapping is returned
+ * and no slot is consumed. For highmem pages, a per-CPU slot is used and the
+ * mapping must be released with `kunmap()` in the reverse order of the
+ * `kmap()` calls. The mapping is only valid on the current CPU.
+ * 
+ * @param addr The physical address of the page to map, must be page aligned.
+ * @return void* The virtual address where the page can be accessed.
+ */
+void *kmap(paddr addr)
+{
+    if (page_lowmem_compatible(addr)) {
+        return (void *) paddr_to_vaddr(addr);
+    }
+
+    const uint cpu = cpu_id();
+    if (kmap_depth[cpu] >= KMAP_SLOTS_PER_CPU) {
+        panic("kmap(): no more kmap slots available");
+    }
+
+    const uint slot = KMAP_FIXMAP_FIRST +
+        cpu * KMAP_SLOTS_PER_CPU + kmap_depth[cpu]++;
+    return (void *) paging_fixmap_set(slot, addr);
+}
+
+/**
+ * @brief Release a temporary mapping created with `kmap()`. Mappings must be
+ * released in the reverse order of their creation. Passing an address of the
+ * direct mapping is safe and has no effect.
+ * 
+ * @param ptr The address returned by `kmap()`.
+ */
+void kunmap(void *ptr)
+{
+    const vaddr va = page_align_down((vaddr) ptr);
+    if (va < KMAP_BASE || va >= KMAP_END) {
+        return;
+    }
+
+    const uint cpu = cpu_id();
+    assert(kmap_depth[cpu] > 0);
+
+    const uint slot = KMAP_FIXMAP_FIRST +
+        cpu * KMAP_SLOTS_PER_CPU + --kmap_depth[cpu];
+    if (paging_fixmap_vaddr(slot) != va) {
+        panic("kunmap(): mappings must be released in reverse order");
+    }
+    paging_fixmap_clear(slot);
+}
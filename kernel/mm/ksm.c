@@ -0,0 +1,384 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <mm/vm.h>
+#include <mm/ksm.h>
+#include <mm/page.h>
+#include <mm/slub.h>
+
+/// A private page seen during the current pass, which may be merged with an
+/// identical page found later in the pass.
+struct ksm_item {
+    struct vm_space *space;
+    vaddr va;
+    paddr pa;
+    u32 checksum;
+    struct list_head node;
+};
+
+/// A merged page, shared read-only by all the mappings of identical pages.
+/// The entry is released lazily when the page is not merged anymore.
+struct ksm_stable {
+    paddr pa;
+    u32 checksum;
+    struct list_head node;
+};
+
+/// The pages seen during the current pass, and the merged pages, hashed by
+/// the checksum of their content. The first table is emptied after each pass
+/// since the content of the private pages may have changed since.
+static struct list_head ksm_unstable[KSM_BUCKETS];
+static struct list_head ksm_stable[KSM_BUCKETS];
+
+/// The caches used to allocate the entries of the hash tables.
+static struct slub_cache *ksm_item_cache = NULL;
+static struct slub_cache *ksm_stable_cache = NULL;
+
+/// The position of the scanner: the list node of the address space being
+/// scanned, or NULL between two passes, and the next address to scan in it.
+static struct list_head *ksm_cursor = NULL;
+static vaddr ksm_cursor_va = 0;
+
+/// The checksum of a zeroed page.
+static u32 ksm_zero_checksum = 0;
+
+/// The number of completed passes, of pages scanned, of pages merged with
+/// another page, and of zeroed pages merged with the zero page.
+static uint ksm_passes = 0;
+static uint ksm_scanned = 0;
+static uint ksm_merges = 0;
+static uint ksm_zero_merges = 0;
+
+/// The number of pages merged during the current pass.
+static uint ksm_pass_merges = 0;
+
+/**
+ * @brief Compute the checksum of the content of a page, with the FNV-1a hash
+ * of its words.
+ * 
+ * @param page The page.
+ * @return u32 The checksum.
+ */
+static u32 ksm_checksum(const u32 *page)
+{
+    u32 hash = 2166136261u;
+    for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+        hash = (hash ^ page[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Check if a page is zeroed.
+ * 
+ * @param page The page.
+ * @return true If all the words of the page are 0.
+ */
+static bool ksm_is_zero(const u32 *page)
+{
+    for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+        if (page[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Setup the same-page merging. This function must be called after the
+ * slub allocator has been initialized.
+ */
+_init
+void ksm_setup(void)
+{
+    for (uint i = 0; i < KSM_BUCKETS; i++) {
+        list_init(&ksm_unstable[i]);
+        list_init(&ksm_stable[i]);
+    }
+
+    ksm_item_cache = slub_create_cache(
+        "ksm_item", sizeof(struct ksm_item), 0, 0, SLUB_NONE);
+    ksm_stable_cache = slub_create_cache(
+        "ksm_stable", sizeof(struct ksm_stable), 0, 0, SLUB_NONE);
+    if (ksm_item_cache == NULL || ksm_stable_cache == NULL) {
+        panic("Failed to create the ksm caches");
+    }
+
+    u32 hash = 2166136261u;
+    for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+        hash *= 16777619u;
+    }
+    ksm_zero_checksum = hash;
+}
+
+/**
+ * @brief Check if the page of an entry of the merged pages is still merged.
+ * 
+ * @param stable The entry.
+ * @return true If the page is still merged.
+ */
+static bool ksm_stable_alive(const struct ksm_stable *stable)
+{
+    const struct page *page = page_info(stable->pa);
+    return (page->flags & PG_KSM) && page->count > 0;
+}
+
+/**
+ * @brief Print the number of merged pages and of pages saved by merging them.
+ */
+void ksm_debug_info(void)
+{
+    uint shared = 0;
+    uint saved = 0;
+    for (uint i = 0; i < KSM_BUCKETS; i++) {
+        list_foreach(&ksm_stable[i], entry) {
+            struct ksm_stable *stable = list_entry(entry, struct ksm_stable,
+                node);
+            if (ksm_stable_alive(stable)) {
+                shared++;
+                saved += page_info(stable->pa)->count - 1;
+            }
+        }
+    }
+    debug("KSM: %u pages shared, %u pages saved, %u zero pages merged",
+        shared, saved, ksm_zero_merges);
+    debug("  %u pages scanned in %u passes, %u merges", ksm_scanned,
+        ksm_passes, ksm_merges);
+}
+
+/**
+ * @brief Find the next address to scan in the mergeable areas. The area of
+ * the cursor is found in the tree of the areas, so that the cost does not
+ * grow with the number of areas before it.
+ * 
+ * @param space Set to the address space of the address.
+ * @param va Set to the address.
+ * @return true If there is an address to scan.
+ * @return false If the pass is complete.
+ */
+static bool ksm_next(struct vm_space **space, vaddr *va)
+{
+    for (; ksm_cursor != &vm_spaces; ksm_cursor = ksm_cursor->next) {
+        struct vm_space *current = list_entry(ksm_cursor, struct vm_space,
+            node);
+        struct vm_area *area = vm_area_find_next(current, ksm_cursor_va);
+        while (area != NULL && !(area->flags & VM_MERGEABLE)) {
+            area = (area->node.next == &current->areas) ? NULL :
+                list_next_entry(&area->node, struct vm_area, node);
+        }
+
+        if (area != NULL) {
+            *space = current;
+            *va = max(area->start, ksm_cursor_va);
+            ksm_cursor_va = *va + PAGE_SIZE;
+            return true;
+        }
+        ksm_cursor_va = 0;
+    }
+    return false;
+}
+
+/**
+ * @brief Merge a page with an identical merged page, if there is one.
+ * 
+ * @param space The address space of the page.
+ * @param va The address of the page.
+ * @param pa The page.
+ * @param checksum The checksum of the page.
+ * @return true If an identical merged page was found.
+ */
+static bool ksm_merge_stable(struct vm_space *space, vaddr va, paddr pa,
+    u32 checksum)
+{
+    const void *content = (const void *) paddr_to_vaddr(pa);
+    list_foreach_safe(&ksm_stable[checksum & (KSM_BUCKETS - 1)], entry) {
+        struct ksm_stable *stable = list_entry(entry, struct ksm_stable, node);
+        if (!ksm_stable_alive(stable)) {
+            list_remove(&stable->node);
+            slub_free(ksm_stable_cache, stable);
+        } else if (stable->checksum == checksum && memcmp(content,
+            (const void *) paddr_to_vaddr(stable->pa), PAGE_SIZE) == 0) {
+            return vm_page_merge(space, va, pa, stable->pa);
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Merge a page with an identical private page seen earlier in the pass,
+ * if there is one. The page seen earlier becomes a merged page. Otherwise,
+ * the page is remembered for the rest of the pass.
+ * 
+ * @param space The address space of the page.
+ * @param va The address of the page.
+ * @param pa The page.
+ * @param checksum The checksum of the page.
+ * @return true If the page was merged.
+ */
+static bool ksm_merge_unstable(struct vm_space *space, vaddr va, paddr pa,
+    u32 checksum)
+{
+    struct list_head *bucket = &ksm_unstable[checksum & (KSM_BUCKETS - 1)];
+    const void *content = (const void *) paddr_to_vaddr(pa);
+    list_foreach(bucket, entry) {
+        struct ksm_item *item = list_entry(entry, struct ksm_item, node);
+        if (item->checksum != checksum ||
+            vm_page_private(item->space, item->va) != item->pa ||
+            memcmp(content, (const void *) paddr_to_vaddr(item->pa),
+                PAGE_SIZE) != 0) {
+            continue;
+        }
+
+        struct ksm_stable *stable = slub_alloc(ksm_stable_cache);
+        if (stable == NULL) {
+            return false;
+        }
+        stable->pa = item->pa;
+        stable->checksum = checksum;
+        list_add_tail(&ksm_stable[checksum & (KSM_BUCKETS - 1)],
+            &stable->node);
+        vm_page_merge(item->space, item->va, item->pa, item->pa);
+
+        list_remove(&item->node);
+        slub_free(ksm_item_cache, item);
+        return vm_page_merge(space, va, pa, stable->pa);
+    }
+
+    struct ksm_item *item = slub_alloc(ksm_item_cache);
+    if (item != NULL) {
+        item->space = space;
+        item->va = va;
+        item->pa = pa;
+        item->checksum = checksum;
+        list_add_tail(bucket, &item->node);
+    }
+    return false;
+}
+
+/**
+ * @brief Scan a page: a zeroed page is replaced with the zero page, and other
+ * pages are merged with an identical merged page, or else with an identical
+ * page seen earlier in the pass.
+ * 
+ * @param space The address space of the page.
+ * @param va The address of the page.
+ */
+static void ksm_scan_page(struct vm_space *space, vaddr va)
+{
+    const paddr pa = vm_page_private(space, va);
+    if (pa == 0) {
+        return;
+    }
+
+    const u32 *content = (const u32 *) paddr_to_vaddr(pa);
+    const u32 checksum = ksm_checksum(content);
+    ksm_scanned++;
+    if (checksum == ksm_zero_checksum && ksm_is_zero(content)) {
+        if (vm_page_merge(space, va, pa, 0)) {
+            ksm_zero_merges++;
+            ksm_pass_merges++;
+        }
+    } else if (ksm_merge_stable(space, va, pa, checksum) ||
+        ksm_merge_unstable(space, va, pa, checksum)) {
+        ksm_merges++;
+        ksm_pass_merges++;
+    }
+}
+
+/**
+ * @brief Complete a pass: the pages seen during the pass are forgotten, and
+ * the entries of the pages that are not merged anymore are released.
+ */
+static void ksm_end_pass(void)
+{
+    for (uint i = 0; i < KSM_BUCKETS; i++) {
+        list_foreach_safe(&ksm_unstable[i], entry) {
+            list_remove(entry);
+            slub_free(ksm_item_cache, list_entry(entry, struct ksm_item,
+                node));
+        }
+        list_foreach_safe(&ksm_stable[i], entry) {
+            struct ksm_stable *stable = list_entry(entry, struct ksm_stable,
+                node);
+            if (!ksm_stable_alive(stable)) {
+                list_remove(entry);
+                slub_free(ksm_stable_cache, stable);
+            }
+        }
+    }
+    ksm_cursor = NULL;
+    ksm_passes++;
+}
+
+/**
+ * @brief Run the same-page merging scanner. This function should be called
+ * when the CPU has nothing better to do. Each call scans a bounded number of
+ * addresses of the mergeable areas of all the address spaces, and a pass
+ * over all of them is started again until a pass does not merge any page.
+ * 
+ * @param budget The maximum number of addresses to scan.
+ * @return true if the scanner still has work to do.
+ * @return false if the last pass did not merge any page.
+ */
+bool ksm_run(uint budget)
+{
+    if (ksm_cursor == NULL) {
+        ksm_cursor = vm_spaces.next;
+        ksm_cursor_va = 0;
+        ksm_pass_merges = 0;
+    }
+
+    for (uint i = 0; i < budget; i++) {
+        struct vm_space *space;
+        vaddr va;
+        if (!ksm_next(&space, &va)) {
+            ksm_end_pass();
+            return ksm_pass_merges > 0;
+        }
+        ksm_scan_page(space, va);
+    }
+    return true;
+}
+
+/**
+ * @brief Forget the pages of an address space that is being destroyed, and
+ * move the scanner to the next address space if it was scanning it.
+ * 
+ * @param space The address space.
+ */
+void ksm_forget_space(struct vm_space *space)
+{
+    if (ksm_cursor == &space->node) {
+        ksm_cursor = space->node.next;
+        ksm_cursor_va = 0;
+    }
+
+    for (uint i = 0; i < KSM_BUCKETS; i++) {
+        list_foreach_safe(&ksm_unstable[i], entry) {
+            struct ksm_item *item = list_entry(entry, struct ksm_item, node);
+            if (item->space == space) {
+                list_remove(entry);
+                slub_free(ksm_item_cache, item);
+            }
+        }
+    }
+}
@@ -0,0 +1,325 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <mm/lru.h>
+#include <mm/page.h>
+#include <mm/reclaim.h>
+
+/// A list of pages, from the most recently used at its head to the least
+/// recently used at its tail.
+struct lru_list {
+    struct list_head pages;
+    uint count;
+};
+
+/// The LRU lists of each type. A new page starts at the head of the inactive
+/// list, and is promoted to the active list if it is referenced before it
+/// reaches the tail. The active pages that are not referenced anymore are
+/// moved back to the inactive list, where they get a second chance.
+static struct lru_list lru_inactive[LRU_TYPES];
+static struct lru_list lru_active[LRU_TYPES];
+
+/// The operations of the owners of the pages of each type.
+static const struct lru_ops *lru_ops[LRU_TYPES] = {};
+
+/// The number of pages scanned, promoted, deactivated and evicted by the
+/// reclaimer.
+static uint lru_scanned = 0;
+static uint lru_promoted = 0;
+static uint lru_deactivated = 0;
+static uint lru_evicted = 0;
+
+/// Set while the reclaimer evicts pages, since evicting a page may allocate
+/// memory and reclaim memory again.
+static bool lru_shrinking = false;
+
+/// The shrinker evicting the least recently used pages.
+static struct shrinker lru_shrinker = {
+    .name = "lru",
+    .shrink = lru_shrink,
+};
+
+/**
+ * @brief Initialize the LRU lists and register the LRU shrinker.
+ */
+_init
+void lru_setup(void)
+{
+    for (uint i = 0; i < LRU_TYPES; i++) {
+        list_init(&lru_inactive[i].pages);
+        list_init(&lru_active[i].pages);
+    }
+    shrinker_register(&lru_shrinker);
+}
+
+/**
+ * @brief Register the operations of the owner of the pages of a type.
+ * 
+ * @param type The LRU type (LRU_*).
+ * @param ops The operations. The structure must stay valid forever.
+ */
+void lru_register(uint type, const struct lru_ops *ops)
+{
+    assert(type < LRU_TYPES && ops->referenced != NULL);
+    lru_ops[type] = ops;
+}
+
+/**
+ * @brief Print some debug information about the LRU lists.
+ */
+void lru_debug_info(void)
+{
+    debug("LRU: anon %u/%u, file %u/%u pages active/inactive",
+        lru_active[LRU_ANON].count, lru_inactive[LRU_ANON].count,
+        lru_active[LRU_FILE].count, lru_inactive[LRU_FILE].count);
+    debug("  %u scanned, %u promoted, %u deactivated, %u evicted",
+        lru_scanned, lru_promoted, lru_deactivated, lru_evicted);
+}
+
+/**
+ * @brief Get the list containing a page.
+ * 
+ * @param page The page, which must be on the LRU lists.
+ * @return struct lru_list* The list of the page.
+ */
+static struct lru_list *lru_list_of(struct page *page)
+{
+    const uint type = (page->flags & PG_LRU_FILE) ? LRU_FILE : LRU_ANON;
+    return (page->flags & PG_ACTIVE) ? &lru_active[type] :
+        &lru_inactive[type];
+}
+
+/**
+ * @brief Move a page to the head of the active or inactive list of its type.
+ * 
+ * @param page The page, which must be on the LRU lists.
+ * @param active Whether the page is moved to the active list.
+ */
+static void lru_move(struct page *page, bool active)
+{
+    struct lru_list *from = lru_list_of(page);
+    list_remove(&page->list);
+    from->count--;
+
+    page->flags &= ~(PG_ACTIVE | PG_REFERENCED);
+    page->flags |= active ? PG_ACTIVE : 0;
+
+    struct lru_list *to = lru_list_of(page);
+    list_add_head(&to->pages, &page->list);
+    to->count++;
+}
+
+/**
+ * @brief Add a page to the head of the inactive list of a type. The `list`
+ * field of the page is used to link it, so the page must not be in another
+ * list.
+ * 
+ * @param page The page, which must not be on the LRU lists.
+ * @param type The LRU type (LRU_*).
+ */
+void lru_add(struct page *page, uint type)
+{
+    assert(!(page->flags & PG_LRU) && type < LRU_TYPES);
+    page->flags &= ~(PG_ACTIVE | PG_REFERENCED | PG_LRU_FILE);
+    page->flags |= PG_LRU | (type == LRU_FILE ? PG_LRU_FILE : 0);
+    list_add_head(&lru_inactive[type].pages, &page->list);
+    lru_inactive[type].count++;
+}
+
+/**
+ * @brief Remove a page from the LRU lists. It must be called before the page
+ * is released.
+ * 
+ * @param page The page. Nothing is done if it is not on the LRU lists.
+ */
+void lru_remove(struct page *page)
+{
+    if (!(page->flags & PG_LRU)) {
+        return;
+    }
+
+    lru_list_of(page)->count--;
+    list_remove(&page->list);
+    page->flags &= ~(PG_LRU | PG_ACTIVE | PG_REFERENCED | PG_LRU_FILE);
+}
+
+/**
+ * @brief Mark a page as accessed, for the accesses that do not go through a
+ * mapping of the page and do not set an accessed bit, like a read of a cached
+ * file. The second access to an inactive page promotes it.
+ * 
+ * @param page The page. Nothing is done if it is not on the LRU lists.
+ */
+void lru_mark_accessed(struct page *page)
+{
+    if (!(page->flags & PG_LRU)) {
+        return;
+    } else if (!(page->flags & PG_REFERENCED)) {
+        page->flags |= PG_REFERENCED;
+    } else if (!(page->flags & PG_ACTIVE)) {
+        lru_move(page, true);
+        lru_promoted++;
+    }
+}
+
+/**
+ * @brief Test and clear whether a page was referenced since it was last
+ * scanned, either through its mappings or with `lru_mark_accessed()`.
+ * 
+ * @param type The LRU type of the page.
+ * @param page The page.
+ * @return true If the page was referenced.
+ */
+static bool lru_referenced(uint type, struct page *page)
+{
+    const bool marked = page->flags & PG_REFERENCED;
+    page->flags &= ~PG_REFERENCED;
+    return lru_ops[type]->referenced(page) || marked;
+}
+
+/**
+ * @brief Age the tail of the active list of a type: the pages referenced
+ * since they were last scanned stay active, and the others are moved to the
+ * inactive list.
+ * 
+ * @param type The LRU type.
+ * @param count The number of pages to scan.
+ */
+static void lru_age(uint type, uint count)
+{
+    struct lru_list *active = &lru_active[type];
+    for (uint i = 0; i < count && active->count > 0; i++) {
+        struct page *page = list_last_entry(&active->pages, struct page,
+            list);
+        lru_scanned++;
+        if (lru_referenced(type, page)) {
+            lru_move(page, true);
+        } else {
+            lru_move(page, false);
+            lru_deactivated++;
+        }
+    }
+}
+
+/**
+ * @brief Evict the least recently used pages of a type. The active list is
+ * first aged so that the inactive list is at least as long, which gives the
+ * inactive pages a chance to be referenced again before they reach the tail.
+ * Then, the pages at the tail of the inactive list are promoted if they were
+ * referenced, and evicted otherwise.
+ * 
+ * @param type The LRU type.
+ * @param target The number of pages to evict.
+ * @return u32 The number of pages evicted.
+ */
+static u32 lru_shrink_type(uint type, u32 target)
+{
+    struct lru_list *active = &lru_active[type];
+    struct lru_list *inactive = &lru_inactive[type];
+    if (inactive->count < active->count) {
+        lru_age(type, min(active->count - inactive->count,
+            (uint) LRU_AGE_BATCH));
+    }
+
+    u32 evicted = 0;
+    uint scan = min(inactive->count, target * LRU_SCAN_RATIO);
+    for (; scan > 0 && evicted < target; scan--) {
+        struct page *page = list_last_entry(&inactive->pages, struct page,
+            list);
+        lru_scanned++;
+        if (lru_referenced(type, page)) {
+            lru_move(page, true);
+            lru_promoted++;
+            continue;
+        }
+
+        lru_remove(page);
+        if (lru_ops[type]->evict(page)) {
+            evicted++;
+        } else {
+            lru_add(page, type);
+        }
+    }
+
+    lru_evicted += evicted;
+    return evicted;
+}
+
+/**
+ * @brief Evict the least recently used pages, starting with the file pages
+ * which are usually cheaper to evict than the anonymous ones. The types whose
+ * pages cannot be evicted are skipped, and nothing is done when called again
+ * by an allocation made while evicting.
+ * 
+ * @param target The number of pages to evict.
+ * @return u32 The number of pages evicted.
+ */
+u32 lru_shrink(u32 target)
+{
+    static const uint order[] = { LRU_FILE, LRU_ANON };
+    if (lru_shrinking) {
+        return 0;
+    }
+
+    lru_shrinking = true;
+    u32 evicted = 0;
+    for (uint i = 0; i < LRU_TYPES && evicted < target; i++) {
+        const uint type = order[i];
+        if (lru_ops[type] != NULL && lru_ops[type]->evict != NULL) {
+            evicted += lru_shrink_type(type, target - evicted);
+        }
+    }
+    lru_shrinking = false;
+    return evicted;
+}
+
+/**
+ * @brief Evict a page on demand, whatever its age, for example to give back
+ * a page borrowed from the contiguous memory area. The page is put back in
+ * the lists if its owner cannot evict it.
+ * 
+ * @param page The page.
+ * @return true If the page was evicted and released.
+ * @return false If the page is not on the LRU lists, cannot be evicted, or if
+ * called by an allocation made while evicting.
+ */
+bool lru_evict(struct page *page)
+{
+    if (!(page->flags & PG_LRU) || lru_shrinking) {
+        return false;
+    }
+
+    const uint type = (page->flags & PG_LRU_FILE) ? LRU_FILE : LRU_ANON;
+    if (lru_ops[type] == NULL || lru_ops[type]->evict == NULL) {
+        return false;
+    }
+
+    lru_shrinking = true;
+    lru_remove(page);
+    const bool evicted = lru_ops[type]->evict(page);
+    if (evicted) {
+        lru_evicted++;
+    } else {
+        lru_add(page, type);
+    }
+    lru_shrinking = false;
+    return evicted;
+}
@@ -0,0 +1,332 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <arch/paging.h>
+#include <mm/memblock.h>
+
+/// The usable physical memory, as described by the memory map.
+_initdata struct memblock_type memblock_memory = { };
+
+/// The physical memory used by the kernel image, the data given by the
+/// bootloader and the early allocations. Reserved memory is a subset of
+/// the usable memory.
+_initdata struct memblock_type memblock_reserved = { };
+
+/// Set when the page array has been built from the memblock regions. After
+/// this point, the page allocators must be used instead.
+_initdata static bool memblock_finished = false;
+
+/**
+ * @brief Add a region to a memblock type. The region is merged with the
+ * regions it overlaps or is adjacent to, so that the regions stay sorted and
+ * disjoint.
+ * 
+ * @param type The memblock type.
+ * @param base The first physical address of the region.
+ * @param end The end physical address of the region (exclusive).
+ */
+_init
+static void memblock_insert(struct memblock_type *type, u64 base, u64 end)
+{
+    if (base >= end) {
+        return;
+    }
+
+    // Find the first region that ends at or after the new region start, and
+    // absorb all the regions that overlap or touch the new region.
+    uint first = 0;
+    while (first < type->count && type->regions[first].end < base) {
+        first++;
+    }
+
+    uint last = first;
+    while (last < type->count && type->regions[last].base <= end) {
+        base = min(base, type->regions[last].base);
+        end = max(end, type->regions[last].end);
+        last++;
+    }
+
+    // Replace the absorbed regions [first, last) with the merged region.
+    const uint removed = last - first;
+    if (removed == 0 && type->count >= MEMBLOCK_MAX_REGIONS) {
+        panic("memblock: too many regions");
+    }
+
+    const uint moved = type->count - last;
+    memmove(&type->regions[first + 1], &type->regions[last],
+        moved * sizeof(struct memblock_region));
+    type->regions[first] = (struct memblock_region) {
+        .base = base,
+        .end = end,
+    };
+    type->count = type->count - removed + 1;
+}
+
+/**
+ * @brief Remove a range from a memblock type. The regions partially covered
+ * by the range are shrunk or split.
+ * 
+ * @param type The memblock type.
+ * @param base The first physical address of the range.
+ * @param end The end physical address of the range (exclusive).
+ */
+_init
+static void memblock_remove(struct memblock_type *type, u64 base, u64 end)
+{
+    for (uint i = 0; i < type->count; i++) {
+        struct memblock_region *region = &type->regions[i];
+        if (region->end <= base || region->base >= end) {
+            continue;
+        }
+
+        // Keep the parts of the region below and above the range. If both
+        // parts exist, the region is split in two.
+        const struct memblock_region old = *region;
+        if (old.base < base && old.end > end) {
+            if (type->count >= MEMBLOCK_MAX_REGIONS) {
+                panic("memblock: too many regions");
+            }
+            memmove(&type->regions[i + 1], &type->regions[i],
+                (type->count - i) * sizeof(struct memblock_region));
+            type->regions[i].end = base;
+            type->regions[i + 1].base = end;
+            type->count++;
+            return;
+        } else if (old.base < base) {
+            region->end = base;
+        } else if (old.end > end) {
+            region->base = end;
+        } else {
+            memmove(&type->regions[i], &type->regions[i + 1],
+                (type->count - i - 1) * sizeof(struct memblock_region));
+            type->count--;
+            i--;
+        }
+    }
+}
+
+/**
+ * @brief Find a free range of memory, i.e. usable memory that is not
+ * reserved, below the given limit. The memory is searched from the top, so
+ * that the low memory, needed by legacy devices, is used last.
+ * 
+ * @param size The size of the range, in bytes.
+ * @param align The alignment of the range. It must be a power of two.
+ * @param limit The end of the memory that can be used.
+ * @return u64 The base address of the range, or 0 if no range was found.
+ */
+_init
+static u64 memblock_find(u64 size, u64 align, u64 limit)
+{
+    for (int i = memblock_memory.count - 1; i >= 0; i--) {
+        const struct memblock_region *memory = &memblock_memory.regions[i];
+        const u64 end = min(memory->end, limit);
+
+        // Try each gap between reserved regions, from the top. The gap `j` is
+        // the free space below the reserved region `j`.
+        const struct memblock_region *reserved = memblock_reserved.regions;
+        for (int j = memblock_reserved.count; j >= 0; j--) {
+            const u64 gap_end = (j < (int) memblock_reserved.count)
+                ? min(end, reserved[j].base)
+                : end;
+            const u64 gap_base = (j > 0)
+                ? max(memory->base, reserved[j - 1].end)
+                : memory->base;
+
+            if (gap_end <= gap_base || gap_end - gap_base < size) {
+                continue;
+            }
+
+            const u64 base = (gap_end - size) & ~(align - 1);
+            if (base >= gap_base) {
+                return base;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Setup the early memory allocator from the memory map given by the
+ * bootloader. The kernel image, the first page of memory and the data given
+ * by the bootloader (the multiboot information, the memory map and the
+ * modules) are reserved so that early allocations cannot overwrite them.
+ * 
+ * @param mb_info The multiboot information structure.
+ */
+_init
+void memblock_setup(struct mb_info *mb_info)
+{
+    if (!(mb_info->flags & MB_INFO_MEMMAP)) {
+        // TODO: Implement a sort of memory probing
+        // The problem is that it is slow and not very reliable and
+        // can potentially permanently damage the system if we write
+        // to device-mapped memory. Therefore, we should only do this
+        // if we have no other choice, and do it very conservatively.
+        panic("No memory map provided by the bootloader");
+    }
+
+    struct mb_mmap *mmap = (struct mb_mmap *) mb_info->mmap_addr;
+    while (mmap < mb_mmap_end(mb_info)) {
+        if (mmap->type == MB_MEMORY_AVAILABLE) {
+            memblock_add(mmap->addr, mmap->len);
+        }
+        mmap = mb_next_mmap(mmap);
+    }
+
+    // The first page is never used, since a null physical address is used
+    // to report allocation failures.
+    const paddr kernel_end = (vaddr) &__end - KERNEL_VBASE;
+    memblock_reserve(0, PAGE_SIZE);
+    memblock_reserve(KERNEL_PBASE, kernel_end - KERNEL_PBASE);
+    memblock_reserve((vaddr) mb_info - KERNEL_VBASE, sizeof(struct mb_info));
+    memblock_reserve(mb_info->mmap_addr - KERNEL_VBASE, mb_info->mmap_length);
+
+    if (mb_info->flags & MB_INFO_MODS) {
+        struct mb_module *mods = (struct mb_module *)
+            paddr_to_vaddr(mb_info->mods_addr);
+        memblock_reserve(mb_info->mods_addr,
+            mb_info->mods_count * sizeof(struct mb_module));
+        for (u32 i = 0; i < mb_info->mods_count; i++) {
+            memblock_reserve(mods[i].mod_start,
+                mods[i].mod_end - mods[i].mod_start);
+        }
+    }
+}
+
+/**
+ * @brief Add a range of usable memory. The range is clamped to the physical
+ * address space supported by the kernel.
+ * 
+ * @param base The first physical address of the range.
+ * @param size The size of the range, in bytes.
+ */
+_init
+void memblock_add(u64 base, u64 size)
+{
+    memblock_insert(&memblock_memory, min(base, PADDR_END),
+        min(base + size, PADDR_END));
+}
+
+/**
+ * @brief Reserve a range of memory, so that it is not used by the early
+ * allocations and is marked as used by the kernel in the page array. The
+ * range is extended to whole pages.
+ * 
+ * @param base The first physical address of the range.
+ * @param size The size of the range, in bytes.
+ */
+_init
+void memblock_reserve(u64 base, u64 size)
+{
+    const u64 end = (base + size + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1);
+    memblock_insert(&memblock_reserved, base & ~((u64) PAGE_SIZE - 1),
+        min(end, PADDR_END));
+}
+
+/**
+ * @brief Release a range of reserved memory. The range becomes available for
+ * the early allocations, and will be free memory in the page array.
+ * 
+ * @param base The first physical address of the range.
+ * @param size The size of the range, in bytes.
+ */
+_init
+void memblock_free(u64 base, u64 size)
+{
+    assert(!memblock_finished);
+    memblock_remove(&memblock_reserved, base, base + size);
+}
+
+/**
+ * @brief Mark the early allocator as finished. This is called once the page
+ * array has been built from the memblock regions: the memory that is not
+ * reserved becomes free memory of the page allocators, and the early
+ * allocator must not be used anymore.
+ */
+_init
+void memblock_finish(void)
+{
+    memblock_finished = true;
+}
+
+/**
+ * @brief Get the end of the usable memory.
+ * 
+ * @return u64 The end physical address of the last usable memory region, or
+ * 0 if there is no usable memory.
+ */
+_init
+u64 memblock_end(void)
+{
+    if (memblock_memory.count == 0) {
+        return 0;
+    }
+    return memblock_memory.regions[memblock_memory.count - 1].end;
+}
+
+/**
+ * @brief Allocate physical memory during the early boot, before the page
+ * allocators are available. The memory is allocated from the top of the low
+ * memory, so that it is always directly accessible by the kernel.
+ * 
+ * @param size The size of the allocation, in bytes.
+ * @param align The alignment of the allocation. It must be a power of two. If
+ * zero, MEMBLOCK_ALIGN is used.
+ * @return paddr The physical address of the allocated memory, or 0 if the
+ * allocation failed.
+ */
+_init
+paddr memblock_phys_alloc(u32 size, u32 align)
+{
+    assert(!memblock_finished);
+    if (align == 0) {
+        align = MEMBLOCK_ALIGN;
+    }
+    assert(is_power_of_2(align));
+
+    const u64 base = memblock_find(size, align, LOWMEM_END);
+    if (base != 0) {
+        memblock_reserve(base, size);
+    }
+    return (paddr) base;
+}
+
+/**
+ * @brief Allocate memory during the early boot, before the page allocators
+ * are available. This is the same as `memblock_phys_alloc()`, but returns a
+ * pointer to the memory in the kernel address space.
+ * 
+ * @param size The size of the allocation, in bytes.
+ * @param align The alignment of the allocation. It must be a power of two. If
+ * zero, MEMBLOCK_ALIGN is used.
+ * @return void* The allocated memory, or NULL if the allocation failed.
+ */
+_init
+void *memblock_alloc(u32 size, u32 align)
+{
+    const paddr base = memblock_phys_alloc(size, align);
+    if (base == 0) {
+        return NULL;
+    }
+    return (void *) paddr_to_vaddr(base);
+}
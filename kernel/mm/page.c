@@ -19,21 +19,67 @@
 #include <lib/log.h>
 #include <lib/math.h>
 #include <lib/panic.h>
+#include <lib/assert.h>
+#include <mm/cma.h>
 #include <mm/page.h>
+#include <mm/memblock.h>
 #include <mm/buddy.h>
+#include <mm/highmem.h>
 #include <arch/x86.h>
+#include <arch/cpu.h>
 #include <arch/paging.h>
 #include <arch/serial.h>
 
-/// The page array. This array contains information about each physical page
-/// in the system, such as the page type (free, reserved, kernel, poisoned),
-/// the number of references to the page, and other information.
-static struct page *pages = NULL;
+/// The section table. Each present section points to an array containing
+/// information about each physical page of the section, such as the page type
+/// (free, reserved, kernel, poisoned), the number of references to the page,
+/// and other information. Sections without usable memory are NULL and do not
+/// use any memory for their pages.
+static struct page *page_sections[PAGE_SECTION_COUNT] = { };
 
-/// The number of pages in the system. This is also the number of entries
-/// in the `pages` array.
+/// The number of page frames covered by the section table, up to the last
+/// usable page of the system.
 static unsigned int pg_count = 0;
 
+/// The end page frame number of the initialized part of the section table.
+/// Pages above are not initialized yet and are invisible to the rest of the
+/// kernel until `page_deferred_init()` reaches them.
+static unsigned int pg_init_end = 0;
+
+/// The number of pages in present sections that are not initialized yet.
+static unsigned int pg_deferred = 0;
+
+/// The number of present sections.
+static unsigned int pg_sections = 0;
+
+/// The number of CPU cycles spent initializing the page array during the
+/// boot, and later by `page_deferred_init()`.
+static u32 pg_boot_cycles = 0;
+static u32 pg_deferred_cycles = 0;
+
+/**
+ * @brief A range of physical pages of the same type, used to initialize the
+ * page array. Ranges are built from the memory map at boot, and kept sorted
+ * and disjoint so that each page information structure is written once.
+ */
+struct page_range {
+    /// The first page frame number of the range.
+    u32 start;
+
+    /// The end page frame number of the range (exclusive).
+    u32 end;
+
+    /// The type of the pages (PG_FREE, PG_KERNEL or PG_RESERVED).
+    uint type;
+};
+
+/// The physical memory ranges, sorted by address. Memory not covered by any
+/// range is poisoned.
+static struct page_range page_ranges[PAGE_MAX_RANGES] = { };
+
+/// The number of entries in the `page_ranges` array.
+static uint page_range_count = 0;
+
 /// The number of reserved pages in the system. Reserved pages are pages
 /// reserved by devices and does not contain RAM data. An example of reserved
 /// pages are VGA memory, used by the VGA controller to store the screen
@@ -53,155 +99,186 @@ unsigned int pg_kernel = 0;
 unsigned int pg_free = 0;
 
 /**
- * @brief Sanitize the memory map provided by the bootloader. Essentially, this
- * function will exclude the kernel memory from the free memory regions, because
- * the multiboot specification does not mark the kernel memory as used in the
- * memory map (and it is fucking stupid to be honest).
+ * @brief Add a range of pages of the given type. The new range overrides the
+ * parts of the existing ranges that it overlaps, so that the ranges stay
+ * disjoint: when the memory map describes overlapping regions, the last
+ * region wins.
  * 
- * Since the kernel is loaded at the first megabyte of memory, we can safely
- * assume that the kernel base address should be the base address of a free
- * memory region since some memory below the kernel is reserved for the BIOS.
- * This greatly simplifies the process of finding the kernel memory in the
- * memory map, but if this is not the case, this function will panic.
- * 
- * @param mb_info The multiboot information structure.
+ * @param start The first page frame number of the range.
+ * @param end The end page frame number of the range (exclusive).
+ * @param type The type of the pages in the range.
  */
-static void sanitize_mmap(struct mb_info *mb_info) 
+_init
+static void page_add_range(u32 start, u32 end, uint type)
 {
-    struct mb_mmap *mmap = (struct mb_mmap *) mb_info->mmap_addr;
-    bool kernel_found = false;
+    end = min(end, pg_count);
+    if (start >= end) {
+        return;
+    }
 
-    while (mmap < mb_mmap_end(mb_info)) {
-        if (mmap->type == MB_MEMORY_AVAILABLE) {
-            const vaddr kernel_start = KERNEL_VBASE + 0x100000;
-            const vaddr kernel_end = page_align_up((vaddr) &__end);
-            const u32 kernel_size = kernel_end - kernel_start;
-
-            if (mmap->addr == KERNEL_PBASE) {
-                mmap->addr += kernel_size;
-                mmap->len -= kernel_size;
-                kernel_found = true;
+    const uint count = page_range_count;
+    for (uint i = 0; i < count; i++) {
+        struct page_range *range = &page_ranges[i];
+        if (range->end <= start || range->start >= end) {
+            continue;
+        }
+
+        // If the existing range covers both sides of the new range, keep its
+        // upper part as a separate range.
+        if (range->start < start && range->end > end) {
+            if (page_range_count >= PAGE_MAX_RANGES) {
+                panic("page_add_range(): too many memory ranges");
             }
+            page_ranges[page_range_count++] = (struct page_range) {
+                .start = end,
+                .end = range->end,
+                .type = range->type,
+            };
+            range->end = start;
+        } else if (range->start < start) {
+            range->end = start;
+        } else if (range->end > end) {
+            range->start = end;
+        } else {
+            range->end = range->start;
         }
-        mmap = mb_next_mmap(mmap);
     }
 
-    if (!kernel_found) {
-        panic("Kernel memory not found in memory map");
+    if (page_range_count >= PAGE_MAX_RANGES) {
+        panic("page_add_range(): too many memory ranges");
     }
+    page_ranges[page_range_count++] = (struct page_range) {
+        .start = start,
+        .end = end,
+        .type = type,
+    };
 }
 
-
 /**
- * @brief Find the last regular address in the memory map and return it. This
- * is useful to calculate the size of the page array to avoid wasting memory
- * by allocating a overly large page array.
- * 
- * @param mb_info The loaded multiboot information structure.
- * @return paddr The last regular address in the memory map, or 0 if no
- * regular addresses were found.
+ * @brief Sort the ranges by address and remove the empty ones.
  */
-static paddr find_last_regular_address(struct mb_info *mb_info)
+_init
+static void page_sort_ranges(void)
 {
-    struct mb_mmap *mmap = (struct mb_mmap *) mb_info->mmap_addr;
-    paddr last = 0;
+    uint count = 0;
+    for (uint i = 0; i < page_range_count; i++) {
+        if (page_ranges[i].start == page_ranges[i].end) {
+            continue;
+        }
 
-    while (mmap < mb_mmap_end(mb_info)) {
-        if (mmap->type == MB_MEMORY_AVAILABLE) {
-            last = (u32) (mmap->addr + mmap->len - 1);
+        // Insertion sort: the number of ranges is small and the memory map
+        // is usually already sorted.
+        const struct page_range range = page_ranges[i];
+        uint j = count++;
+        while (j > 0 && page_ranges[j - 1].start > range.start) {
+            page_ranges[j] = page_ranges[j - 1];
+            j--;
         }
-        mmap = mb_next_mmap(mmap);
+        page_ranges[j] = range;
     }
-
-    return last;
+    page_range_count = count;
 }
 
 /**
- * @brief Allocate memory during the boot process by modifying the memory map
- * provided by the bootloader. The allocated memory will be deducted from the
- * memory map.
+ * @brief Initialize a run of page information structures with the given type
+ * and update the page counters in bulk.
  * 
- * @param mb_info The loaded multiboot information structure.
- * @return void* The pointer to the allocated memory, or NULL if the memory
- * could not be allocated.
+ * @param start The first page frame number.
+ * @param end The end page frame number (exclusive).
+ * @param type The type of the pages: PG_FREE, PG_RESERVED, PG_POISONED or
+ * PG_KERNEL.
  */
-static void *allocate_boot_memory(struct mb_info *mb_info, size_t size)
+static void page_fill(u32 start, u32 end, uint type)
 {
-    struct mb_mmap *mmap = (struct mb_mmap *) mb_info->mmap_addr;
-    struct mb_mmap *free_mmap = NULL;
-    const u32 align = 16;
-
-    while (mmap < mb_mmap_end(mb_info)) {
-        if (mmap->type == MB_MEMORY_AVAILABLE && mmap->len >= size + align) {
-            free_mmap = mmap;
-        }
-        mmap = mb_next_mmap(mmap);
+    const u16 count = (type == PG_KERNEL) ? 1 : 0;
+    for (u32 i = start; i < end; i++) {
+        const u32 section = i >> PAGE_SECTION_SHIFT;
+        struct page *pg = &page_sections[section][i & (PAGE_SECTION_PAGES - 1)];
+        pg->flags = type | (section << PG_SECTION_SHIFT);
+        pg->order = 0;
+        pg->count = count;
+        list_init(&pg->list);
+        pg->mapping = NULL;
+        pg->index = 0;
     }
 
-    // If we did not find a suitable free memory region, return NULL
-    if (free_mmap == NULL) {
-        return NULL;
+    if (type == PG_FREE) {
+        pg_free += end - start;
+    } else if (type == PG_KERNEL) {
+        pg_kernel += end - start;
+    } else if (type == PG_RESERVED) {
+        pg_reserved += end - start;
+    } else if (type == PG_POISONED) {
+        pg_poisoned += end - start;
+    } else {
+        panic("page_fill(): Invalid page type");
     }
-
-    // Calculate the number of bytes needed to align the memory
-    const u32 aligned_area_base = align_up(free_mmap->addr, align);
-    const u32 misalign = aligned_area_base - free_mmap->addr;
-
-    // Update the memory map
-    free_mmap->addr = aligned_area_base + size;
-    free_mmap->len -= size + misalign;
-
-    return (void *) KERNEL_VBASE + aligned_area_base;
 }
 
 /**
- * @brief Change the type of a page and update page counters accordingly.
+ * @brief Initialize the page information structures of the pages in the given
+ * range using the memory ranges. The pages not covered by any range are
+ * poisoned, since they are not usable. The range must be inside a present
+ * section.
  * 
- * @param pg The page to change the type of.
- * @param type The new type of the page. This should be one of the following
- * values: PG_FREE, PG_RESERVED, PG_POISONED, PG_KERNEL.
+ * @param start The first page frame number.
+ * @param end The end page frame number (exclusive).
  */
-static void page_change_type(struct page *pg, int type)
+static void page_init_range(u32 start, u32 end)
 {
-    if (pg->flags & PG_FREE) {
-        pg_free--;
-    } else if (pg->flags & PG_KERNEL) {
-        pg_kernel--;
-    } else if (pg->flags & PG_RESERVED) {
-        pg_reserved--;
-    } else if (pg->flags & PG_POISONED) {
-        pg_poisoned--;
-    } 
+    u32 next = start;
+    for (uint i = 0; i < page_range_count && next < end; i++) {
+        const struct page_range *range = &page_ranges[i];
+        if (range->end <= next) {
+            continue;
+        }
 
-    if (type == PG_FREE) {
-        pg_free++;
-    } else if (type == PG_KERNEL) {
-        pg_kernel++;
-    } else if (type == PG_RESERVED) {
-        pg_reserved++;
-    } else if (type == PG_POISONED) {
-        pg_poisoned++;
-    } else {
-        panic("page_change_type(): Invalid page type");
+        const u32 first = max(range->start, next);
+        const u32 range_start = min(first, end);
+        const u32 range_end = min(range->end, end);
+        page_fill(next, range_start, PG_POISONED);
+        page_fill(range_start, range_end, range->type);
+        next = range_end;
     }
-
-    pg->flags = type;
+    page_fill(next, end, PG_POISONED);
+    pg_deferred -= end - start;
+    pg_init_end = end;
 }
 
 /**
- * @brief Get the page information structure for a given physical address. If
- * the address is out of range, this function will panic.
- * 
- * @param addr The physical address.
- * @return struct page* The page information structure.
+ * @brief Allocate the page information structures of each section containing
+ * usable memory, using the early memory allocator.
  */
-static struct page *get_page_info(paddr addr)
+_init
+static void page_allocate_sections(void)
 {
-    const u32 idx = page_pfn(addr);
-    if (idx >= pg_count) {
-        panic("get_page_info(): Invalid page address (out of range)");
+    bool present[PAGE_SECTION_COUNT] = { };
+    memblock_foreach(&memblock_memory, region) {
+        const u64 start = region->base >> PAGE_SHIFT;
+        const u64 end = min(region->end >> PAGE_SHIFT, (u64) pg_count);
+        for (u64 i = start; i < end; i += PAGE_SECTION_PAGES) {
+            present[i >> PAGE_SECTION_SHIFT] = true;
+        }
+        if (start < end) {
+            present[(end - 1) >> PAGE_SECTION_SHIFT] = true;
+        }
+    }
+
+    for (u32 i = 0; i < PAGE_SECTION_COUNT; i++) {
+        const u32 base = i << PAGE_SECTION_SHIFT;
+        if (!present[i] || base >= pg_count) {
+            continue;
+        }
+
+        const u32 count = min(pg_count - base, (u32) PAGE_SECTION_PAGES);
+        page_sections[i] = memblock_alloc(count * sizeof(struct page),
+                                          PAGE_SIZE);
+        if (page_sections[i] == NULL) {
+            panic("Unable to allocate memory for page section %u", i);
+        }
+        pg_deferred += count;
+        pg_sections++;
     }
-    return &pages[idx];
 }
 
 /**
@@ -213,88 +290,158 @@ static struct page *get_page_info(paddr addr)
 _init
 void page_setup(struct mb_info *mb_info)
 {
-    if (!(mb_info->flags & MB_INFO_MEMMAP)) {
-        // TODO: Implement a sort of memory probing
-        // The problem is that it is slow and not very reliable and
-        // can potentially permanently damage the system if we write
-        // to device-mapped memory. Therefore, we should only do this
-        // if we have no other choice, and do it very conservatively.
-        panic("No memory map provided by the bootloader");
-    }
-
-    sanitize_mmap(mb_info);
-
-    paddr pg_last = find_last_regular_address(mb_info);
-    if (!pg_last) {
-        panic("Unable to find last regular address in memory map");
+    const u64 pg_last = memblock_end();
+    if (pg_last == 0) {
+        panic("No usable memory in the memory map");
     }
 
-    pg_count = page_pfn(page_align_up(pg_last));
-    pages = allocate_boot_memory(mb_info, pg_count * sizeof(struct page));
-    if (pages == NULL) {
-        panic("Unable to allocate memory for page array");
+    pg_count = (pg_last + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    page_allocate_sections();
+    debug("Page array: %u sections (%u KiB)", pg_sections,
+        (pg_deferred * sizeof(struct page)) / 1024);
+
+    // Build the list of memory ranges. The usable memory is free, except the
+    // memory reserved by the hardware according to the memory map. The
+    // memory map entries use 64 bits addresses and may describe memory above
+    // the end of the page array, so the frame numbers are computed on 64
+    // bits before being clamped to the page array.
+    memblock_foreach(&memblock_memory, region) {
+        page_add_range(region->base >> PAGE_SHIFT,
+                       min(region->end >> PAGE_SHIFT, (u64) pg_count),
+                       PG_FREE);
     }
 
-    debug("Page array at %08x (%u pages)", pages, pg_count);
-
-    // Initialize the page array and poison all pages by default. During the
-    // page setup process, we will mark pages as free, reserved, or kernel
-    // memory, and any pages that are not marked will be considered poisoned
-    // and unusable to avoid any potential issues.
-    pg_poisoned = pg_count;
-    for (u32 i = 0; i < pg_count; i++) {
-        pages[i].flags = PG_POISONED;
-        pages[i].order = 0;
-        pages[i].count = 0;
-    }
-
-    // Use the memory map to mark pages as free or reserved
     struct mb_mmap *mmap = (struct mb_mmap *) mb_info->mmap_addr;
     while (mmap < mb_mmap_end(mb_info)) {
-        if (mmap->type == MB_MEMORY_AVAILABLE) {
-            const u32 start = page_pfn(mmap->addr);
-            const u32 end = page_pfn(mmap->addr + mmap->len);
-            for (u32 i = start; i < end; i++) {
-                page_change_type(&pages[i], PG_FREE);
-            }
-        } else if (mmap->type == MB_MEMORY_RESERVED) {
-            const u32 start = page_pfn(mmap->addr);
-            const u32 end = page_pfn(mmap->addr + mmap->len);
-            for (u32 i = start; i < end; i++) {
-                page_change_type(&pages[i], PG_RESERVED);
-            }
+        const u32 start = min(mmap->addr >> PAGE_SHIFT, (u64) pg_count);
+        const u32 end = min((mmap->addr + mmap->len) >> PAGE_SHIFT,
+                            (u64) pg_count);
+        if (mmap->type == MB_MEMORY_RESERVED) {
+            page_add_range(start, end, PG_RESERVED);
         }
         mmap = mb_next_mmap(mmap);
     }
 
+    // The memory reserved with the early memory allocator (the kernel image,
+    // the data given by the bootloader, the page arrays and all the early
+    // allocations) is used by the kernel. The rest of the usable memory is
+    // handed to the buddy allocator.
+    memblock_foreach(&memblock_reserved, region) {
+        page_add_range(region->base >> PAGE_SHIFT,
+                       min(region->end >> PAGE_SHIFT, (u64) pg_count),
+                       PG_KERNEL);
+    }
+    memblock_finish();
+
     // The first page of memory is reserved by the BIOS. Furthermore, since 
     // the first page is never valid, we can safely return it to indicate an
     // error (el famoso 1 billion dollar mistake).
-    page_change_type(&pages[0], PG_RESERVED);
+    page_add_range(0, 1, PG_RESERVED);
 
     // Reserve the area used by the BIOS and some other devices
-    const u32 bios_start_idx = page_pfn(0xA0000);
-    const u32 bios_end_idx = page_pfn(0x100000);
-    for (u32 i = bios_start_idx; i < bios_end_idx; i++) {
-        page_change_type(&pages[i], PG_RESERVED);
-    }
-    
-    // Mark the kernel pages as used by the kernel
-    const u32 kernel_end_paddr = (vaddr) &__end - KERNEL_VBASE;
-    const u32 kernel_start_idx = page_pfn(KERNEL_PBASE);
-    const u32 kernel_end_idx = page_pfn(kernel_end_paddr);
-    for (u32 i = kernel_start_idx; i < kernel_end_idx; i++) {
-        page_change_type(&pages[i], PG_KERNEL);
-        pages[i].count = 1;
+    page_add_range(page_pfn(0xA0000), page_pfn(0x100000), PG_RESERVED);
+
+    page_sort_ranges();
+
+    // Only initialize the first section now, which is enough memory to finish
+    // booting. The other sections are initialized in the background by
+    // `page_deferred_init()`, or on demand when the memory is exhausted.
+    const u64 start = cpu_rdtsc();
+    page_init_range(0, min(pg_count, (u32) PAGE_SECTION_PAGES));
+    pg_boot_cycles = cpu_rdtsc() - start;
+
+    // Set aside the contiguous memory area now that the free pages are known,
+    // before any other allocation can fragment the memory.
+    cma_reserve();
+}
+
+/**
+ * @brief Initialize the next present section of the page array, and give its
+ * free pages to the buddy allocator or to the highmem zone. Sections are
+ * aligned on the largest buddy block, so that the free memory of a section
+ * can be added with the largest blocks possible and never needs to be merged
+ * with the memory of the next section.
+ * 
+ * This must be called after the buddy allocator and the highmem zone have
+ * been set up.
+ * 
+ * @return true if some pages are still not initialized.
+ * @return false if the whole page array is initialized.
+ */
+bool page_deferred_init(void)
+{
+    while (pg_init_end < pg_count) {
+        const u32 start = pg_init_end;
+        const u32 end = min(start + PAGE_SECTION_PAGES, pg_count);
+        if (page_sections[start >> PAGE_SECTION_SHIFT] == NULL) {
+            pg_init_end = end;
+            continue;
+        }
+
+        const u64 tsc = cpu_rdtsc();
+        page_init_range(start, end);
+        pg_deferred_cycles += cpu_rdtsc() - tsc;
+        if (start < page_pfn(LOWMEM_END)) {
+            buddy_add_memory(start, end);
+        } else {
+            highmem_add_memory(start, end);
+        }
+        break;
     }
+    return pg_init_end < pg_count;
+}
 
-    // Mark the page array as used by the kernel
-    const u32 page_array_start_idx = page_pfn((paddr) ((vaddr) pages - KERNEL_VBASE));
-    const u32 page_array_end_idx = page_pfn((paddr) &pages[pg_count] - KERNEL_VBASE);
-    for (u32 i = page_array_start_idx; i < page_array_end_idx; i++) {
-        page_change_type(&pages[i], PG_KERNEL);
-        pages[i].count = 1;
+/**
+ * @brief Get the end of the initialized part of the page array.
+ * 
+ * @return u32 The page frame number following the last initialized page.
+ */
+u32 page_pfn_end(void)
+{
+    return pg_init_end;
+}
+
+/**
+ * @brief Free the init section, which contains the code and data only used
+ * during the boot, and give its pages to the buddy allocator. This must be
+ * called once the kernel is fully initialized, from a function that is not
+ * in the init section itself.
+ */
+void page_free_init_memory(void)
+{
+    const vaddr start = (vaddr) __init_start;
+    const vaddr end = (vaddr) __init_end;
+    assert(page_is_aligned(start) && page_is_aligned(end));
+
+    buddy_free_range((void *) start, page_pfn(end - start));
+    info("Freed %u KiB of init memory", (end - start) / 1024);
+}
+
+/**
+ * @brief Verify if all pages in the given physical range are free memory
+ * according to the memory map. Unlike the page information structures, this
+ * works even if the page array is not fully initialized, but does not take
+ * the allocations into account.
+ * 
+ * @param start The first physical address of the range.
+ * @param end The end physical address of the range (exclusive).
+ * @return true If the whole range is usable memory.
+ * @return false Otherwise.
+ */
+bool page_range_free(paddr start, paddr end)
+{
+    u32 next = page_pfn(start);
+    const u32 last = page_pfn(page_align_up(end));
+    for (uint i = 0; i < page_range_count && next < last; i++) {
+        const struct page_range *range = &page_ranges[i];
+        if (range->end <= next) {
+            continue;
+        } else if (range->start > next || range->type != PG_FREE) {
+            return false;
+        }
+        next = range->end;
     }
+    return next >= last;
 }
 
 void page_debug_info(void)
@@ -308,13 +455,18 @@ void page_debug_info(void)
     debug("Reserved pages: %u (%u KiB)", pg_reserved, pg_reserved_kib);
     debug("Poisoned pages: %u (%u KiB)", pg_poisoned, pg_poisoned_kib);
     debug("Kernel pages: %u (%u KiB)", pg_kernel, pg_kernel_kib);
+    debug("Uninitialized pages: %u", pg_deferred);
+    debug("Page array initialized in %u cycles at boot, %u cycles deferred",
+        pg_boot_cycles, pg_deferred_cycles);
 }
 
 /**
  * @brief Get the page information structure for a given physical address. If
  * there is no page information structure for the address, this function will
  * return NULL. This can happen if the address is outside the range of the
- * regular memory pages.
+ * regular memory pages, inside a section without usable memory, or if its
+ * page information structure has not been initialized yet by
+ * `page_deferred_init()`.
  * 
  * @param addr The physical address of the page.
  * @return struct page* The page information structure, or NULL if the address
@@ -322,9 +474,32 @@ void page_debug_info(void)
  */
 struct page *page_info(paddr addr)
 {
-    const uint pnf = page_pfn(addr);
-    if (pnf >= pg_count) {
+    const u32 pnf = page_pfn(addr);
+    if (pnf >= pg_init_end) {
         return NULL;
     }
-    return &pages[pnf];
+
+    struct page *section = page_sections[pnf >> PAGE_SECTION_SHIFT];
+    if (section == NULL) {
+        return NULL;
+    }
+    return &section[pnf & (PAGE_SECTION_PAGES - 1)];
+}
+
+/**
+ * @brief Get the physical address of the page described by the given page
+ * information structure. This is the inverse of `page_info()`.
+ * 
+ * @param pg The page information structure, must be an entry of the page
+ * array.
+ * @return paddr The physical address of the page.
+ */
+paddr page_paddr(struct page *pg)
+{
+    const u32 section = (pg->flags & PG_SECTION_MASK) >> PG_SECTION_SHIFT;
+    assert(page_sections[section] != NULL);
+
+    const u32 idx = pg - page_sections[section];
+    assert(idx < PAGE_SECTION_PAGES);
+    return page_pnf_to_offset((section << PAGE_SECTION_SHIFT) + idx);
 }
\ No newline at end of file
@@ -0,0 +1,405 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <arch/paging.h>
+#include <mm/lru.h>
+#include <mm/page.h>
+#include <mm/buddy.h>
+#include <mm/pagecache.h>
+
+/// The objects with dirty pages, in the order they were first dirtied.
+static DECLARE_LIST(pagecache_dirty);
+
+/// The number of lookups that found the page in the cache, and of lookups
+/// that had to read it.
+static uint pagecache_hits = 0;
+static uint pagecache_misses = 0;
+
+/// The number of pages read because they were requested, and read ahead.
+static uint pagecache_reads = 0;
+static uint pagecache_readahead_pages = 0;
+
+/// The number of pages written back, of write errors, and of pages evicted.
+static uint pagecache_writes = 0;
+static uint pagecache_write_errors = 0;
+static uint pagecache_evictions = 0;
+
+static bool pagecache_referenced(struct page *page);
+static bool pagecache_evict(struct page *page);
+
+/// The LRU operations of the cached pages.
+static const struct lru_ops pagecache_lru_ops = {
+    .referenced = pagecache_referenced,
+    .evict = pagecache_evict,
+};
+
+/**
+ * @brief Setup the page cache. This function must be called after the LRU
+ * lists and the radix trees have been initialized.
+ */
+_init
+void pagecache_setup(void)
+{
+    lru_register(LRU_FILE, &pagecache_lru_ops);
+}
+
+/**
+ * @brief Print some debug information about the page cache.
+ */
+void pagecache_debug_info(void)
+{
+    debug("Page cache: %u hits, %u misses, %u pages read, %u read ahead",
+        pagecache_hits, pagecache_misses, pagecache_reads,
+        pagecache_readahead_pages);
+    debug("  %u pages written back, %u write errors, %u pages evicted",
+        pagecache_writes, pagecache_write_errors, pagecache_evictions);
+}
+
+/**
+ * @brief Initialize an object without any cached page.
+ * 
+ * @param object The object.
+ * @param ops The operations of the backing store of the object.
+ * @param size The size of the object, in pages.
+ */
+void pagecache_object_init(struct pagecache_object *object,
+    const struct pagecache_ops *ops, u32 size)
+{
+    object->ops = ops;
+    object->size = size;
+    object->pages.root = NULL;
+    object->nrpages = 0;
+    object->nrdirty = 0;
+    object->ra.start = 0;
+    object->ra.size = 0;
+    object->ra.prev = (u32) -1;
+    list_init(&object->dirty_node);
+}
+
+/**
+ * @brief Remove a page from the cache and release it.
+ * 
+ * @param object The object of the page.
+ * @param index The position of the page in the object.
+ * @param page The page, removed from the LRU lists.
+ */
+static void pagecache_remove(struct pagecache_object *object, u32 index,
+    struct page *page)
+{
+    radix_delete(&object->pages, index);
+    object->nrpages--;
+
+    page->mapping = NULL;
+    page->flags &= ~PG_READAHEAD;
+    page->count = 0;
+    buddy_free((void *) paddr_to_vaddr(page_paddr(page)), 0);
+}
+
+/**
+ * @brief Write a dirty page back and clear its dirty tag. The tag is cleared
+ * even on an I/O error, since retrying would most likely fail again, and the
+ * error is counted instead.
+ * 
+ * @param object The object of the page.
+ * @param index The position of the page in the object.
+ * @param page The page.
+ */
+static void pagecache_write_page(struct pagecache_object *object, u32 index,
+    struct page *page)
+{
+    const void *data = (const void *) paddr_to_vaddr(page_paddr(page));
+    if (object->ops->write(object, index, data)) {
+        pagecache_writes++;
+    } else {
+        pagecache_write_errors++;
+    }
+
+    radix_tag_clear(&object->pages, index, PAGECACHE_TAG_DIRTY);
+    if (--object->nrdirty == 0) {
+        list_remove(&object->dirty_node);
+    }
+}
+
+/**
+ * @brief Release all the pages of an object, after writing back its dirty
+ * pages.
+ * 
+ * @param object The object.
+ */
+void pagecache_object_release(struct pagecache_object *object)
+{
+    u32 index = 0;
+    struct page *page;
+    while ((page = radix_next(&object->pages, &index)) != NULL) {
+        if (radix_tag_get(&object->pages, index, PAGECACHE_TAG_DIRTY)) {
+            pagecache_write_page(object, index, page);
+        }
+        lru_remove(page);
+        pagecache_remove(object, index, page);
+    }
+    assert(object->nrpages == 0 && object->nrdirty == 0);
+}
+
+/**
+ * @brief The cached pages are not mapped, so their accesses are only recorded
+ * by `lru_mark_accessed()`.
+ * 
+ * @param page The page.
+ * @return false Always.
+ */
+static bool pagecache_referenced([[maybe_unused]] struct page *page)
+{
+    return false;
+}
+
+/**
+ * @brief Evict a clean page from the cache. The dirty pages are left to the
+ * writeback, so that the reclaimer does not wait for the backing store, and
+ * the pages pinned by a reader are skipped.
+ * 
+ * @param page The page, removed from the LRU lists.
+ * @return true If the page was evicted.
+ * @return false If the page is dirty or pinned.
+ */
+static bool pagecache_evict(struct page *page)
+{
+    struct pagecache_object *object = page->mapping;
+    if (page->count > 1 ||
+        radix_tag_get(&object->pages, page->index, PAGECACHE_TAG_DIRTY)) {
+        return false;
+    }
+
+    pagecache_remove(object, page->index, page);
+    pagecache_evictions++;
+    return true;
+}
+
+/**
+ * @brief Read a page of an object from its backing store into the cache. The
+ * count of a cached page is 1, for the reference of the cache, and is raised
+ * while a reader uses the page, so that the reclaimer does not evict it.
+ * 
+ * @param object The object.
+ * @param index The position of the page in the object.
+ * @return struct page* The page, or NULL if there is no memory left or on an
+ * I/O error.
+ */
+static struct page *pagecache_add(struct pagecache_object *object, u32 index)
+{
+    void *data = buddy_alloc(0, BUDDY_RECLAIMABLE);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    struct page *page = page_info((vaddr) data - KERNEL_VBASE);
+    if (!object->ops->read(object, index, data) ||
+        !radix_insert(&object->pages, index, page)) {
+        buddy_free(data, 0);
+        return NULL;
+    }
+
+    page->count = 1;
+    page->mapping = object;
+    page->index = index;
+    lru_add(page, LRU_FILE);
+    object->nrpages++;
+    return page;
+}
+
+/**
+ * @brief Read a window of pages into the cache, skipping the pages already
+ * cached, and record it as the last window of the object.
+ * 
+ * @param object The object.
+ * @param start The first page of the window.
+ * @param size The size of the window, in pages.
+ * @param marker The page starting the next window when it is accessed.
+ */
+static void pagecache_read_window(struct pagecache_object *object,
+    u32 start, u32 size, u32 marker)
+{
+    object->ra.start = start;
+    object->ra.size = size;
+
+    const u32 count = min(size, object->size - start);
+    for (u32 index = start; index < start + count; index++) {
+        if (radix_lookup(&object->pages, index) != NULL) {
+            continue;
+        }
+
+        struct page *page = pagecache_add(object, index);
+        if (page == NULL) {
+            break;
+        } else if (index == marker) {
+            page->flags |= PG_READAHEAD;
+        }
+        pagecache_readahead_pages++;
+    }
+}
+
+/**
+ * @brief Get the size of the next readahead window: it grows faster while it
+ * is small, and is capped to PAGECACHE_RA_MAX pages.
+ * 
+ * @param size The size of the last window.
+ * @return u32 The size of the next window.
+ */
+static u32 pagecache_next_window(u32 size)
+{
+    const u32 next = (size < PAGECACHE_RA_MAX / 16) ? size * 4 : size * 2;
+    return min(next, (u32) PAGECACHE_RA_MAX);
+}
+
+/**
+ * @brief Read a missing page. If the read is sequential, the pages following
+ * it are read ahead, the window growing with each sequential miss. Otherwise,
+ * only the page is read and the window is reset.
+ * 
+ * @param object The object.
+ * @param index The position of the missing page.
+ * @return struct page* The page, or NULL if there is no memory left or on an
+ * I/O error.
+ */
+static struct page *pagecache_miss(struct pagecache_object *object,
+    u32 index)
+{
+    struct page *page = pagecache_add(object, index);
+    if (page == NULL) {
+        return NULL;
+    }
+    pagecache_reads++;
+
+    struct pagecache_readahead *ra = &object->ra;
+    if (index != ra->prev + 1) {
+        ra->start = index;
+        ra->size = 0;
+        return page;
+    }
+
+    // The first pages of the window are read now, and the rest when the
+    // reader reaches the marker. The page is pinned meanwhile, since reading
+    // the window may reclaim memory.
+    const u32 size = ra->size ? pagecache_next_window(ra->size) :
+        PAGECACHE_RA_INIT;
+    if (index + 1 < object->size) {
+        page->count++;
+        pagecache_read_window(object, index + 1, size - 1, index + 1);
+        page->count--;
+        ra->start = index;
+        ra->size = size;
+    }
+    return page;
+}
+
+/**
+ * @brief Get a page of an object, reading it from the backing store if it is
+ * not cached. The access is recorded for the LRU lists, and reaching the
+ * marked page of the readahead window reads the next window. The page is
+ * pinned while the window is read, but not after this function returns: a
+ * later allocation may evict it if it is clean.
+ * 
+ * @param object The object.
+ * @param index The position of the page in the object.
+ * @return void* The content of the page, or NULL if the page is outside of
+ * the object, if there is no memory left or on an I/O error.
+ */
+void *pagecache_read(struct pagecache_object *object, u32 index)
+{
+    if (index >= object->size) {
+        return NULL;
+    }
+
+    struct page *page = radix_lookup(&object->pages, index);
+    if (page == NULL) {
+        pagecache_misses++;
+        page = pagecache_miss(object, index);
+        if (page == NULL) {
+            return NULL;
+        }
+    } else {
+        pagecache_hits++;
+        struct pagecache_readahead *ra = &object->ra;
+        const u32 next = ra->start + ra->size;
+        if ((page->flags & PG_READAHEAD) && next < object->size) {
+            page->flags &= ~PG_READAHEAD;
+            page->count++;
+            pagecache_read_window(object, next,
+                pagecache_next_window(ra->size), next);
+            page->count--;
+        }
+    }
+
+    object->ra.prev = index;
+    lru_mark_accessed(page);
+    return (void *) paddr_to_vaddr(page_paddr(page));
+}
+
+/**
+ * @brief Mark a cached page as modified, so that it is written back later.
+ * 
+ * @param object The object.
+ * @param index The position of the page in the object.
+ * @return true If the page is cached and is now dirty.
+ * @return false If the page is not cached.
+ */
+bool pagecache_mark_dirty(struct pagecache_object *object, u32 index)
+{
+    struct page *page = radix_lookup(&object->pages, index);
+    if (page == NULL) {
+        return false;
+    } else if (radix_tag_get(&object->pages, index, PAGECACHE_TAG_DIRTY)) {
+        return true;
+    }
+
+    radix_tag_set(&object->pages, index, PAGECACHE_TAG_DIRTY);
+    if (object->nrdirty++ == 0) {
+        list_add_tail(&pagecache_dirty, &object->dirty_node);
+    }
+    lru_mark_accessed(page);
+    return true;
+}
+
+/**
+ * @brief Write back the dirty pages of the objects, in the order the objects
+ * were first dirtied. The dirty pages of an object are found with the dirty
+ * tag of its radix tree, without visiting its clean pages. This function
+ * should be called when the CPU has nothing better to do.
+ * 
+ * @param budget The maximum number of pages to write back.
+ * @return true if there are still dirty pages.
+ * @return false if all the pages are clean.
+ */
+bool pagecache_writeback(uint budget)
+{
+    while (budget > 0 && !list_empty(&pagecache_dirty)) {
+        struct pagecache_object *object = list_first_entry(&pagecache_dirty,
+            struct pagecache_object, dirty_node);
+
+        u32 index = 0;
+        struct page *page;
+        while (budget > 0 && (page = radix_next_tagged(&object->pages,
+            &index, PAGECACHE_TAG_DIRTY)) != NULL) {
+            pagecache_write_page(object, index, page);
+            budget--;
+        }
+    }
+    return !list_empty(&pagecache_dirty);
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/math.h>
+#include <mm/page.h>
+#include <mm/buddy.h>
+#include <mm/reclaim.h>
+
+/// The list of registered shrinkers. They are called in registration order.
+static DECLARE_LIST(shrinker_list);
+
+/// Set when the number of free pages dropped below the low watermark, and
+/// cleared when the background reclaimer has reached the high watermark or
+/// cannot free more memory.
+static bool reclaim_pending = false;
+
+/// The number of times the background reclaimer was woken up.
+static unsigned int reclaim_wakeups = 0;
+
+/// The number of direct reclaims done by failing allocations.
+static unsigned int reclaim_direct_count = 0;
+
+/**
+ * @brief Call the shrinkers until the given number of pages has been freed or
+ * until no shrinker can free more memory.
+ * 
+ * @param target The number of pages to free.
+ * @return u32 The number of pages actually freed.
+ */
+static u32 reclaim_shrink(u32 target) {
+    u32 freed = 0;
+    list_foreach(&shrinker_list, entry) {
+        if (freed >= target) {
+            break;
+        }
+
+        struct shrinker *shrinker = list_entry(entry, struct shrinker, node);
+        const u32 count = shrinker->shrink(target - freed);
+        shrinker->reclaimed += count;
+        freed += count;
+    }
+    return freed;
+}
+
+/**
+ * @brief Register a shrinker. The shrinker structure must stay valid until it
+ * is unregistered.
+ * 
+ * @param shrinker The shrinker to register.
+ */
+void shrinker_register(struct shrinker *shrinker)
+{
+    shrinker->reclaimed = 0;
+    list_init(&shrinker->node);
+    list_add_tail(&shrinker_list, &shrinker->node);
+}
+
+/**
+ * @brief Unregister a shrinker previously registered with
+ * `shrinker_register()`.
+ * 
+ * @param shrinker The shrinker to unregister.
+ */
+void shrinker_unregister(struct shrinker *shrinker)
+{
+    list_remove(&shrinker->node);
+}
+
+/**
+ * @brief Wake up the background reclaimer. This is called by the buddy
+ * allocator when the number of free pages drops below the low watermark.
+ * The reclaim itself is deferred to `reclaim_run()`, so that the allocation
+ * that crossed the watermark is not slowed down.
+ */
+void reclaim_wakeup(void)
+{
+    if (!reclaim_pending) {
+        reclaim_pending = true;
+        reclaim_wakeups++;
+    }
+}
+
+/**
+ * @brief Print some debug information about the reclaimer.
+ */
+void reclaim_debug_info(void)
+{
+    debug("Reclaim: %u wakeups, %u direct reclaims", reclaim_wakeups,
+        reclaim_direct_count);
+    list_foreach(&shrinker_list, entry) {
+        struct shrinker *shrinker = list_entry(entry, struct shrinker, node);
+        debug("  - %s: %u pages reclaimed", shrinker->name,
+            shrinker->reclaimed);
+    }
+}
+
+/**
+ * @brief Run the background reclaimer. This function should be called when
+ * the CPU has nothing better to do. If the reclaimer was woken up, memory is
+ * reclaimed until the number of free pages reaches the high watermark, so
+ * that allocations do not have to reclaim memory themselves.
+ * 
+ * @param budget The maximum number of pages to reclaim.
+ * @return true if the reclaimer still has work to do.
+ * @return false if the reclaimer is idle.
+ */
+bool reclaim_run(u32 budget)
+{
+    if (!reclaim_pending) {
+        return false;
+    }
+
+    const u32 free = buddy_free_count();
+    const u32 high = buddy_watermark(BUDDY_WMARK_HIGH);
+    if (free >= high) {
+        reclaim_pending = false;
+        return false;
+    }
+
+    const u32 target = min(high - free, budget);
+    if (reclaim_shrink(target) < target) {
+        reclaim_pending = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Synchronously reclaim memory. This is used by an allocation that
+ * cannot be satisfied, as a last resort before failing.
+ * 
+ * @param target The number of pages to reclaim.
+ * @return u32 The number of pages actually reclaimed.
+ */
+u32 reclaim_direct(u32 target)
+{
+    reclaim_direct_count++;
+    return reclaim_shrink(target);
+}
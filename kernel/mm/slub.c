@@ -20,12 +20,26 @@
 #include <lib/math.h>
 #include <mm/slub.h>
 #include <mm/buddy.h>
+#include <mm/reclaim.h>
 
 static struct slub_cache slub_cache_cache = { };
 static struct slub_cache slub_cache = { };
 static struct slub slub_cache_slub = { };
 static struct slub slub_slub = { };
 
+/// The list of all caches created with `slub_create_cache()`. The internal
+/// caches used by the slub allocator itself are not in this list and are
+/// never shrunk.
+static DECLARE_LIST(slub_caches);
+
+static u32 slub_shrink(u32 target);
+
+/// The shrinker releasing the empty slubs of all caches.
+static struct shrinker slub_shrinker = {
+    .name = "slub",
+    .shrink = slub_shrink,
+};
+
 /**
  * @brief Check if the given pointer is contained within the slub region. 
  * However, this function does not check if the pointer is actually a valid
@@ -111,6 +125,7 @@ static void slub_new_cache(
     list_init(&cache->partial_slubs);
     list_init(&cache->free_slubs);
     list_init(&cache->full_slubs);
+    list_init(&cache->cache_node);
 }
 
 /**
@@ -168,7 +183,11 @@ static bool slub_add_slub(struct slub_cache *cache)
         return false;
     }
 
-    void *base = buddy_alloc(cache->order);
+    const uint flags = (cache->flags & SLUB_RECLAIMABLE)
+        ? BUDDY_RECLAIMABLE
+        : BUDDY_NONE;
+
+    void *base = buddy_alloc(cache->order, flags);
     if (base == NULL) {
         slub_free(&slub_cache, slub);
         return false;
@@ -187,8 +206,8 @@ static bool slub_add_slub(struct slub_cache *cache)
 _init
 void slub_setup(void)
 {
-    vaddr slub_cache_slub_mem = (vaddr) buddy_alloc(0);
-    vaddr slub_slub_mem = (vaddr) buddy_alloc(0);
+    vaddr slub_cache_slub_mem = (vaddr) buddy_alloc(0, BUDDY_NONE);
+    vaddr slub_slub_mem = (vaddr) buddy_alloc(0, BUDDY_NONE);
 
     if (!slub_cache_slub_mem || !slub_slub_mem) {
         panic("Failed to allocate memory for slub caches");
@@ -204,6 +223,8 @@ void slub_setup(void)
     // to the cache since the slub cache is not yet available.
     slub_new_cache(&slub_cache, "slub", sizeof(struct slub), 0, 1, SLUB_NONE);
     slub_new_slub(&slub_cache, &slub_slub, slub_slub_mem, 0);
+
+    shrinker_register(&slub_shrinker);
 }
 
 /**
@@ -321,9 +342,69 @@ void slub_destroy_cache(struct slub_cache *cache)
         slub_free(&slub_cache, slub);
     }
 
+    list_remove(&cache->cache_node);
     slub_free(&slub_cache_cache, cache);
 }
 
+/**
+ * @brief Give the empty slubs of a cache back to the buddy allocator. Caches
+ * with the SLUB_STICKY flag are never shrunk, and caches with a minimum
+ * number of free objects keep one empty slub to respect it.
+ * 
+ * @param cache The cache to shrink.
+ * @param target The number of pages to free.
+ * @return u32 The number of pages actually freed.
+ */
+u32 slub_shrink_cache(struct slub_cache *cache, u32 target)
+{
+    if (cache->flags & SLUB_STICKY) {
+        return 0;
+    }
+
+    u32 freed = 0;
+    bool keep = cache->min_free > 0;
+    list_foreach_safe(&cache->free_slubs, node) {
+        if (freed >= target) {
+            break;
+        } else if (keep) {
+            keep = false;
+            continue;
+        }
+
+        struct slub *slub = list_entry(node, struct slub, slub_node);
+        list_remove(node);
+        buddy_free((void *) slub->base, slub->order);
+        freed += buddy_order_to_pfn(slub->order);
+        slub_free(&slub_cache, slub);
+    }
+
+    if (freed > 0 && (cache->flags & SLUB_DEBUG)) {
+        debug("%s cache : %u pages shrunk", cache->name, freed);
+    }
+    return freed;
+}
+
+/**
+ * @brief Shrink all caches until the given number of pages has been freed.
+ * This is the slub allocator shrinker, called by the reclaimer.
+ * 
+ * @param target The number of pages to free.
+ * @return u32 The number of pages actually freed.
+ */
+static u32 slub_shrink(u32 target)
+{
+    u32 freed = 0;
+    list_foreach(&slub_caches, entry) {
+        if (freed >= target) {
+            break;
+        }
+        struct slub_cache *cache = list_entry(
+            entry, struct slub_cache, cache_node);
+        freed += slub_shrink_cache(cache, target - freed);
+    }
+    return freed;
+}
+
 /**
  * @brief Create a new cache for allocating objects of a given size.
  * 
@@ -353,5 +434,6 @@ struct slub_cache *slub_create_cache(
     }
 
     slub_new_cache(cache, name, obj_size, obj_align, min_free, flags);
+    list_add_tail(&slub_caches, &cache->cache_node);
     return cache;
 }
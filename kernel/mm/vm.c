@@ -0,0 +1,1149 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <arch/cpu.h>
+#include <arch/tlb.h>
+#include <arch/trap.h>
+#include <memory.h>
+#include <mm/vm.h>
+#include <mm/page.h>
+#include <mm/lru.h>
+#include <mm/zero.h>
+#include <mm/zram.h>
+#include <mm/ksm.h>
+#include <mm/slub.h>
+#include <mm/buddy.h>
+
+/// Latency statistics of a page fault path.
+struct vm_fault_stats {
+    /// The number of faults resolved by this path.
+    uint count;
+
+    /// The highest number of cycles spent to resolve a fault.
+    u32 max;
+
+    /// The latency histogram, see VM_FAULT_BUCKETS.
+    uint histogram[VM_FAULT_BUCKETS];
+};
+
+/// The kernel address space. It is the address space used at boot, and its
+/// kernel part is shared by all the address spaces.
+struct vm_space vm_kernel_space = {
+    .pd = &kernel_pd,
+    .areas = { &vm_kernel_space.areas, &vm_kernel_space.areas },
+    .tree = { NULL },
+};
+
+/// All the address spaces, starting with the kernel address space.
+DECLARE_LIST(vm_spaces);
+
+/// The address space currently active on the CPU, where the faults of the
+/// user part of the address space are resolved.
+static struct vm_space *vm_active = &vm_kernel_space;
+
+/// The caches used to allocate the area and address space structures.
+static struct slub_cache *vm_area_cache = NULL;
+static struct slub_cache *vm_space_cache = NULL;
+
+/// The area of the last resolved fault. Accesses to an area usually fault
+/// several times in a row, so it is checked before searching the address
+/// space.
+static struct vm_area *vm_fault_hint = NULL;
+
+/// The statistics of the fast path, taken when the area is the one of the
+/// previous fault, the page table exists and a pre-zeroed page is available,
+/// and of the slow path for all the other resolved faults.
+static struct vm_fault_stats vm_fault_fast = {};
+static struct vm_fault_stats vm_fault_slow = {};
+
+/// The number of faults that could not be resolved.
+static uint vm_fault_failures = 0;
+
+/// The number of pages mapped by fault-around, in addition to the pages that
+/// faulted.
+static uint vm_fault_around_pages = 0;
+
+/// The number of write faults on shared pages that copied the page, and the
+/// number of those that reused the page because it was not shared anymore.
+static uint vm_cow_copies = 0;
+static uint vm_cow_reuses = 0;
+
+/// A page that is always filled with zeros. It is mapped read-only on read
+/// faults, so that reading untouched memory does not allocate any page, and
+/// is replaced with a private page on the first write. It is never counted
+/// in the `count` field of its page information structure.
+static u8 vm_zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE))) = {};
+
+/// The physical address of the zero page.
+#define VM_ZERO_PADDR   ((vaddr) vm_zero_page - KERNEL_VBASE)
+
+/// The number of read faults and of fault-around entries that mapped the zero
+/// page, and the number of write faults that replaced it with a private page.
+static uint vm_zero_maps = 0;
+static uint vm_zero_breaks = 0;
+
+/// The number of pages swapped out to the compressed swap, and swapped back
+/// in by a fault.
+static uint vm_swap_outs = 0;
+static uint vm_swap_ins = 0;
+
+static bool vm_page_referenced(struct page *page);
+static bool vm_page_evict(struct page *page);
+
+/// The LRU operations of the anonymous pages, which are evicted to the
+/// compressed swap.
+static const struct lru_ops vm_lru_ops = {
+    .referenced = vm_page_referenced,
+    .evict = vm_page_evict,
+};
+
+/**
+ * @brief Setup the virtual memory subsystem. This function must be called
+ * after the slub allocator has been initialized.
+ */
+_init
+void vm_setup(void)
+{
+    vm_area_cache = slub_create_cache(
+        "vm_area", sizeof(struct vm_area), 0, 0, SLUB_NONE);
+    vm_space_cache = slub_create_cache(
+        "vm_space", sizeof(struct vm_space), 0, 0, SLUB_NONE);
+    if (vm_area_cache == NULL || vm_space_cache == NULL) {
+        panic("Failed to create the vm caches");
+    }
+    lru_register(LRU_ANON, &vm_lru_ops);
+    list_add_tail(&vm_spaces, &vm_kernel_space.node);
+}
+
+/**
+ * @brief Print a page fault latency histogram.
+ * 
+ * @param name The name of the fault path.
+ * @param stats The statistics of the path.
+ */
+static void vm_debug_stats(const char *name, struct vm_fault_stats *stats)
+{
+    debug("  - %s path: %u faults, max %u cycles", name, stats->count,
+        stats->max);
+    for (uint i = 0; i < VM_FAULT_BUCKETS; i++) {
+        if (stats->histogram[i] > 0) {
+            debug("      %u+ cycles: %u", 1u << i, stats->histogram[i]);
+        }
+    }
+}
+
+/**
+ * @brief Get the number of page faults resolved since the boot.
+ * 
+ * @return u32 The number of resolved page faults.
+ */
+u32 vm_fault_count(void)
+{
+    return vm_fault_fast.count + vm_fault_slow.count;
+}
+
+/**
+ * @brief Print the page fault statistics.
+ */
+void vm_debug_info(void)
+{
+    debug("Page faults: %u resolved, %u failed, %u pages mapped around",
+        vm_fault_fast.count + vm_fault_slow.count, vm_fault_failures,
+        vm_fault_around_pages);
+    debug("Copy-on-write: %u pages copied, %u pages reused", vm_cow_copies,
+        vm_cow_reuses);
+    debug("Zero page: %u mappings, %u replaced on write", vm_zero_maps,
+        vm_zero_breaks);
+    debug("Swap: %u pages swapped out, %u swapped in", vm_swap_outs,
+        vm_swap_ins);
+    vm_debug_stats("fast", &vm_fault_fast);
+    vm_debug_stats("slow", &vm_fault_slow);
+}
+
+/**
+ * @brief Check if a page table entry refers to a swapped out page. Such an
+ * entry is not present, and holds the zram slot of the page in its frame
+ * number.
+ * 
+ * @param pte The page table entry.
+ * @return true If the page is swapped out.
+ */
+static inline bool vm_pte_swapped(const struct pte *pte)
+{
+    return !pte->present && pte->v != 0;
+}
+
+/**
+ * @brief Get the end of the area preceding an area in its address space.
+ * 
+ * @param area The area.
+ * @return vaddr The end of the previous area, or 0 if the area is the first
+ * one of its address space.
+ */
+static vaddr vm_area_prev_end(struct vm_area *area)
+{
+    struct list_head *prev = area->node.prev;
+    if (prev == &area->space->areas) {
+        return 0;
+    }
+    return list_entry(prev, struct vm_area, node)->end;
+}
+
+/**
+ * @brief Get the area following an area in its address space.
+ * 
+ * @param area The area.
+ * @return struct vm_area* The next area, or NULL if the area is the last one
+ * of its address space.
+ */
+static struct vm_area *vm_area_next(struct vm_area *area)
+{
+    struct list_head *next = area->node.next;
+    if (next == &area->space->areas) {
+        return NULL;
+    }
+    return list_entry(next, struct vm_area, node);
+}
+
+/**
+ * @brief Recompute the largest free gap of the subtree of an area, from the
+ * gap before the area and from the largest gaps of its children.
+ * 
+ * @param node The tree node of the area.
+ */
+static void vm_area_augment(struct rb_node *node)
+{
+    struct vm_area *area = rb_entry(node, struct vm_area, rb);
+    u32 gap = area->start - vm_area_prev_end(area);
+    if (node->left != NULL) {
+        gap = max(gap, rb_entry(node->left, struct vm_area, rb)->subtree_gap);
+    }
+    if (node->right != NULL) {
+        gap = max(gap, rb_entry(node->right, struct vm_area, rb)->subtree_gap);
+    }
+    area->subtree_gap = gap;
+}
+
+/**
+ * @brief Find the area containing an address.
+ * 
+ * @param space The address space.
+ * @param addr The address.
+ * @return struct vm_area* The area containing the address, or NULL if the
+ * address is not inside any area.
+ */
+struct vm_area *vm_area_find(struct vm_space *space, vaddr addr)
+{
+    struct rb_node *node = space->tree.node;
+    while (node != NULL) {
+        struct vm_area *area = rb_entry(node, struct vm_area, rb);
+        if (addr < area->start) {
+            node = node->left;
+        } else if (addr >= area->end) {
+            node = node->right;
+        } else {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the first area ending after an address: the area containing
+ * the address, or else the first area following it.
+ * 
+ * @param space The address space.
+ * @param addr The address.
+ * @return struct vm_area* The area, or NULL if there is no area after the
+ * address.
+ */
+struct vm_area *vm_area_find_next(struct vm_space *space, vaddr addr)
+{
+    struct vm_area *next = NULL;
+    struct rb_node *node = space->tree.node;
+    while (node != NULL) {
+        struct vm_area *area = rb_entry(node, struct vm_area, rb);
+        if (addr >= area->end) {
+            node = node->right;
+        } else if (addr >= area->start) {
+            return area;
+        } else {
+            next = area;
+            node = node->left;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Search the lowest free gap of a subtree where a range fits. The
+ * subtrees whose largest gap is too small are skipped, as well as the left
+ * subtrees whose gaps are all below the lower bound.
+ * 
+ * @param node The root of the subtree, or NULL.
+ * @param size The size of the range.
+ * @param low The lowest address of the range.
+ * @param high The highest end of the range.
+ * @return vaddr The start of the range, or 0 if it does not fit in the gaps
+ * of the subtree.
+ */
+static vaddr vm_gap_search(struct rb_node *node, u32 size, vaddr low,
+    vaddr high)
+{
+    if (node == NULL) {
+        return 0;
+    }
+
+    struct vm_area *area = rb_entry(node, struct vm_area, rb);
+    if (area->subtree_gap < size) {
+        return 0;
+    }
+
+    if (area->start > low) {
+        const vaddr found = vm_gap_search(node->left, size, low, high);
+        if (found != 0) {
+            return found;
+        }
+    }
+
+    const vaddr gap_start = max(vm_area_prev_end(area), low);
+    const vaddr gap_end = min(area->start, high);
+    if (gap_start >= high) {
+        return 0;
+    } else if (gap_end > gap_start && gap_end - gap_start >= size) {
+        return gap_start;
+    }
+    return vm_gap_search(node->right, size, low, high);
+}
+
+/**
+ * @brief Find the lowest free range of an address space, outside of any
+ * area, in O(log n).
+ * 
+ * @param space The address space.
+ * @param size The size of the range. It must be page aligned.
+ * @param low The lowest address of the range. It must be page aligned. The
+ * first page is never used.
+ * @param high The highest end of the range. It must be page aligned.
+ * @return vaddr The start of the range, or 0 if there is no free range large
+ * enough.
+ */
+vaddr vm_space_find_gap(struct vm_space *space, u32 size, vaddr low,
+    vaddr high)
+{
+    low = max(low, (vaddr) PAGE_SIZE);
+    const vaddr found = vm_gap_search(space->tree.node, size, low, high);
+    if (found != 0) {
+        return found;
+    }
+
+    // The gap after the last area is not tracked by the tree.
+    vaddr last_end = 0;
+    if (!list_empty(&space->areas)) {
+        last_end = list_last_entry(&space->areas, struct vm_area, node)->end;
+    }
+
+    const vaddr gap_start = max(last_end, low);
+    if (gap_start < high && high - gap_start >= size) {
+        return gap_start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Create an area mapped on demand. No memory is allocated until the
+ * pages of the area are accessed. In the kernel part of the address space,
+ * the area must be inside the [KERNEL_MAP_BASE, KERNEL_MAP_END) area and must
+ * not overlap the mappings created with `paging_map_kernel()`.
+ * 
+ * @param space The address space.
+ * @param start The first address of the area. It must be page aligned.
+ * @param size The size of the area, in bytes. It must be page aligned.
+ * @param flags The access rights of the area (VM_*).
+ * @return struct vm_area* The new area, or NULL if it overlaps another area
+ * or if there is no memory left.
+ */
+struct vm_area *vm_area_create(struct vm_space *space, vaddr start, u32 size,
+    uint flags)
+{
+    assert(page_is_aligned(start) && page_is_aligned(size) && size > 0);
+    assert(start + size - 1 >= start);
+    assert(start + size <= KERNEL_VBASE ||
+        (start >= KERNEL_MAP_BASE && start + size <= KERNEL_MAP_END));
+
+    // Find the position of the new area in the tree. Since the areas do not
+    // overlap, an area overlapping the new one is always on the path. The
+    // last area where the path goes left is the one following the new area.
+    const vaddr end = start + size;
+    struct rb_node **link = &space->tree.node;
+    struct rb_node *parent = NULL;
+    struct list_head *next = &space->areas;
+    while (*link != NULL) {
+        parent = *link;
+        struct vm_area *area = rb_entry(parent, struct vm_area, rb);
+        if (end <= area->start) {
+            next = &area->node;
+            link = &parent->left;
+        } else if (start >= area->end) {
+            link = &parent->right;
+        } else {
+            return NULL;
+        }
+    }
+
+    struct vm_area *area = slub_alloc(vm_area_cache);
+    if (area == NULL) {
+        return NULL;
+    }
+
+    area->start = start;
+    area->end = end;
+    area->flags = flags;
+    area->space = space;
+    list_insert(next->prev, next, &area->node);
+    rb_insert(&space->tree, &area->rb, parent, link, vm_area_augment);
+
+    // The gap before the next area is now smaller.
+    if (next != &space->areas) {
+        struct vm_area *following = list_entry(next, struct vm_area, node);
+        rb_propagate(&following->rb, vm_area_augment);
+    }
+    return area;
+}
+
+/**
+ * @brief Create an area mapped on demand in the lowest free range of an
+ * address space between two addresses.
+ * 
+ * @param space The address space.
+ * @param size The size of the area, in bytes. It must be page aligned.
+ * @param flags The access rights of the area (VM_*).
+ * @param low The lowest address of the area. It must be page aligned.
+ * @param high The highest end of the area. It must be page aligned.
+ * @return struct vm_area* The new area, or NULL if there is no free range
+ * large enough or no memory left.
+ */
+struct vm_area *vm_area_alloc(struct vm_space *space, u32 size, uint flags,
+    vaddr low, vaddr high)
+{
+    const vaddr start = vm_space_find_gap(space, size, low, high);
+    if (start == 0) {
+        return NULL;
+    }
+    return vm_area_create(space, start, size, flags);
+}
+
+/**
+ * @brief Release an anonymous page that is not mapped anymore.
+ * 
+ * @param page The page, whose count must have dropped to 0.
+ */
+static void vm_page_release(struct page *page)
+{
+    assert(page->count == 0);
+    lru_remove(page);
+    page->mapping = NULL;
+    page->flags &= ~PG_KSM;
+    buddy_free((void *) paddr_to_vaddr(page_paddr(page)), 0);
+}
+
+/**
+ * @brief Record the area and the address where an anonymous page is mapped,
+ * and add the page to the LRU lists if it is not there yet.
+ * 
+ * @param page The page.
+ * @param area An area mapping the page.
+ * @param va The address of the page in the area.
+ */
+static void vm_page_track(struct page *page, struct vm_area *area, vaddr va)
+{
+    page->mapping = area;
+    page->index = va;
+    if (!(page->flags & PG_LRU)) {
+        lru_add(page, LRU_ANON);
+    }
+}
+
+/**
+ * @brief Forget that an area maps an anonymous page. If the page was tracked
+ * through this area, it leaves the LRU lists, since its other mappings are
+ * unknown. It is tracked again when one of them makes it private.
+ * 
+ * @param page The page.
+ * @param area The area not mapping the page anymore.
+ */
+static void vm_page_untrack(struct page *page, struct vm_area *area)
+{
+    if (page->mapping == area) {
+        lru_remove(page);
+        page->mapping = NULL;
+    }
+}
+
+/**
+ * @brief Test and clear the accessed bit of the mapping of an anonymous page
+ * by the area tracking it. Like Linux does on x86, the TLB is not flushed: a
+ * stale entry may only delay the next update of the bit, which makes the
+ * page look older than it is.
+ * 
+ * @param page The page.
+ * @return true If the page was accessed since the last call.
+ */
+static bool vm_page_referenced(struct page *page)
+{
+    const struct vm_area *area = page->mapping;
+    if (area == NULL) {
+        return false;
+    }
+
+    struct pte *pte = paging_get_pte(area->space->pd, page->index, false);
+    if (pte == NULL || !pte->present || !pte->accessed ||
+        ((paddr) pte->frame << 12) != page_paddr(page)) {
+        return false;
+    }
+    pte->accessed = 0;
+    return true;
+}
+
+/**
+ * @brief Evict an anonymous page to the compressed swap. The page table entry
+ * of the page is replaced by a swap entry, and the page is released. Shared
+ * pages are not evicted, since only one of their mappings is known.
+ * 
+ * @param page The page, removed from the LRU lists.
+ * @return true If the page was evicted and released.
+ * @return false If the page is shared, or if the swap is full.
+ */
+static bool vm_page_evict(struct page *page)
+{
+    const struct vm_area *area = page->mapping;
+    if (area == NULL || page->count != 1) {
+        return false;
+    }
+
+    const vaddr va = page->index;
+    const paddr pa = page_paddr(page);
+    struct pte *pte = paging_get_pte(area->space->pd, va, false);
+    if (pte == NULL || !pte->present || ((paddr) pte->frame << 12) != pa) {
+        return false;
+    }
+
+    const u32 slot = zram_store((void *) paddr_to_vaddr(pa));
+    if (slot == 0) {
+        return false;
+    }
+
+    pte->v = 0;
+    pte->frame = slot;
+    paging_invalidate_page(va);
+
+    page->count = 0;
+    vm_page_release(page);
+    vm_swap_outs++;
+    return true;
+}
+
+/**
+ * @brief Destroy an area, removing its mappings and releasing the pages that
+ * are not shared with another address space.
+ * 
+ * @param space The address space containing the area.
+ * @param area The area to destroy.
+ */
+void vm_area_destroy(struct vm_space *space, struct vm_area *area)
+{
+    for (vaddr va = area->start; va < area->end; va += PAGE_SIZE) {
+        struct pte *pte = paging_get_pte(space->pd, va, false);
+        if (pte != NULL && vm_pte_swapped(pte)) {
+            zram_free(pte->frame);
+            pte->v = 0;
+            continue;
+        } else if (pte == NULL || !pte->present) {
+            continue;
+        }
+
+        const paddr pa = (paddr) pte->frame << 12;
+        if (pa == VM_ZERO_PADDR) {
+            continue;
+        }
+
+        struct page *page = page_info(pa);
+        vm_page_untrack(page, area);
+        if (--page->count == 0) {
+            vm_page_release(page);
+        }
+    }
+    paging_unmap_range(space->pd, area->start, area->end - area->start);
+
+    if (vm_fault_hint == area) {
+        vm_fault_hint = NULL;
+    }
+
+    // The gap before the next area grows by the size of the area and by the
+    // gap before it.
+    struct vm_area *next = vm_area_next(area);
+    list_remove(&area->node);
+    rb_erase(&space->tree, &area->rb, vm_area_augment);
+    if (next != NULL) {
+        rb_propagate(&next->rb, vm_area_augment);
+    }
+    slub_free(vm_area_cache, area);
+}
+
+/**
+ * @brief Create an empty address space. Its kernel part is shared with the
+ * kernel address space.
+ * 
+ * @return struct vm_space* The new address space, or NULL if there is no
+ * memory left.
+ */
+struct vm_space *vm_space_create(void)
+{
+    struct vm_space *space = slub_alloc(vm_space_cache);
+    if (space == NULL) {
+        return NULL;
+    }
+
+    space->pd = paging_create_pd();
+    if (space->pd == NULL) {
+        slub_free(vm_space_cache, space);
+        return NULL;
+    }
+    list_init(&space->areas);
+    space->tree.node = NULL;
+    list_add_tail(&vm_spaces, &space->node);
+    return space;
+}
+
+/**
+ * @brief Destroy an address space created with `vm_space_create()` or
+ * `vm_space_clone()`, with all its areas.
+ * 
+ * @param space The address space. It must not be active.
+ */
+void vm_space_destroy(struct vm_space *space)
+{
+    assert(space != &vm_kernel_space && space != vm_active);
+    ksm_forget_space(space);
+    list_remove(&space->node);
+    list_foreach_safe(&space->areas, entry) {
+        vm_area_destroy(space, list_entry(entry, struct vm_area, node));
+    }
+    paging_destroy_pd(space->pd);
+    slub_free(vm_space_cache, space);
+}
+
+/**
+ * @brief Share the pages of an area with a copy of the area in another address
+ * space. The pages are mapped read-only in both address spaces and their
+ * count is incremented, so that the first write copies them. The pages
+ * swapped out share their slot instead.
+ * 
+ * @param src The source address space.
+ * @param area The area of the source address space.
+ * @param dst The destination address space, containing a copy of the area.
+ * @param tlb The gather collecting the pages of `src` made read-only.
+ * @return true If the pages were shared.
+ * @return false If a page table could not be allocated.
+ */
+static bool vm_area_share(struct vm_space *src, struct vm_area *area,
+    struct vm_space *dst, struct mmu_gather *tlb)
+{
+    for (vaddr va = area->start; va < area->end; va += PAGE_SIZE) {
+        struct pte *src_pte = paging_get_pte(src->pd, va, false);
+        if (src_pte == NULL || src_pte->v == 0) {
+            continue;
+        }
+
+        struct pte *dst_pte = paging_get_pte(dst->pd, va, true);
+        if (dst_pte == NULL) {
+            return false;
+        }
+
+        // A swapped out page is shared by sharing its slot: each address
+        // space reads its own copy back.
+        if (vm_pte_swapped(src_pte)) {
+            zram_dup(src_pte->frame);
+            *dst_pte = *src_pte;
+            continue;
+        }
+
+        if (src_pte->rw) {
+            src_pte->rw = 0;
+            tlb_gather_page(tlb, va);
+        }
+        *dst_pte = *src_pte;
+
+        const paddr pa = (paddr) src_pte->frame << 12;
+        if (pa != VM_ZERO_PADDR) {
+            page_info(pa)->count++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Duplicate an address space, like `fork()` does. Instead of copying
+ * the pages of the user areas, they are shared copy-on-write: both address
+ * spaces map them read-only, and the page fault handler copies a page when
+ * it is written. The areas of the kernel part are not duplicated, since the
+ * kernel part is shared by all the address spaces.
+ * 
+ * @param src The address space to duplicate.
+ * @return struct vm_space* The new address space, or NULL if there is no
+ * memory left.
+ */
+struct vm_space *vm_space_clone(struct vm_space *src)
+{
+    struct vm_space *dst = vm_space_create();
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    struct mmu_gather tlb;
+    tlb_gather_init(&tlb, src->pd);
+
+    bool success = true;
+    list_foreach(&src->areas, entry) {
+        struct vm_area *area = list_entry(entry, struct vm_area, node);
+        if (area->start >= KERNEL_VBASE) {
+            break;
+        }
+
+        const u32 size = area->end - area->start;
+        struct vm_area *copy = vm_area_create(dst, area->start, size,
+            area->flags);
+        if (copy == NULL || !vm_area_share(src, area, dst, &tlb)) {
+            success = false;
+            break;
+        }
+    }
+
+    // The pages already shared stay read-only in the source address space
+    // on failure, which only costs a useless fault on the next write.
+    tlb_finish(&tlb);
+    if (!success) {
+        vm_space_destroy(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+/**
+ * @brief Switch to another address space. The faults of the user part of the
+ * address space are then resolved in this address space.
+ * 
+ * @param space The address space.
+ */
+void vm_switch(struct vm_space *space)
+{
+    vm_active = space;
+    vm_fault_hint = NULL;
+    paging_switch(space->pd);
+}
+
+/**
+ * @brief Convert the access rights of an area to mapping flags.
+ * 
+ * @param flags The access rights of the area (VM_*).
+ * @return uint The mapping flags (PAGING_*).
+ */
+static uint vm_paging_flags(uint flags)
+{
+    uint paging_flags = PAGING_NONE;
+    if (flags & VM_WRITE) {
+        paging_flags |= PAGING_WRITE;
+    }
+    if (!(flags & VM_EXEC)) {
+        paging_flags |= PAGING_NOEXEC;
+    }
+    if (flags & VM_USER) {
+        paging_flags |= PAGING_USER;
+    }
+    return paging_flags;
+}
+
+/**
+ * @brief Record the latency of a resolved page fault.
+ * 
+ * @param stats The statistics of the fault path.
+ * @param start The value of the time stamp counter when the fault started to
+ * be handled.
+ */
+static void vm_fault_account(struct vm_fault_stats *stats, u64 start)
+{
+    const u64 elapsed = cpu_rdtsc() - start;
+    const u32 cycles = (elapsed > UINT32_MAX) ? UINT32_MAX : (u32) elapsed;
+    const uint bucket = 31 - __builtin_clz(cycles | 1);
+
+    stats->count++;
+    stats->max = max(stats->max, cycles);
+    stats->histogram[min(bucket, (uint) VM_FAULT_BUCKETS - 1)]++;
+}
+
+/**
+ * @brief Map a newly allocated page, which is not shared yet, and add it to
+ * the LRU lists.
+ * 
+ * @param area The area containing the page.
+ * @param pte The page table entry, which must not be present.
+ * @param va The virtual address of the page.
+ * @param page The page, in the low memory.
+ * @param flags The mapping flags (PAGING_*).
+ */
+static void vm_map_page(struct vm_area *area, struct pte *pte, vaddr va,
+    void *page, uint flags)
+{
+    const paddr pa = (vaddr) page - KERNEL_VBASE;
+    struct page *info = page_info(pa);
+    info->count = 1;
+    vm_page_track(info, area, va);
+    paging_set_pte(pte, va, pa, flags);
+}
+
+/**
+ * @brief Map the zero page read-only.
+ * 
+ * @param pte The page table entry, which must not be present.
+ * @param va The virtual address of the page.
+ * @param flags The mapping flags (PAGING_*) of the area. PAGING_WRITE is
+ * ignored.
+ */
+static void vm_map_zero_page(struct pte *pte, vaddr va, uint flags)
+{
+    paging_set_pte(pte, va, VM_ZERO_PADDR, flags & ~PAGING_WRITE);
+    vm_zero_maps++;
+}
+
+/**
+ * @brief Resolve a write fault on a page shared copy-on-write. If the page is
+ * not shared anymore, because the other address spaces copied or released
+ * it, the page is simply made writable again, unless it is a merged page
+ * that may be shared again at any time. Otherwise, the page is copied
+ * and the copy replaces the shared page in this address space. The zero page
+ * is always replaced, with a zeroed page that does not need to be copied.
+ * 
+ * @param space The address space.
+ * @param area The area containing the fault.
+ * @param va The address of the faulting page.
+ * @return true If the fault was resolved.
+ * @return false If the page is not mapped, or if there is no memory left.
+ */
+static bool vm_fault_cow(struct vm_space *space, struct vm_area *area,
+    vaddr va)
+{
+    struct pte *pte = paging_get_pte(space->pd, va, false);
+    if (pte == NULL || !pte->present) {
+        return false;
+    }
+
+    const paddr pa = (paddr) pte->frame << 12;
+    const bool zero = pa == VM_ZERO_PADDR;
+    struct page *shared = zero ? NULL : page_info(pa);
+    if (!zero && shared->count == 1 && !(shared->flags & PG_KSM)) {
+        vm_page_track(shared, area, va);
+        pte->rw = 1;
+        paging_invalidate_page(va);
+        vm_cow_reuses++;
+        return true;
+    }
+
+    // The shared page is pinned while the copy is allocated, since the
+    // allocation may reclaim memory, and the reclaimer would otherwise evict
+    // a merged page that is only mapped here.
+    if (!zero) {
+        shared->count++;
+    }
+    void *copy = buddy_alloc(0, BUDDY_MOVABLE | (zero ? BUDDY_ZERO : 0));
+    if (!zero) {
+        shared->count--;
+    }
+    if (copy == NULL) {
+        return false;
+    }
+
+    if (zero) {
+        vm_zero_breaks++;
+    } else {
+        memcpy(copy, (void *) paddr_to_vaddr(pa), PAGE_SIZE);
+        vm_page_untrack(shared, area);
+        if (--shared->count == 0) {
+            vm_page_release(shared);
+        }
+        vm_cow_copies++;
+    }
+
+    pte->v = 0;
+    vm_map_page(area, pte, va, copy, vm_paging_flags(area->flags));
+    paging_invalidate_page(va);
+    return true;
+}
+
+/**
+ * @brief Resolve a fault on a swapped out page, by reading it back from the
+ * compressed swap into a new page.
+ * 
+ * @param area The area containing the fault.
+ * @param pte The swap entry of the page.
+ * @param va The address of the faulting page.
+ * @return true If the fault was resolved.
+ * @return false If there is no memory left.
+ */
+static bool vm_swap_in(struct vm_area *area, struct pte *pte, vaddr va)
+{
+    void *page = buddy_alloc(0, BUDDY_MOVABLE);
+    if (page == NULL) {
+        return false;
+    }
+
+    const u32 slot = pte->frame;
+    zram_load(slot, page);
+    zram_free(slot);
+    pte->v = 0;
+    vm_map_page(area, pte, va, page, vm_paging_flags(area->flags));
+    vm_swap_ins++;
+    return true;
+}
+
+/**
+ * @brief Map the neighbours of a faulting page, to avoid taking a fault for
+ * each page when an area is accessed sequentially. The window is aligned on
+ * VM_FAULT_AROUND pages and clamped to the area and to the page table of the
+ * faulting page, so that all the entries are reached from the same page table
+ * walk. After a read fault, the neighbours are mapped to the zero page.
+ * After a write fault, only pages that are readily available are used: the
+ * window stops growing when the pre-zeroed page pool is empty, since
+ * allocating from the buddy allocator would make the fault slower.
+ * 
+ * @param area The area containing the fault.
+ * @param pte The page table entry of the faulting page.
+ * @param va The address of the faulting page.
+ * @param write Whether the fault was caused by a write.
+ */
+static void vm_fault_around(struct vm_area *area, struct pte *pte, vaddr va,
+    bool write)
+{
+    // The window is smaller than a page table and aligned on its size, so it
+    // never crosses a page table boundary.
+    const u32 window = VM_FAULT_AROUND * PAGE_SIZE;
+    const vaddr window_start = align_down(va, window);
+    const vaddr start = max(area->start, window_start);
+    const vaddr end = min(area->end - 1, window_start + window - 1) + 1;
+    const uint flags = vm_paging_flags(area->flags);
+
+    for (vaddr addr = start; addr != end; addr += PAGE_SIZE) {
+        struct pte *entry = pte + (i32) (addr - va) / PAGE_SIZE;
+        if (addr == va || entry->v != 0) {
+            continue;
+        } else if (!write) {
+            vm_map_zero_page(entry, addr, flags);
+            vm_fault_around_pages++;
+            continue;
+        }
+
+        void *page = zero_pool_get(MIGRATE_MOVABLE);
+        if (page == NULL) {
+            break;
+        }
+        vm_map_page(area, entry, addr, page, flags);
+        vm_fault_around_pages++;
+    }
+}
+
+/**
+ * @brief Resolve a fault on a non-present page. A swapped out page is read
+ * back, otherwise a read fault maps the zero page, and a write fault maps a
+ * zeroed page. The fast path, taken for
+ * repeated faults in the same area, only reads the page table entry and,
+ * for a write, takes a page from the pre-zeroed page pool. Otherwise, the
+ * area is searched in the address space and the page is allocated by the
+ * buddy allocator, which may reclaim memory. The neighbouring pages are then
+ * mapped as well if possible.
+ * 
+ * @param addr The faulting address.
+ * @param error The page fault error code (TRAP_PF_*).
+ * @param fast Set to true if the fault was resolved by the fast path.
+ * @return true If the fault was resolved.
+ * @return false If the access is invalid, or if there is no memory left.
+ */
+static bool vm_fault_resolve(vaddr addr, u32 error, bool *fast)
+{
+    struct vm_space *space = (addr >= KERNEL_VBASE) ?
+        &vm_kernel_space : vm_active;
+
+    // The page tables created in the kernel space after the active address
+    // space was created are not in its page directory yet.
+    if (space != vm_active && paging_sync_kernel(vm_active->pd, addr)) {
+        return true;
+    }
+
+    struct vm_area *area = vm_fault_hint;
+    *fast = area != NULL && addr >= area->start && addr < area->end;
+    if (!*fast) {
+        area = vm_area_find(space, addr);
+        if (area == NULL) {
+            return false;
+        }
+    }
+
+    // The access must be allowed by the area. Then, a protection fault can
+    // only be a write to a page shared copy-on-write.
+    if (((error & TRAP_PF_WRITE) && !(area->flags & VM_WRITE)) ||
+        ((error & TRAP_PF_USER) && !(area->flags & VM_USER))) {
+        return false;
+    } else if (error & TRAP_PF_PRESENT) {
+        *fast = false;
+        return (error & TRAP_PF_WRITE) &&
+            vm_fault_cow(space, area, align_down(addr, PAGE_SIZE));
+    }
+
+    const vaddr va = align_down(addr, PAGE_SIZE);
+    struct pte *pte = paging_get_pte(space->pd, va, false);
+    if (pte == NULL) {
+        *fast = false;
+        pte = paging_get_pte(space->pd, va, true);
+        if (pte == NULL) {
+            return false;
+        }
+    }
+
+    if (vm_pte_swapped(pte)) {
+        *fast = false;
+        vm_fault_hint = area;
+        return vm_swap_in(area, pte, va);
+    }
+
+    const uint flags = vm_paging_flags(area->flags);
+    if (!(error & TRAP_PF_WRITE)) {
+        vm_map_zero_page(pte, va, flags);
+        vm_fault_around(area, pte, va, false);
+        vm_fault_hint = area;
+        return true;
+    }
+
+    void *page = *fast ? zero_pool_get(MIGRATE_MOVABLE) : NULL;
+    if (page == NULL) {
+        *fast = false;
+        page = buddy_alloc(0, BUDDY_MOVABLE | BUDDY_ZERO);
+        if (page == NULL) {
+            return false;
+        }
+    }
+
+    vm_map_page(area, pte, va, page, flags);
+    vm_fault_around(area, pte, va, true);
+    vm_fault_hint = area;
+    return true;
+}
+
+/**
+ * @brief Handle a page fault, and record its latency if it was resolved.
+ * 
+ * @param addr The faulting address, read from CR2.
+ * @param error The page fault error code (TRAP_PF_*).
+ * @return true If the fault was resolved, and the access can be retried.
+ * @return false If the access is invalid.
+ */
+bool vm_fault(vaddr addr, u32 error)
+{
+    const u64 start = cpu_rdtsc();
+    bool fast = false;
+    if (!vm_fault_resolve(addr, error, &fast)) {
+        vm_fault_failures++;
+        return false;
+    }
+
+    vm_fault_account(fast ? &vm_fault_fast : &vm_fault_slow, start);
+    return true;
+}
+
+/**
+ * @brief Get the private page mapped at an address of a mergeable area, for
+ * the same-page merging. The zero page, the shared pages and the pages that
+ * were already merged are not private.
+ * 
+ * @param space The address space.
+ * @param va The address of the page.
+ * @return paddr The physical address of the page, or 0 if there is no
+ * private page mapped at this address.
+ */
+paddr vm_page_private(struct vm_space *space, vaddr va)
+{
+    const struct vm_area *area = vm_area_find(space, va);
+    if (area == NULL || !(area->flags & VM_MERGEABLE)) {
+        return 0;
+    }
+
+    struct pte *pte = paging_get_pte(space->pd, va, false);
+    if (pte == NULL || !pte->present) {
+        return 0;
+    }
+
+    const paddr pa = (paddr) pte->frame << 12;
+    if (pa == VM_ZERO_PADDR) {
+        return 0;
+    }
+
+    const struct page *page = page_info(pa);
+    return (page->count == 1 && !(page->flags & PG_KSM)) ? pa : 0;
+}
+
+/**
+ * @brief Merge a private page with an identical page. The caller must have
+ * compared their content. The mapping is made read-only, so that a write
+ * copies the page again.
+ * 
+ * @param space The address space.
+ * @param va The address of the page.
+ * @param pa The page, as returned by `vm_page_private()`.
+ * @param target The page replacing it: a merged page, 0 for the zero page, or
+ * the page itself to turn it into a merged page.
+ * @return true If the page was merged.
+ * @return false If the page is not mapped at this address anymore, or is not
+ * private anymore.
+ */
+bool vm_page_merge(struct vm_space *space, vaddr va, paddr pa, paddr target)
+{
+    if (vm_page_private(space, va) != pa) {
+        return false;
+    }
+
+    struct pte *pte = paging_get_pte(space->pd, va, false);
+    struct page *page = page_info(pa);
+    pte->rw = 0;
+    if (target == pa) {
+        page->flags |= PG_KSM;
+    } else {
+        if (target == 0) {
+            pte->frame = VM_ZERO_PADDR >> 12;
+        } else {
+            struct page *merged = page_info(target);
+            assert(merged->flags & PG_KSM);
+            merged->count++;
+            pte->frame = target >> 12;
+        }
+        page->count = 0;
+        vm_page_release(page);
+    }
+    paging_invalidate_page(va);
+    return true;
+}
@@ -0,0 +1,208 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/log.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <memory.h>
+#include <mm/vm.h>
+#include <mm/page.h>
+#include <mm/buddy.h>
+#include <mm/highmem.h>
+#include <mm/vmalloc.h>
+#include <arch/paging.h>
+
+/// The area flag marking a range that has been freed but whose TLB entries
+/// have not been purged yet. The range cannot be reused until it is purged.
+#define VMALLOC_LAZY    0x80000000
+
+/// The address space used to track the ranges of the vmalloc area. Its areas
+/// are never mapped on demand: the pages of a range are mapped when it is
+/// allocated, and the tree of the areas is only used to find free ranges.
+static struct vm_space vmalloc_space = {
+    .pd = &kernel_pd,
+    .areas = { &vmalloc_space.areas, &vmalloc_space.areas },
+    .tree = { NULL },
+};
+
+/// The number of live allocations and of the pages mapped by them.
+static uint vmalloc_areas = 0;
+static uint vmalloc_pages = 0;
+
+/// The number of freed pages whose TLB entries have not been purged yet.
+static uint vmalloc_lazy_pages = 0;
+
+/// The number of purges of the lazily freed ranges.
+static uint vmalloc_purges = 0;
+
+/**
+ * @brief Print some debug information about the vmalloc area.
+ */
+void vmalloc_debug_info(void)
+{
+    debug("vmalloc: %u areas, %u pages, %u lazy pages, %u purges",
+        vmalloc_areas, vmalloc_pages, vmalloc_lazy_pages, vmalloc_purges);
+}
+
+/**
+ * @brief Release a page of a vmalloc buffer to the allocator it comes from.
+ * 
+ * @param pa The physical address of the page, or 0 to do nothing.
+ */
+static void vmalloc_free_page(paddr pa)
+{
+    if (pa == 0) {
+        return;
+    } else if (page_info(pa)->flags & PG_HIGHMEM) {
+        highmem_free(pa);
+    } else {
+        buddy_free((void *) paddr_to_vaddr(pa), 0);
+    }
+}
+
+/**
+ * @brief Unmap the pages of the beginning of a range and release them,
+ * without flushing the TLB.
+ * 
+ * @param area The area of the range.
+ * @param end The end of the mapped part of the range.
+ * @return uint The number of pages released.
+ */
+static uint vmalloc_release(struct vm_area *area, vaddr end)
+{
+    uint count = 0;
+    for (vaddr va = area->start; va < end; va += PAGE_SIZE) {
+        struct pte *pte = paging_get_pte(&kernel_pd, va, false);
+        if (pte == NULL || !pte->present) {
+            continue;
+        }
+
+        vmalloc_free_page((paddr) pte->frame << 12);
+        pte->v = 0;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Flush the TLB once for all the lazily freed ranges, and make their
+ * virtual addresses available again. The pages of the ranges have already
+ * been released when they were freed: their stale TLB entries are harmless
+ * as long as the addresses are not reused.
+ */
+void vmalloc_purge(void)
+{
+    if (vmalloc_lazy_pages == 0) {
+        return;
+    }
+
+    paging_flush_global();
+    list_foreach_safe(&vmalloc_space.areas, entry) {
+        struct vm_area *area = list_entry(entry, struct vm_area, node);
+        if (area->flags & VMALLOC_LAZY) {
+            vm_area_destroy(&vmalloc_space, area);
+        }
+    }
+    vmalloc_lazy_pages = 0;
+    vmalloc_purges++;
+}
+
+/**
+ * @brief Allocate a virtually contiguous buffer in the vmalloc area. The
+ * buffer is made of single pages, preferably from the high memory, so the
+ * allocation does not depend on the physical fragmentation. A guard page
+ * that is never mapped follows the buffer to catch overflows.
+ * 
+ * @param size The size of the buffer, in bytes.
+ * @return void* The buffer, or NULL if the size is 0, or if there is no
+ * virtual range or no memory left.
+ */
+void *vmalloc(u32 size)
+{
+    if (size == 0 || size > VMALLOC_END - VMALLOC_BASE - PAGE_SIZE) {
+        return NULL;
+    }
+    size = align_up(size, PAGE_SIZE);
+
+    const u32 range = size + PAGE_SIZE;
+    struct vm_area *area = vm_area_alloc(&vmalloc_space, range, VM_WRITE,
+        VMALLOC_BASE, VMALLOC_END);
+    if (area == NULL && vmalloc_lazy_pages > 0) {
+        vmalloc_purge();
+        area = vm_area_alloc(&vmalloc_space, range, VM_WRITE, VMALLOC_BASE,
+            VMALLOC_END);
+    }
+    if (area == NULL) {
+        return NULL;
+    }
+
+    const vaddr end = area->start + size;
+    for (vaddr va = area->start; va < end; va += PAGE_SIZE) {
+        paddr pa = highmem_alloc();
+        if (pa == 0) {
+            void *page = buddy_alloc(0, BUDDY_NONE);
+            pa = page != NULL ? (vaddr) page - KERNEL_VBASE : 0;
+        }
+
+        struct pte *pte = pa ? paging_get_pte(&kernel_pd, va, true) : NULL;
+        if (pte == NULL) {
+            // The buffer has never been accessed, so its range does not need
+            // to wait for a purge.
+            vmalloc_free_page(pa);
+            vmalloc_release(area, va);
+            vm_area_destroy(&vmalloc_space, area);
+            return NULL;
+        }
+        paging_set_pte(pte, va, pa, PAGING_WRITE | PAGING_NOEXEC);
+    }
+
+    vmalloc_areas++;
+    vmalloc_pages += size / PAGE_SIZE;
+    return (void *) area->start;
+}
+
+/**
+ * @brief Free a buffer allocated with `vmalloc()`. Its pages are released
+ * immediately, but its TLB entries are only purged when enough pages have
+ * been freed, with a single flush for all the freed buffers. Until then, the
+ * virtual range of the buffer is not reused.
+ * 
+ * @param ptr The buffer, or NULL to do nothing.
+ */
+void vfree(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct vm_area *area = vm_area_find(&vmalloc_space, (vaddr) ptr);
+    if (area == NULL || area->start != (vaddr) ptr) {
+        panic("vfree(): %p was not allocated with vmalloc()", ptr);
+    } else if (area->flags & VMALLOC_LAZY) {
+        panic("vfree(): double free of %p", ptr);
+    }
+
+    const uint count = vmalloc_release(area, area->end - PAGE_SIZE);
+    area->flags |= VMALLOC_LAZY;
+    vmalloc_areas--;
+    vmalloc_pages -= count;
+    vmalloc_lazy_pages += count;
+    if (vmalloc_lazy_pages >= VMALLOC_LAZY_MAX) {
+        vmalloc_purge();
+    }
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/log.h>
+#include <lib/assert.h>
+#include <mm/page.h>
+#include <mm/zero.h>
+#include <mm/buddy.h>
+#include <arch/paging.h>
+
+/// The pre-zeroed pages, one list for each migrate type so that a zeroed page
+/// does not pollute a pageblock of a different mobility. Since the content of
+/// the pages must stay zeroed, they are linked with the `list` field of their
+/// page information structure instead of a node stored inside the page.
+static struct list_head zero_pool[MIGRATE_TYPES] = { };
+
+/// The number of pages in each pre-zeroed list.
+static uint zero_pool_count[MIGRATE_TYPES] = { };
+
+/// The buddy allocation flags used to refill the list of each migrate type.
+static const uint zero_pool_flags[MIGRATE_TYPES] = {
+    [MIGRATE_UNMOVABLE] = BUDDY_NONE,
+    [MIGRATE_RECLAIMABLE] = BUDDY_RECLAIMABLE,
+    [MIGRATE_MOVABLE] = BUDDY_MOVABLE,
+};
+
+/// The number of zeroed page requests served from the pool.
+static uint zero_pool_hits = 0;
+
+/// The number of zeroed page requests that found the pool empty, and had to
+/// zero the page inline.
+static uint zero_pool_misses = 0;
+
+/**
+ * @brief Initialize the pre-zeroed page pool. The pool is empty until the
+ * first call to `zero_pool_refill()`.
+ */
+_init
+void zero_pool_setup(void)
+{
+    for (uint i = 0; i < MIGRATE_TYPES; i++) {
+        list_init(&zero_pool[i]);
+    }
+}
+
+/**
+ * @brief Print some debug information about the pre-zeroed page pool.
+ */
+void zero_pool_debug_info(void)
+{
+    debug("Zero pool: %u/%u/%u pages, %u hits, %u misses",
+        zero_pool_count[MIGRATE_UNMOVABLE],
+        zero_pool_count[MIGRATE_RECLAIMABLE],
+        zero_pool_count[MIGRATE_MOVABLE],
+        zero_pool_hits, zero_pool_misses);
+}
+
+/**
+ * @brief Take a pre-zeroed page from the pool. This function is called by the
+ * buddy allocator for single page requests with the `BUDDY_ZERO` flag. If the
+ * pool is empty, the request is counted as a miss and the caller must zero a
+ * page itself.
+ * 
+ * @param type The migrate type of the allocation.
+ * @return void* The zeroed page, or NULL if the pool is empty.
+ */
+void *zero_pool_get(uint type)
+{
+    assert(type < MIGRATE_TYPES);
+    struct list_head *entry = list_pop_head(&zero_pool[type]);
+    if (entry == NULL) {
+        zero_pool_misses++;
+        return NULL;
+    }
+
+    struct page *pg = list_entry(entry, struct page, list);
+    zero_pool_count[type]--;
+    zero_pool_hits++;
+    return (void *) paddr_to_vaddr(page_paddr(pg));
+}
+
+/**
+ * @brief Zero some free pages and add them to the pool. This function should
+ * be called when the CPU has nothing better to do, so that zeroing pages is
+ * moved out of the allocation path. The pool stops growing when it reaches
+ * its target size or when the free memory is below the high watermark, so
+ * that it never competes with the background reclaimer.
+ * 
+ * @param budget The maximum number of pages to zero.
+ * @return true if the pool still needs to be refilled.
+ * @return false if the pool is full or if no more memory can be used.
+ */
+bool zero_pool_refill(uint budget)
+{
+    // The contiguous memory area is never requested directly, so only the
+    // migrate types up to MIGRATE_MOVABLE need pre-zeroed pages.
+    for (uint type = 0; type <= MIGRATE_MOVABLE; type++) {
+        while (zero_pool_count[type] < ZERO_POOL_TARGET) {
+            if (budget == 0) {
+                return true;
+            } else if (buddy_below_watermark(BUDDY_WMARK_HIGH)) {
+                return false;
+            }
+
+            void *ptr = buddy_alloc(0, zero_pool_flags[type]);
+            if (ptr == NULL) {
+                return false;
+            }
+
+            struct page *pg = page_info((vaddr) ptr - KERNEL_VBASE);
+            memset(ptr, 0, PAGE_SIZE);
+            list_add_tail(&zero_pool[type], &pg->list);
+            zero_pool_count[type]++;
+            budget--;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Give all pages of the pool back to the buddy allocator. This is
+ * used when the buddy allocator cannot satisfy an allocation, since the
+ * pre-zeroed pages are only an optimization and must not cause an
+ * allocation failure.
+ * 
+ * @return uint The number of pages given back to the buddy allocator.
+ */
+uint zero_pool_drain(void)
+{
+    uint drained = 0;
+    for (uint type = 0; type < MIGRATE_TYPES; type++) {
+        struct list_head *entry;
+        while ((entry = list_pop_head(&zero_pool[type])) != NULL) {
+            struct page *pg = list_entry(entry, struct page, list);
+            buddy_free((void *) paddr_to_vaddr(page_paddr(pg)), 0);
+            drained++;
+        }
+        zero_pool_count[type] = 0;
+    }
+    return drained;
+}
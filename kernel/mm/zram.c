@@ -0,0 +1,291 @@
+/**
+ * Copyright (C) 2024 Romain CADILHAC
+ *
+ * This file is part of Kiwi
+ *
+ * Kiwi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kiwi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kiwi. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <memory.h>
+#include <lib/log.h>
+#include <lib/lz4.h>
+#include <lib/math.h>
+#include <lib/assert.h>
+#include <arch/cpu.h>
+#include <mm/page.h>
+#include <mm/zram.h>
+#include <mm/slub.h>
+#include <mm/buddy.h>
+#include <mm/vmalloc.h>
+
+/**
+ * @brief A slot of the compressed swap, storing one page. A page whose words
+ * all have the same value, like a zeroed page, only stores the value.
+ */
+struct zram_slot {
+    union {
+        /// The compressed page, or the copy of a page that does not compress.
+        void *data;
+
+        /// The value of all the words of a same-filled page.
+        u32 fill;
+
+        /// The next free slot, for a free slot.
+        u32 next_free;
+    };
+
+    /// The size of the compressed page, 0 for a same-filled page, and
+    /// PAGE_SIZE for a page stored uncompressed.
+    u16 size;
+
+    /// The number of page table entries referring to the slot, or 0 if the
+    /// slot is free.
+    u16 count;
+};
+
+/// The slots, allocated with `vmalloc()`. The slot 0 is never used, so that a
+/// slot number is never 0.
+static struct zram_slot *zram_slots = NULL;
+
+/// The first free slot, or 0 if all the slots are used.
+static u32 zram_free_slot = 0;
+
+/// The caches of the size classes of the compressed pages.
+static struct slub_cache *zram_classes[ZRAM_CLASSES] = {};
+
+/// The buffer where the pages are compressed before their size is known.
+static u8 zram_buffer[ZRAM_MAX_SIZE];
+
+/// The number of pages stored, of same-filled pages, and of pages stored
+/// uncompressed.
+static uint zram_pages = 0;
+static uint zram_same_pages = 0;
+static uint zram_huge_pages = 0;
+
+/// The number of bytes of the compressed pages, and of the memory used to
+/// store them, rounded to their size class.
+static u32 zram_compressed = 0;
+static u32 zram_used = 0;
+
+/// The number of pages that could not be stored.
+static uint zram_failures = 0;
+
+/// The latency of the page-ins: their number, the slowest one, and a
+/// histogram like the page fault latency histograms.
+static uint zram_loads = 0;
+static u32 zram_load_max = 0;
+static uint zram_load_histogram[ZRAM_LATENCY_BUCKETS] = {};
+
+/**
+ * @brief Setup the compressed swap. This function must be called after the
+ * virtual memory subsystem has been initialized.
+ */
+_init
+void zram_setup(void)
+{
+    zram_slots = vmalloc(ZRAM_SLOTS * sizeof(struct zram_slot));
+    if (zram_slots == NULL) {
+        panic("Failed to allocate the zram slots");
+    }
+
+    for (u32 i = 1; i < ZRAM_SLOTS; i++) {
+        zram_slots[i].next_free = (i + 1 < ZRAM_SLOTS) ? i + 1 : 0;
+        zram_slots[i].size = 0;
+        zram_slots[i].count = 0;
+    }
+    zram_free_slot = 1;
+
+    for (uint i = 0; i < ZRAM_CLASSES; i++) {
+        const u16 size = (i + 1) * ZRAM_CLASS_SIZE;
+        zram_classes[i] = slub_create_cache("zram", size, 0, 0, SLUB_NONE);
+        if (zram_classes[i] == NULL) {
+            panic("Failed to create the zram size classes");
+        }
+    }
+}
+
+/**
+ * @brief Print some debug information about the compressed swap, including
+ * the compression ratio and the page-in latency histogram.
+ */
+void zram_debug_info(void)
+{
+    // The sizes are converted to KiB first so that the ratio does not need a
+    // 64 bits division.
+    const u32 original = zram_pages * (PAGE_SIZE / 1024);
+    const u32 used = max(zram_used / 1024, 1u);
+    const u32 ratio = original * 100 / used;
+    debug("zram: %u pages (%u same-filled, %u uncompressed), %u failures",
+        zram_pages, zram_same_pages, zram_huge_pages, zram_failures);
+    debug("  %u KiB compressed to %u KiB (%u KiB used), ratio %u.%02u",
+        original, zram_compressed / 1024, zram_used / 1024, ratio / 100,
+        ratio % 100);
+    debug("  %u page-ins, max %u cycles", zram_loads, zram_load_max);
+    for (uint i = 0; i < ZRAM_LATENCY_BUCKETS; i++) {
+        if (zram_load_histogram[i] > 0) {
+            debug("      %u+ cycles: %u", 1u << i, zram_load_histogram[i]);
+        }
+    }
+}
+
+/**
+ * @brief Check if all the words of a page have the same value.
+ * 
+ * @param page The page.
+ * @param fill Set to the value of the words if they are all the same.
+ * @return true If the page is same-filled.
+ */
+static bool zram_same_filled(const u32 *page, u32 *fill)
+{
+    for (uint i = 1; i < PAGE_SIZE / sizeof(u32); i++) {
+        if (page[i] != page[0]) {
+            return false;
+        }
+    }
+    *fill = page[0];
+    return true;
+}
+
+/**
+ * @brief Store the content of a page in a slot. The page is compressed with
+ * LZ4 into a buffer of the smallest size class large enough, or copied into
+ * a whole page if it does not compress well enough.
+ * 
+ * @param page The page, in the low memory.
+ * @return u32 The slot, or 0 if there is no free slot or no memory left.
+ */
+u32 zram_store(const void *page)
+{
+    const u32 index = zram_free_slot;
+    if (index == 0) {
+        zram_failures++;
+        return 0;
+    }
+
+    struct zram_slot *slot = &zram_slots[index];
+    u32 fill;
+    if (zram_same_filled(page, &fill)) {
+        zram_free_slot = slot->next_free;
+        slot->fill = fill;
+        slot->size = 0;
+        slot->count = 1;
+        zram_same_pages++;
+        zram_pages++;
+        return index;
+    }
+
+    u32 size = lz4_compress(page, PAGE_SIZE, zram_buffer, ZRAM_MAX_SIZE);
+    void *data;
+    if (size == 0) {
+        size = PAGE_SIZE;
+        data = buddy_alloc(0, BUDDY_NONE);
+        if (data != NULL) {
+            memcpy(data, page, PAGE_SIZE);
+            zram_huge_pages++;
+        }
+    } else {
+        data = slub_alloc(zram_classes[(size - 1) / ZRAM_CLASS_SIZE]);
+        if (data != NULL) {
+            memcpy(data, zram_buffer, size);
+        }
+    }
+    if (data == NULL) {
+        zram_failures++;
+        return 0;
+    }
+
+    zram_free_slot = slot->next_free;
+    slot->data = data;
+    slot->size = size;
+    slot->count = 1;
+    zram_pages++;
+    zram_compressed += size;
+    zram_used += align_up(size, ZRAM_CLASS_SIZE);
+    return index;
+}
+
+/**
+ * @brief Restore the content of a page from a slot, and record the latency of
+ * the page-in. The slot is not released.
+ * 
+ * @param index The slot.
+ * @param page The page to fill, in the low memory.
+ */
+void zram_load(u32 index, void *page)
+{
+    assert(index > 0 && index < ZRAM_SLOTS && zram_slots[index].count > 0);
+    const u64 start = cpu_rdtsc();
+
+    struct zram_slot *slot = &zram_slots[index];
+    if (slot->size == 0) {
+        u32 *words = page;
+        for (uint i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+            words[i] = slot->fill;
+        }
+    } else if (slot->size == PAGE_SIZE) {
+        memcpy(page, slot->data, PAGE_SIZE);
+    } else if (lz4_decompress(slot->data, slot->size, page, PAGE_SIZE) !=
+        PAGE_SIZE) {
+        panic("zram: slot %u is corrupted", index);
+    }
+
+    const u64 elapsed = cpu_rdtsc() - start;
+    const u32 cycles = (elapsed > UINT32_MAX) ? UINT32_MAX : (u32) elapsed;
+    const uint bucket = 31 - __builtin_clz(cycles | 1);
+    zram_load_max = max(zram_load_max, cycles);
+    zram_load_histogram[min(bucket, (uint) ZRAM_LATENCY_BUCKETS - 1)]++;
+    zram_loads++;
+}
+
+/**
+ * @brief Add a reference to a slot, when a page table entry referring to it
+ * is copied.
+ * 
+ * @param index The slot.
+ */
+void zram_dup(u32 index)
+{
+    assert(index > 0 && index < ZRAM_SLOTS && zram_slots[index].count > 0);
+    zram_slots[index].count++;
+}
+
+/**
+ * @brief Drop a reference to a slot, and release the slot when it was the
+ * last one.
+ * 
+ * @param index The slot.
+ */
+void zram_free(u32 index)
+{
+    assert(index > 0 && index < ZRAM_SLOTS && zram_slots[index].count > 0);
+    struct zram_slot *slot = &zram_slots[index];
+    if (--slot->count > 0) {
+        return;
+    }
+
+    if (slot->size == 0) {
+        zram_same_pages--;
+    } else if (slot->size == PAGE_SIZE) {
+        buddy_free(slot->data, 0);
+        zram_huge_pages--;
+    } else {
+        slub_free(zram_classes[(slot->size - 1) / ZRAM_CLASS_SIZE],
+            slot->data);
+    }
+    zram_pages--;
+    zram_compressed -= slot->size;
+    zram_used -= align_up(slot->size, ZRAM_CLASS_SIZE);
+
+    slot->next_free = zram_free_slot;
+    zram_free_slot = index;
+}